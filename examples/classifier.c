@@ -15,7 +15,7 @@ float *get_regression_values(char **labels, int n)
     return v;
 }
 
-void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear)
+void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear, int dist)
 {
     int i;
 
@@ -37,6 +37,16 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     }
     srand(time(0));
     network *net = nets[0];
+    process_group *group = 0;
+    int rank = 0;
+    if(dist){
+        if(ngpus > 1) error("-dist trains one network per process");
+        group = make_process_group();
+        rank = process_group_rank(group);
+        attach_process_group(net, group);
+        // each rank draws its own images
+        srand(time(0) + rank);
+    }
 
     int imgs = net->batch * net->subdivisions * ngpus;
 
@@ -91,6 +101,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     data train;
     data buffer;
     pthread_t load_thread;
+    checkpointer *ckpt = make_checkpointer(2);
     args.d = &buffer;
     load_thread = load_data(args);
 
@@ -147,18 +158,25 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
             epoch = *net->seen/N;
             char buff[256];
             sprintf(buff, "%s/%s_%d.weights",backup_directory,base, epoch);
-            save_weights(net, buff);
+            if(rank == 0) checkpoint_weights(ckpt, net, buff);
         }
-        if(get_current_batch(net)%1000 == 0){
+        if(get_current_batch(net)%1000 == 0 && rank == 0){
             char buff[256];
             sprintf(buff, "%s/%s.backup",backup_directory,base);
-            save_weights(net, buff);
+            checkpoint_weights(ckpt, net, buff);
         }
     }
     char buff[256];
     sprintf(buff, "%s/%s.weights", backup_directory, base);
-    save_weights(net, buff);
+    if(rank == 0) checkpoint_weights(ckpt, net, buff);
     pthread_join(load_thread, 0);
+    flush_checkpoints(ckpt);
+    print_checkpoint_stats(ckpt, stderr);
+    free_checkpointer(ckpt);
+    if(group){
+        print_process_group_stats(group, stderr);
+        free_process_group(group);
+    }
 
     free_network(net);
     if(labels) free_ptrs((void**)labels, classes);
@@ -1066,6 +1084,7 @@ void run_classifier(int argc, char **argv)
     int cam_index = find_int_arg(argc, argv, "-c", 0);
     int top = find_int_arg(argc, argv, "-t", 0);
     int clear = find_arg(argc, argv, "-clear");
+    int dist = find_arg(argc, argv, "-dist");
     char *data = argv[3];
     char *cfg = argv[4];
     char *weights = (argc > 5) ? argv[5] : 0;
@@ -1075,7 +1094,7 @@ void run_classifier(int argc, char **argv)
     if(0==strcmp(argv[2], "predict")) predict_classifier(data, cfg, weights, filename, top);
     else if(0==strcmp(argv[2], "fout")) file_output_classifier(data, cfg, weights, filename);
     else if(0==strcmp(argv[2], "try")) try_classifier(data, cfg, weights, filename, atoi(layer_s));
-    else if(0==strcmp(argv[2], "train")) train_classifier(data, cfg, weights, gpus, ngpus, clear);
+    else if(0==strcmp(argv[2], "train")) train_classifier(data, cfg, weights, gpus, ngpus, clear, dist);
     else if(0==strcmp(argv[2], "demo")) demo_classifier(data, cfg, weights, cam_index, filename);
     else if(0==strcmp(argv[2], "gun")) gun_classifier(data, cfg, weights, cam_index, filename);
     else if(0==strcmp(argv[2], "threat")) threat_classifier(data, cfg, weights, cam_index, filename);
@@ -3,7 +3,7 @@
 static int coco_ids[] = {1,2,3,4,5,6,7,8,9,10,11,13,14,15,16,17,18,19,20,21,22,23,24,25,27,28,31,32,33,34,35,36,37,38,39,40,41,42,43,44,46,47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63,64,65,67,70,72,73,74,75,76,77,78,79,80,81,82,84,85,86,87,88,89,90};
 
 
-void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear)
+void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear, char *tracefile, int trace_batches, int dist)
 {
     list *options = read_data_cfg(datacfg);
     char *train_images = option_find_str(options, "train", "data/train.list");
@@ -24,10 +24,26 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
         cuda_set_device(gpus[i]);
 #endif
         nets[i] = load_network(cfgfile, weightfile, clear);
+#ifdef GPU
         nets[i]->learning_rate *= ngpus;
+#endif
     }
     srand(time(0));
     network *net = nets[0];
+#ifndef GPU
+    // on CPU the replicas average their gradients, so the rate stays as is
+    replica_group *replicas = (ngpus > 1) ? make_replica_group(nets, ngpus) : 0;
+#endif
+    process_group *group = 0;
+    int rank = 0;
+    if(dist){
+        if(ngpus > 1) error("-dist trains one network per process");
+        group = make_process_group();
+        rank = process_group_rank(group);
+        attach_process_group(net, group);
+        // each rank draws its own images
+        srand(time(0) + rank);
+    }
 
     int imgs = net->batch * net->subdivisions * ngpus;
     printf("Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
@@ -55,6 +71,12 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     //args.type = INSTANCE_DATA;
     args.threads = 64;
 
+    if(tracefile){
+        start_trace(tracefile);
+        trace_thread_name("train");
+    }
+    int traced = 0;
+    checkpointer *ckpt = make_checkpointer(2);
     pthread_t load_thread = load_data(args);
     double time;
     int count = 0;
@@ -81,7 +103,9 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             net = nets[0];
         }
         time=what_time_is_it_now();
+        if(trace_enabled) trace_begin("wait_data", "data", -1);
         pthread_join(load_thread, 0);
+        if(trace_enabled) trace_end();
         train = buffer;
         load_thread = load_data(args);
 
@@ -120,37 +144,53 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             loss = train_networks(nets, ngpus, train, 4);
         }
 #else
-        loss = train_network(net, train);
+        if(replicas){
+            loss = train_replicas(replicas, train);
+        } else {
+            loss = train_network(net, train);
+        }
 #endif
         if (avg_loss < 0) avg_loss = loss;
         avg_loss = avg_loss*.9 + loss*.1;
 
         i = get_current_batch(net);
         printf("%ld: %f, %f avg, %f rate, %lf seconds, %d images\n", get_current_batch(net), loss, avg_loss, get_current_rate(net), what_time_is_it_now()-time, i*imgs);
-        if(i%100==0){
+        if(i%100==0 && rank == 0){
 #ifdef GPU
             if(ngpus != 1) sync_nets(nets, ngpus, 0);
 #endif
             char buff[256];
             sprintf(buff, "%s/%s.backup", backup_directory, base);
-            save_weights(net, buff);
+            checkpoint_weights(ckpt, net, buff);
         }
-        if(i%10000==0 || (i < 1000 && i%100 == 0)){
+        if(rank == 0 && (i%10000==0 || (i < 1000 && i%100 == 0))){
 #ifdef GPU
             if(ngpus != 1) sync_nets(nets, ngpus, 0);
 #endif
             char buff[256];
             sprintf(buff, "%s/%s_%d.weights", backup_directory, base, i);
-            save_weights(net, buff);
+            checkpoint_weights(ckpt, net, buff);
         }
         free_data(train);
+        if(trace_enabled && ++traced == trace_batches) stop_trace();
     }
+    stop_trace();
 #ifdef GPU
     if(ngpus != 1) sync_nets(nets, ngpus, 0);
 #endif
     char buff[256];
     sprintf(buff, "%s/%s_final.weights", backup_directory, base);
-    save_weights(net, buff);
+    if(rank == 0) checkpoint_weights(ckpt, net, buff);
+    flush_checkpoints(ckpt);
+    print_checkpoint_stats(ckpt, stderr);
+    free_checkpointer(ckpt);
+#ifndef GPU
+    if(replicas) free_replica_group(replicas);
+#endif
+    if(group){
+        print_process_group_stats(group, stderr);
+        free_process_group(group);
+    }
 }
 
 
@@ -309,6 +349,7 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
         args.resized = &buf_resized[t];
         thr[t] = load_data_in_thread(args);
     }
+    detection_pool *pool = make_detection_pool(net);
     double start = what_time_is_it_now();
     for(i = nthreads; i < m+nthreads; i += nthreads){
         fprintf(stderr, "%d\n", i);
@@ -333,8 +374,8 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
             network_predict(net, input.data);
             int w = val[t].w;
             int h = val[t].h;
-            int num = 0;
-            detection *dets = get_network_boxes(net, w, h, thresh, .5, map, 0, &num);
+            int num = fill_detection_pool(pool, net, w, h, thresh, .5, map, 0);
+            detection *dets = pool->dets;
             if (nms) do_nms_sort(dets, num, classes, nms);
             if (coco){
                 print_cocos(fp, path, dets, num, classes, w, h);
@@ -343,12 +384,12 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
             } else {
                 print_detector_detections(fps, id, dets, num, classes, w, h);
             }
-            free_detections(dets, num);
             free(id);
             free_image(val[t]);
             free_image(val_resized[t]);
         }
     }
+    free_detection_pool(pool);
     for(j = 0; j < classes; ++j){
         if(fps) fclose(fps[j]);
     }
@@ -438,6 +479,7 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
         args.resized = &buf_resized[t];
         thr[t] = load_data_in_thread(args);
     }
+    detection_pool *pool = make_detection_pool(net);
     double start = what_time_is_it_now();
     for(i = nthreads; i < m+nthreads; i += nthreads){
         fprintf(stderr, "%d\n", i);
@@ -459,8 +501,8 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
             network_predict(net, X);
             int w = val[t].w;
             int h = val[t].h;
-            int nboxes = 0;
-            detection *dets = get_network_boxes(net, w, h, thresh, .5, map, 0, &nboxes);
+            int nboxes = fill_detection_pool(pool, net, w, h, thresh, .5, map, 0);
+            detection *dets = pool->dets;
             if (nms) do_nms_sort(dets, nboxes, classes, nms);
             if (coco){
                 print_cocos(fp, path, dets, nboxes, classes, w, h);
@@ -469,12 +511,12 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
             } else {
                 print_detector_detections(fps, id, dets, nboxes, classes, w, h);
             }
-            free_detections(dets, nboxes);
             free(id);
             free_image(val[t]);
             free_image(val_resized[t]);
         }
     }
+    free_detection_pool(pool);
     for(j = 0; j < classes; ++j){
         if(fps) fclose(fps[j]);
     }
@@ -568,6 +610,8 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     image **alphabet = load_alphabet();
     network *net = load_network(cfgfile, weightfile, 0);
     set_batch_network(net, 1);
+    net->fused_decode = 1;
+    detection_pool *pool = make_detection_pool(net);
     srand(2222222);
     double time;
     char buff[256];
@@ -580,7 +624,7 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
             printf("Enter Image Path: ");
             fflush(stdout);
             input = fgets(input, 256, stdin);
-            if(!input) return;
+            if(!input) break;
             strtok(input, "\n");
         }
         image im = load_image_color(input,0,0);
@@ -596,13 +640,12 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
         time=what_time_is_it_now();
         network_predict(net, X);
         printf("%s: Predicted in %f seconds.\n", input, what_time_is_it_now()-time);
-        int nboxes = 0;
-        detection *dets = get_network_boxes(net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes);
+        int nboxes = fill_detection_pool(pool, net, im.w, im.h, thresh, hier_thresh, 0, 1);
+        detection *dets = pool->dets;
         //printf("%d\n", nboxes);
         //if (nms) do_nms_obj(boxes, probs, l.w*l.h*l.n, l.classes, nms);
-        if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+        if (nms) do_nms_sort_fast(dets, nboxes, l.classes, nms);
         draw_detections(im, dets, nboxes, thresh, names, alphabet, l.classes);
-        free_detections(dets, nboxes);
         if(outfile){
             save_image(im, outfile);
         }
@@ -623,6 +666,7 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
         free_image(sized);
         if (filename) break;
     }
+    free_detection_pool(pool);
 }
 
 /*
@@ -826,12 +870,20 @@ void run_detector(int argc, char **argv)
         gpus = &gpu;
         ngpus = 1;
     }
+#ifndef GPU
+    // CPU builds train -replicas copies of the network on separate cores instead
+    ngpus = find_int_arg(argc, argv, "-replicas", 1);
+    if(ngpus < 1) ngpus = 1;
+#endif
 
     int clear = find_arg(argc, argv, "-clear");
     int fullscreen = find_arg(argc, argv, "-fullscreen");
     int width = find_int_arg(argc, argv, "-w", 0);
     int height = find_int_arg(argc, argv, "-h", 0);
     int fps = find_int_arg(argc, argv, "-fps", 0);
+    char *tracefile = find_char_arg(argc, argv, "-trace", 0);
+    int trace_batches = find_int_arg(argc, argv, "-trace_batches", 20);
+    int dist = find_arg(argc, argv, "-dist");
     //int class = find_int_arg(argc, argv, "-class", 0);
 
     char *datacfg = argv[3];
@@ -839,7 +891,7 @@ void run_detector(int argc, char **argv)
     char *weights = (argc > 5) ? argv[5] : 0;
     char *filename = (argc > 6) ? argv[6]: 0;
     if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen);
-    else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear);
+    else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear, tracefile, trace_batches, dist);
     else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "valid2")) validate_detector_flip(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "recall")) validate_detector_recall(cfg, weights);
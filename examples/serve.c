@@ -0,0 +1,518 @@
+#include "darknet.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Local detection server.  Clients talk over a Unix socket in host byte order:
+ *
+ *   request:  serve_request header, then length payload bytes
+ *             format 0 is packed 8 bit RGB, w*h*3 bytes
+ *             format 1 is an encoded image (jpeg, png, bmp, ...), w and h ignored
+ *   response: serve_response header, then count records of
+ *             float x, y, w, h (relative to the image), float objectness,
+ *             then top pairs of int32 class, float probability
+ *
+ * Requests on one connection may be pipelined.  Responses carry the request
+ * id and can come back out of order, since a pool of workers runs them and the
+ * per-model batcher groups them with requests from other connections. */
+
+#define SERVE_REQUEST_MAGIC  0x51524b44  /* "DKRQ" */
+#define SERVE_RESPONSE_MAGIC 0x53524b44  /* "DKRS" */
+#define SERVE_MAX_PAYLOAD (64 << 20)
+#define SERVE_MAX_TOP 16
+#define SERVE_QUEUE 1024
+
+enum{
+    SERVE_OK, SERVE_BAD_MODEL, SERVE_BAD_IMAGE, SERVE_BAD_REQUEST
+};
+
+typedef struct{
+    uint32_t magic;
+    uint32_t id;
+    uint16_t model;
+    uint16_t format;
+    uint32_t w;
+    uint32_t h;
+    float thresh;
+    float nms;
+    uint32_t top;
+    uint32_t length;
+} serve_request;
+
+typedef struct{
+    uint32_t magic;
+    uint32_t id;
+    int32_t status;
+    uint32_t count;
+    uint32_t top;
+} serve_response;
+
+typedef struct{
+    int fd;
+    int refs;
+    pthread_mutex_t write_mutex;
+} serve_conn;
+
+typedef struct{
+    serve_conn *conn;
+    serve_request req;
+    unsigned char *payload;
+} serve_job;
+
+typedef struct{
+    network *net;
+    batcher *batch;
+} serve_model;
+
+static serve_model *models;
+static int nmodels;
+
+static serve_job job_queue[SERVE_QUEUE];
+static int job_head, job_count;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_space = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int read_full(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    while(n){
+        ssize_t got = read(fd, p, n);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return 0;
+        p += got;
+        n -= got;
+    }
+    return 1;
+}
+
+static int write_full(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    while(n){
+        ssize_t sent = write(fd, p, n);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return 0;
+        p += sent;
+        n -= sent;
+    }
+    return 1;
+}
+
+static void release_conn(serve_conn *c)
+{
+    pthread_mutex_lock(&conn_mutex);
+    int last = (--c->refs == 0);
+    pthread_mutex_unlock(&conn_mutex);
+    if(!last) return;
+    close(c->fd);
+    pthread_mutex_destroy(&c->write_mutex);
+    free(c);
+}
+
+static void push_job(serve_job job)
+{
+    pthread_mutex_lock(&job_mutex);
+    while(job_count == SERVE_QUEUE) pthread_cond_wait(&job_space, &job_mutex);
+    job_queue[(job_head + job_count++) % SERVE_QUEUE] = job;
+    pthread_cond_signal(&job_ready);
+    pthread_mutex_unlock(&job_mutex);
+}
+
+static serve_job pop_job()
+{
+    pthread_mutex_lock(&job_mutex);
+    while(job_count == 0) pthread_cond_wait(&job_ready, &job_mutex);
+    serve_job job = job_queue[job_head];
+    job_head = (job_head + 1) % SERVE_QUEUE;
+    --job_count;
+    pthread_cond_signal(&job_space);
+    pthread_mutex_unlock(&job_mutex);
+    return job;
+}
+
+static image decode_request(serve_request req, unsigned char *payload)
+{
+    image none = {0};
+    if(req.format == 0){
+        if((size_t)req.w*req.h*3 != req.length || !req.w || !req.h) return none;
+        return load_image_bytes(payload, req.w, req.h, 3);
+    }
+    if(req.format == 1) return load_image_memory(payload, req.length, 3);
+    return none;
+}
+
+static int top_classes(detection d, int classes, int top, int *ids)
+{
+    int i, j, n = 0;
+    for(i = 0; i < classes; ++i){
+        float p = d.prob[i];
+        if(p <= 0) continue;
+        if(n < top) j = n++;
+        else if(p <= d.prob[ids[top-1]]) continue;
+        else j = top - 1;
+        for(; j > 0 && d.prob[ids[j-1]] < p; --j) ids[j] = ids[j-1];
+        ids[j] = i;
+    }
+    return n;
+}
+
+static void send_response(serve_conn *c, uint32_t id, int status, detection *dets, int nboxes, int classes, float thresh, int top)
+{
+    int i, k;
+    serve_response res = {SERVE_RESPONSE_MAGIC, id, status, 0, top};
+    size_t record = 5*sizeof(float) + top*(sizeof(int32_t) + sizeof(float));
+    unsigned char *body = calloc(nboxes ? nboxes : 1, record);
+    unsigned char *p = body;
+    int ids[SERVE_MAX_TOP];
+    for(i = 0; i < nboxes; ++i){
+        if(dets[i].objectness <= 0) continue;
+        int n = top_classes(dets[i], classes, top, ids);
+        if(n == 0 || dets[i].prob[ids[0]] < thresh) continue;
+        float box[5] = {dets[i].bbox.x, dets[i].bbox.y, dets[i].bbox.w, dets[i].bbox.h, dets[i].objectness};
+        memcpy(p, box, sizeof(box));
+        p += sizeof(box);
+        for(k = 0; k < top; ++k){
+            int32_t cls = k < n ? ids[k] : -1;
+            float prob = k < n ? dets[i].prob[ids[k]] : 0;
+            memcpy(p, &cls, sizeof(cls));
+            memcpy(p + sizeof(cls), &prob, sizeof(prob));
+            p += sizeof(cls) + sizeof(prob);
+        }
+        ++res.count;
+    }
+    pthread_mutex_lock(&c->write_mutex);
+    if(write_full(c->fd, &res, sizeof(res))) write_full(c->fd, body, p - body);
+    pthread_mutex_unlock(&c->write_mutex);
+    free(body);
+}
+
+static void *serve_worker(void *ptr)
+{
+    while(1){
+        serve_job job = pop_job();
+        serve_request req = job.req;
+        int top = req.top < 1 ? 1 : (req.top > SERVE_MAX_TOP ? SERVE_MAX_TOP : req.top);
+        if(req.model >= nmodels){
+            send_response(job.conn, req.id, SERVE_BAD_MODEL, 0, 0, 0, 0, top);
+        } else {
+            image im = decode_request(req, job.payload);
+            if(!im.data){
+                send_response(job.conn, req.id, SERVE_BAD_IMAGE, 0, 0, 0, 0, top);
+            } else {
+                serve_model m = models[req.model];
+                int nboxes = 0;
+                detection *dets = batcher_detect(m.batch, im, req.thresh, .5, req.nms, &nboxes);
+                layer l = m.net->layers[m.net->n - 1];
+                send_response(job.conn, req.id, SERVE_OK, dets, nboxes, l.classes, req.thresh, top);
+                free_detections(dets, nboxes);
+                free_image(im);
+            }
+        }
+        free(job.payload);
+        release_conn(job.conn);
+    }
+    return 0;
+}
+
+static void *serve_reader(void *ptr)
+{
+    serve_conn *c = ptr;
+    serve_request req;
+    while(read_full(c->fd, &req, sizeof(req))){
+        if(req.magic != SERVE_REQUEST_MAGIC || req.length > SERVE_MAX_PAYLOAD){
+            send_response(c, req.id, SERVE_BAD_REQUEST, 0, 0, 0, 0, 1);
+            break;
+        }
+        serve_job job = {c, req, malloc(req.length ? req.length : 1)};
+        if(!read_full(c->fd, job.payload, req.length)){
+            free(job.payload);
+            break;
+        }
+        pthread_mutex_lock(&conn_mutex);
+        ++c->refs;
+        pthread_mutex_unlock(&conn_mutex);
+        push_job(job);
+    }
+    shutdown(c->fd, SHUT_RD);
+    release_conn(c);
+    return 0;
+}
+
+static int open_socket(char *path, int listening)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) error("Socket path too long");
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) error("socket failed");
+    if(listening){
+        unlink(path);
+        if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) error(path);
+        if(listen(fd, 64) < 0) error("listen failed");
+    } else if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        error(path);
+    }
+    return fd;
+}
+
+void serve(char *path, char **cfgs, char **weights, int n, int workers, int max_batch, float delay)
+{
+    int i;
+    signal(SIGPIPE, SIG_IGN);
+    nmodels = n;
+    models = calloc(n, sizeof(serve_model));
+    for(i = 0; i < n; ++i){
+        models[i].net = load_network_custom(cfgs[i], weights[i], 0, max_batch);
+        models[i].batch = make_batcher(models[i].net, max_batch, delay);
+        if(!models[i].batch) error("Couldn't batch the model, a plan must be compiled for the batch size");
+        fprintf(stderr, "Model %d: %s %s, batch %d\n", i, cfgs[i], weights[i], max_batch);
+    }
+    for(i = 0; i < workers; ++i){
+        pthread_t thread;
+        if(pthread_create(&thread, 0, serve_worker, 0)) error("Thread creation failed");
+        pthread_detach(thread);
+    }
+    int fd = open_socket(path, 1);
+    fprintf(stderr, "Serving %d model%s on %s with %d workers\n", n, n == 1 ? "" : "s", path, workers);
+    while(1){
+        int client = accept(fd, 0, 0);
+        if(client < 0){
+            if(errno == EINTR) continue;
+            error("accept failed");
+        }
+        serve_conn *c = calloc(1, sizeof(serve_conn));
+        c->fd = client;
+        c->refs = 1;
+        pthread_mutex_init(&c->write_mutex, 0);
+        pthread_t thread;
+        if(pthread_create(&thread, 0, serve_reader, c)) error("Thread creation failed");
+        pthread_detach(thread);
+    }
+}
+
+static unsigned char *read_file_bytes(char *filename, int *len)
+{
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) error(filename);
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *buf = malloc(*len);
+    if(fread(buf, 1, *len, fp) != (size_t)*len) error(filename);
+    fclose(fp);
+    return buf;
+}
+
+typedef struct{
+    serve_request req;
+    unsigned char *payload;
+} serve_payload;
+
+/* Either the file as is, or decoded once here and sent as raw RGB. */
+static serve_payload make_payload(char *filename, int raw, int model, float thresh, int top)
+{
+    serve_payload p = {{SERVE_REQUEST_MAGIC, 0, model, raw ? 0 : 1, 0, 0, thresh, .45, top, 0}, 0};
+    int len;
+    p.payload = read_file_bytes(filename, &len);
+    if(raw){
+        image im = load_image_memory(p.payload, len, 3);
+        if(!im.data) error("Cannot decode image");
+        free(p.payload);
+        p.payload = malloc(im.w*im.h*3);
+        int i, k;
+        for(i = 0; i < im.w*im.h; ++i){
+            for(k = 0; k < 3; ++k) p.payload[i*3 + k] = (unsigned char)(255*im.data[i + k*im.w*im.h] + .5);
+        }
+        p.req.w = im.w;
+        p.req.h = im.h;
+        len = im.w*im.h*3;
+        free_image(im);
+    }
+    p.req.length = len;
+    return p;
+}
+
+static int send_request(int fd, serve_payload *p, uint32_t id)
+{
+    p->req.id = id;
+    return write_full(fd, &p->req, sizeof(p->req)) && write_full(fd, p->payload, p->req.length);
+}
+
+static int read_response(int fd, serve_response *res, unsigned char **body)
+{
+    if(!read_full(fd, res, sizeof(*res)) || res->magic != SERVE_RESPONSE_MAGIC) return 0;
+    size_t size = res->count*(5*sizeof(float) + res->top*(sizeof(int32_t) + sizeof(float)));
+    *body = realloc(*body, size ? size : 1);
+    return read_full(fd, *body, size);
+}
+
+void serve_client(char *path, char *filename, int raw, int model, float thresh, int top)
+{
+    int i, k;
+    serve_payload p = make_payload(filename, raw, model, thresh, top);
+    int fd = open_socket(path, 0);
+    serve_response res;
+    unsigned char *body = 0;
+    double start = what_time_is_it_now();
+    if(!send_request(fd, &p, 1) || !read_response(fd, &res, &body)) error("Server closed the connection");
+    printf("%s: status %d, %u detections in %f seconds\n", filename, res.status, res.count, what_time_is_it_now() - start);
+    unsigned char *q = body;
+    for(i = 0; i < res.count; ++i){
+        float box[5];
+        memcpy(box, q, sizeof(box));
+        q += sizeof(box);
+        printf("x %.3f y %.3f w %.3f h %.3f obj %.3f:", box[0], box[1], box[2], box[3], box[4]);
+        for(k = 0; k < res.top; ++k){
+            int32_t cls;
+            float prob;
+            memcpy(&cls, q, sizeof(cls));
+            memcpy(&prob, q + sizeof(cls), sizeof(prob));
+            q += sizeof(cls) + sizeof(prob);
+            if(cls >= 0) printf(" %d %.0f%%", cls, prob*100);
+        }
+        printf("\n");
+    }
+    free(body);
+    free(p.payload);
+    close(fd);
+}
+
+typedef struct{
+    char *path;
+    serve_payload *payload;
+    int requests;
+    int depth;
+    double *latency;    /* one per successful request, in the order they finished */
+    int ok;
+    int errors;
+} bench_args;
+
+/* One connection keeping depth requests in flight. */
+static void *bench_client(void *ptr)
+{
+    bench_args *a = ptr;
+    int fd = open_socket(a->path, 0);
+    double *sent = calloc(a->requests, sizeof(double));
+    unsigned char *body = 0;
+    int next = 0, done = 0;
+    serve_response res;
+    while(next < a->requests && next < a->depth){
+        sent[next] = what_time_is_it_now();
+        if(!send_request(fd, a->payload, next)) break;
+        ++next;
+    }
+    while(done < next){
+        if(!read_response(fd, &res, &body)) break;
+        if(res.status != SERVE_OK || res.id >= a->requests) ++a->errors;
+        else a->latency[a->ok++] = what_time_is_it_now() - sent[res.id];
+        ++done;
+        if(next < a->requests){
+            sent[next] = what_time_is_it_now();
+            if(send_request(fd, a->payload, next)) ++next;
+        }
+    }
+    a->errors += a->requests - done;
+    free(body);
+    free(sent);
+    close(fd);
+    return 0;
+}
+
+static int latency_comparator(const void *pa, const void *pb)
+{
+    double a = *(double *)pa;
+    double b = *(double *)pb;
+    return (a > b) - (a < b);
+}
+
+void serve_bench(char *path, char *filename, int raw, int model, int clients, int requests, int depth)
+{
+    int i;
+    serve_payload p = make_payload(filename, raw, model, .5, 1);
+    bench_args *args = calloc(clients, sizeof(bench_args));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    double *latency = calloc(clients*requests, sizeof(double));
+    double start = what_time_is_it_now();
+    for(i = 0; i < clients; ++i){
+        args[i].path = path;
+        args[i].payload = &p;
+        args[i].requests = requests;
+        args[i].depth = depth;
+        args[i].latency = latency + i*requests;
+        if(pthread_create(threads + i, 0, bench_client, args + i)) error("Thread creation failed");
+    }
+    int errors = 0, ok = 0;
+    for(i = 0; i < clients; ++i){
+        pthread_join(threads[i], 0);
+        errors += args[i].errors;
+    }
+    double elapsed = what_time_is_it_now() - start;
+    // failed requests have no latency, so only the successful ones are ranked
+    for(i = 0; i < clients; ++i){
+        memmove(latency + ok, args[i].latency, args[i].ok*sizeof(double));
+        ok += args[i].ok;
+    }
+    qsort(latency, ok, sizeof(double), latency_comparator);
+    printf("%d clients x %d requests, pipeline depth %d, %s payload of %u bytes\n",
+            clients, requests, depth, raw ? "raw" : "encoded", p.req.length);
+    printf("%d ok, %d errors, %f seconds, %.2f requests/sec\n", ok, errors, elapsed, ok/elapsed);
+    if(ok){
+        printf("Latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                1000*latency[ok/2], 1000*latency[ok*9/10], 1000*latency[ok*99/100], 1000*latency[ok-1]);
+    }
+    free(latency);
+    free(threads);
+    free(args);
+    free(p.payload);
+}
+
+void run_serve(int argc, char **argv)
+{
+    int raw = find_arg(argc, argv, "-raw");
+    int model = find_int_arg(argc, argv, "-model", 0);
+    float thresh = find_float_arg(argc, argv, "-thresh", .5);
+    int top = find_int_arg(argc, argv, "-top", 3);
+    if(0 == strcmp(argv[1], "serve")){
+        int workers = find_int_arg(argc, argv, "-workers", 8);
+        int max_batch = find_int_arg(argc, argv, "-batch", 4);
+        float delay = find_float_arg(argc, argv, "-delay", 5);
+        // the find_*_arg calls shift matched flags out and leave 0s at the end
+        while(argc > 0 && !argv[argc-1]) --argc;
+        if(argc < 5 || (argc - 3) % 2){
+            fprintf(stderr, "usage: %s serve [socket] [cfg] [weights] ([cfg] [weights] ...) [-workers n] [-batch n] [-delay ms]\n", argv[0]);
+            return;
+        }
+        int i, n = (argc - 3)/2;
+        char **cfgs = calloc(n, sizeof(char *));
+        char **weights = calloc(n, sizeof(char *));
+        for(i = 0; i < n; ++i){
+            cfgs[i] = argv[3 + 2*i];
+            weights[i] = argv[4 + 2*i];
+        }
+        serve(argv[2], cfgs, weights, n, workers, max_batch, delay/1000.);
+    } else if(0 == strcmp(argv[1], "serve_client")){
+        if(argc < 4){
+            fprintf(stderr, "usage: %s serve_client [socket] [image] [-model n] [-thresh t] [-top k] [-raw]\n", argv[0]);
+            return;
+        }
+        serve_client(argv[2], argv[3], raw, model, thresh, top);
+    } else if(0 == strcmp(argv[1], "serve_bench")){
+        int clients = find_int_arg(argc, argv, "-clients", 4);
+        int requests = find_int_arg(argc, argv, "-requests", 100);
+        int depth = find_int_arg(argc, argv, "-depth", 2);
+        if(argc < 4){
+            fprintf(stderr, "usage: %s serve_bench [socket] [image] [-clients n] [-requests n] [-depth n] [-model n] [-raw]\n", argv[0]);
+            return;
+        }
+        serve_bench(argv[2], argv[3], raw, model, clients, requests, depth);
+    }
+}
@@ -7,6 +7,9 @@
 
 #define SECRET_NUM -1234
 extern int gpu_index;
+extern int trace_enabled;
+// set in a thread to build networks without describing them on stderr
+extern __thread int quiet_build;
 
 #ifdef GPU
     #define BLOCK 512
@@ -104,6 +107,7 @@ typedef struct{
     float momentum;
     float decay;
     int adam;
+    int adamw;
     float B1;
     float B2;
     float eps;
@@ -116,6 +120,33 @@ typedef struct network network;
 struct layer;
 typedef struct layer layer;
 
+struct profiler;
+typedef struct profiler profiler;
+
+struct layer_scheduler;
+typedef struct layer_scheduler layer_scheduler;
+
+struct batcher;
+typedef struct batcher batcher;
+
+struct model_registry;
+typedef struct model_registry model_registry;
+
+struct checkpointer;
+typedef struct checkpointer checkpointer;
+
+struct replica_group;
+typedef struct replica_group replica_group;
+
+struct process_group;
+typedef struct process_group process_group;
+
+struct parameter_arena;
+typedef struct parameter_arena parameter_arena;
+
+struct recompute_plan;
+typedef struct recompute_plan recompute_plan;
+
 struct layer{
     LAYER_TYPE type;    // 网络层的类型，枚举类型，取值比如DROPOUT,CONVOLUTIONAL,MAXPOOL分别表示dropout层，卷积层，最大池化层，可参见LAYER_TYPE枚举类型的定义
     ACTIVATION activation;
@@ -219,6 +250,7 @@ struct layer{
 
     int onlyforward;
     int stopbackward;
+    int checkpoint;
     int dontload;
     int dontsave;
     int dontloadscales;
@@ -473,6 +505,7 @@ typedef struct network{
     int burn_in;
 
     int adam;
+    int adamw;
     float B1;
     float B2;
     float eps;
@@ -505,6 +538,16 @@ typedef struct network{
     int index;
     float *cost;
     float clip;
+    profiler *prof;
+    int parallel_layers;
+    layer_scheduler *sched;
+    void *weights_map;
+    size_t weights_map_size;
+    process_group *dist;
+    parameter_arena *arena;
+    int checkpoint;
+    recompute_plan *recompute;
+    int fused_decode;   /* yolo outputs are squashed by get_network_boxes at inference */
 
 #ifdef GPU
     float *input_gpu;
@@ -545,6 +588,19 @@ typedef struct detection{
     int sort_class;
 } detection;
 
+/* Detections reused from frame to frame: the records, their class scores
+ * and their masks are three blocks allocated once, so filling the pool
+ * for a new frame allocates nothing. */
+typedef struct detection_pool{
+    detection *dets;
+    float *probs;       /* capacity*classes scores, dets[i].prob is row i */
+    float *masks;       /* capacity*(coords-4), for region layers with masks */
+    int size;           /* detections found in the last fill */
+    int capacity;
+    int classes;
+    int coords;
+} detection_pool;
+
 typedef struct matrix{
     int rows, cols;
     float **vals;
@@ -605,6 +661,7 @@ typedef struct{
 
 
 network *load_network(char *cfg, char *weights, int clear);
+network *load_network_custom(char *cfg, char *weights, int clear, int batch);
 load_args get_base_args(network *net);
 
 void free_data(data d);
@@ -633,6 +690,26 @@ void forward_network(network *net);
 void backward_network(network *net);
 void update_network(network *net);
 
+network *make_network_instance(network *base);
+void free_network_instance(network *net);
+void set_network_parallel_layers(network *net, int n);
+void enable_network_profiler(network *net);
+int enable_network_counters(network *net);
+void reset_network_profiler(network *net);
+void print_network_profile(network *net, FILE *fp);
+void save_network_profile(network *net, char *filename);
+
+size_t network_memory(network *net, int batch, int train);
+void print_network_memory(network *net, int batch, FILE *fp);
+size_t heap_bytes();
+int layer_parameter_sizes(layer l, size_t *sizes);
+
+void start_trace(char *filename);
+void stop_trace();
+void trace_begin(const char *name, const char *cat, int arg);
+void trace_end();
+void trace_thread_name(const char *name);
+
 
 float dot_cpu(int N, float *X, int INCX, float *Y, int INCY);
 void axpy_cpu(int N, float ALPHA, float *X, int INCX, float *Y, int INCY);
@@ -699,8 +776,18 @@ int option_find_int(list *l, char *key, int def);
 int option_find_int_quiet(list *l, char *key, int def);
 
 network *parse_network_cfg(char *filename);
+network *parse_network_cfg_custom(char *filename, int batch, int init);
 void save_weights(network *net, char *filename);
 void load_weights(network *net, char *filename);
+void map_weights(network *net, char *filename);
+void save_weight_file(network *net, char *filename);
+void map_weight_file(network *net, char *filename);
+int is_weight_file(char *filename);
+void compile_network_plan(char *cfgfile, char *weightfile, char *planfile, int batch);
+network *load_network_plan(char *filename);
+int is_network_plan(char *filename);
+void codegen_network(char *cfgfile, char *weightfile, char *outfile, char *name, int embed, int verify);
+int verify_weight_file(char *filename);
 void save_weights_upto(network *net, char *filename, int cutoff);
 void load_weights_upto(network *net, char *filename, int start, int cutoff);
 
@@ -712,6 +799,8 @@ void set_batch_network(network *net, int b);
 void set_temp_network(network *net, float t);
 image load_image(char *filename, int w, int h, int c);
 image load_image_color(char *filename, int w, int h);
+image load_image_bytes(unsigned char *data, int w, int h, int c);
+image load_image_memory(unsigned char *buf, int len, int channels);
 image make_image(int w, int h, int c);
 image resize_image(image im, int w, int h);
 void censor_image(image im, int dx, int dy, int w, int h);
@@ -765,12 +854,48 @@ float *network_predict_image(network *net, image im);
 void network_detect(network *net, image im, float thresh, float hier_thresh, float nms, detection *dets);
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num);
 void free_detections(detection *dets, int n);
+detection_pool *make_detection_pool(network *net);
+int fill_detection_pool(detection_pool *p, network *net, int w, int h, float thresh, float hier, int *map, int relative);
+void free_detection_pool(detection_pool *p);
+batcher *make_batcher(network *net, int max_batch, double max_delay);
+detection *batcher_detect(batcher *b, image im, float thresh, float hier, float nms, int *nboxes);
+void print_batcher_stats(batcher *b, FILE *fp);
+void free_batcher(batcher *b);
+
+model_registry *make_model_registry(size_t budget);
+network *registry_acquire(model_registry *r, char *cfg, char *weights);
+void registry_release(model_registry *r, network *net);
+void print_registry_stats(model_registry *r, FILE *fp);
+void free_model_registry(model_registry *r);
+
+checkpointer *make_checkpointer(int max_pending);
+void checkpoint_weights(checkpointer *c, network *net, char *filename);
+void flush_checkpoints(checkpointer *c);
+void print_checkpoint_stats(checkpointer *c, FILE *fp);
+void free_checkpointer(checkpointer *c);
+
+replica_group *make_replica_group(network **nets, int n);
+float train_replicas(replica_group *g, data d);
+double replica_reduce_time(replica_group *g);
+void free_replica_group(replica_group *g);
+
+process_group *make_process_group();
+int process_group_rank(process_group *g);
+int process_group_size(process_group *g);
+void attach_process_group(network *net, process_group *g);
+void ring_all_reduce(process_group *g, float *x, size_t n);
+void ring_broadcast(process_group *g, void *data, size_t size);
+void print_process_group_stats(process_group *g, FILE *fp);
+void free_process_group(process_group *g);
 
 void reset_network_state(network *net, int b);
 
 char **get_labels(char *filename);
 void do_nms_obj(detection *dets, int total, int classes, float thresh);
 void do_nms_sort(detection *dets, int total, int classes, float thresh);
+void do_nms_obj_fast(detection *dets, int total, int classes, float thresh);
+void do_nms_sort_fast(detection *dets, int total, int classes, float thresh);
+void nms_report(int total, int classes, float thresh, float density, int rounds);
 
 matrix make_matrix(int rows, int cols);
 
@@ -4,6 +4,8 @@
 #include "cuda.h"
 #include "math.h"
 
+#define ACTIVATION_CHUNK (1<<14)    /* floats each thread activates at a time */
+
 ACTIVATION get_activation(char *s);
 
 char *get_activation_string(ACTIVATION a);
@@ -11,11 +13,38 @@ float activate(float x, ACTIVATION a);
 float gradient(float x, ACTIVATION a);
 void gradient_array(const float *x, const int n, const ACTIVATION a, float *delta);
 void activate_array(float *x, const int n, const ACTIVATION a);
+void add_bias_activate(float *x, const float *biases, int batch, int n, int size, ACTIVATION a);
 #ifdef GPU
 void activate_array_gpu(float *x, int n, ACTIVATION a);
 void gradient_array_gpu(float *x, int n, ACTIVATION a, float *delta);
 #endif
 
+/* exp() for the array kernels: 2^k from the exponent bits times a degree 6
+ * polynomial for e^r, |r| <= ln2/2 (the Cephes expf coefficients).  Plain
+ * arithmetic, so the array loops vectorize.  Built with -Ofast the relative
+ * error is 1e-7 near 0 and grows to 4e-6 past |x| = 70, less than moving x
+ * by one ulp changes e^x. */
+static inline float fast_exp(float x)
+{
+    union {float f; int i;} scale;
+    x = (x < -87.3f) ? -87.3f : (x > 88.3f) ? 88.3f : x;
+    int k = (int)(x*1.44269504f + ((x < 0) ? -.5f : .5f));
+    float r = x - k*.693359375f + k*2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p*r + 1.3981999507e-3f;
+    p = p*r + 8.3334519073e-3f;
+    p = p*r + 4.1665795894e-2f;
+    p = p*r + 1.6666665459e-1f;
+    p = p*r + 5.0000001201e-1f;
+    scale.i = (k + 127) << 23;
+    return (p*r*r + r + 1)*scale.f;
+}
+
+/* The logistic and tanh activate_array computes, for code that squashes
+ * values one at a time and has to agree with it. */
+static inline float fast_logistic(float x){return 1.f/(1.f + fast_exp(-x));}
+static inline float fast_tanh(float x){return 1.f - 2.f/(fast_exp(2*x) + 1.f);}
+
 static inline float stair_activate(float x)
 {
     int n = floor(x);
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "network.h"
+#include "image.h"
+#include "box.h"
+#include "utils.h"
+#include "trace.h"
+
+/* Collects single image detection requests from any number of threads and
+ * runs them through the network in batches.  A batch goes as soon as it has
+ * max_batch images or the oldest request has waited max_delay seconds, so
+ * under light load a request pays at most max_delay extra and under heavy
+ * load the network runs full batches.  Only the dispatcher thread touches the
+ * network. */
+
+#define BATCHER_SAMPLES 16384
+
+typedef struct batch_request{
+    image im;
+    float thresh;
+    float hier;
+    float nms;
+    double queued;
+    detection *dets;
+    int nboxes;
+    int done;
+    struct batch_request *next;
+} batch_request;
+
+struct batcher{
+    network *net;
+    int max_batch;
+    double max_delay;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    pthread_t thread;
+    batch_request *head;
+    batch_request *tail;
+    int pending;
+    int quit;
+
+    size_t requests;
+    size_t batches;
+    size_t *batch_sizes;
+    double *latency;
+};
+
+static void deadline_timespec(double t, struct timespec *ts)
+{
+    // what_time_is_it_now() reads CLOCK_REALTIME, the clock cond_timedwait uses
+    ts->tv_sec = (time_t)t;
+    ts->tv_nsec = (long)((t - ts->tv_sec)*1000000000.);
+}
+
+/* Letterboxes straight into the image's slot of net->input. */
+static void load_batch_input(network *net, batch_request **reqs, int n)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        image boxed = float_to_image(net->w, net->h, net->c, net->input + i*net->inputs);
+        fill_image(boxed, .5);
+        letterbox_image_into(reqs[i]->im, net->w, net->h, boxed);
+    }
+}
+
+/* get_network_boxes only reads the first image of a batch, so point a copy of
+ * the layers at image b.  Copies see batch 1 so the flipped-pair averaging
+ * that yolo and region layers do at batch 2 stays off. */
+static detection *batch_network_boxes(network *net, int b, batch_request *r)
+{
+    int i;
+    network view = *net;
+    view.layers = calloc(net->n, sizeof(layer));
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.output) l.output += b*l.outputs;
+        l.batch = 1;
+        view.layers[i] = l;
+    }
+    detection *dets = get_network_boxes(&view, r->im.w, r->im.h, r->thresh, r->hier, 0, 1, &r->nboxes);
+    free(view.layers);
+    if(r->nms) do_nms_sort_fast(dets, r->nboxes, net->layers[net->n-1].classes, r->nms);
+    return dets;
+}
+
+static void run_batch(batcher *b, batch_request **reqs, int n)
+{
+    int i;
+    network *net = b->net;
+    TRACE_BEGIN("batch", "batcher", -1);
+    set_batch_network(net, n);
+    load_batch_input(net, reqs, n);
+    network_predict(net, net->input);
+    for(i = 0; i < n; ++i) reqs[i]->dets = batch_network_boxes(net, i, reqs[i]);
+    TRACE_END();
+
+    double now = what_time_is_it_now();
+    pthread_mutex_lock(&b->mutex);
+    for(i = 0; i < n; ++i){
+        b->latency[b->requests++ % BATCHER_SAMPLES] = now - reqs[i]->queued;
+        reqs[i]->done = 1;
+    }
+    ++b->batches;
+    ++b->batch_sizes[n];
+    pthread_cond_broadcast(&b->finished);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+static void *batcher_thread(void *ptr)
+{
+    batcher *b = (batcher *)ptr;
+    batch_request **reqs = calloc(b->max_batch, sizeof(batch_request *));
+    TRACE_THREAD_NAME("batcher");
+    pthread_mutex_lock(&b->mutex);
+    while(1){
+        while(!b->quit && !b->head) pthread_cond_wait(&b->queued, &b->mutex);
+        if(!b->head) break;
+
+        struct timespec deadline;
+        deadline_timespec(b->head->queued + b->max_delay, &deadline);
+        while(!b->quit && b->pending < b->max_batch){
+            if(pthread_cond_timedwait(&b->queued, &b->mutex, &deadline) == ETIMEDOUT) break;
+        }
+
+        int n = 0;
+        while(b->head && n < b->max_batch){
+            reqs[n++] = b->head;
+            b->head = b->head->next;
+            --b->pending;
+        }
+        if(!b->head) b->tail = 0;
+        pthread_mutex_unlock(&b->mutex);
+        run_batch(b, reqs, n);
+        pthread_mutex_lock(&b->mutex);
+    }
+    pthread_mutex_unlock(&b->mutex);
+    free(reqs);
+    return 0;
+}
+
+/* Takes over net, which must have been built for at least max_batch images,
+ * e.g. by load_network_custom.  Returns 0 if it wasn't. */
+batcher *make_batcher(network *net, int max_batch, double max_delay)
+{
+    if(max_batch < 1) max_batch = 1;
+    if(net->batch < max_batch){
+        fprintf(stderr, "Batcher needs a network built for %d images, this one takes %d\n", max_batch, net->batch);
+        return 0;
+    }
+    batcher *b = calloc(1, sizeof(batcher));
+    b->net = net;
+    b->max_batch = max_batch;
+    b->max_delay = max_delay;
+    b->batch_sizes = calloc(max_batch + 1, sizeof(size_t));
+    b->latency = calloc(BATCHER_SAMPLES, sizeof(double));
+
+    // requests only ever read boxes back
+    net->fused_decode = 1;
+
+    pthread_mutex_init(&b->mutex, 0);
+    pthread_cond_init(&b->queued, 0);
+    pthread_cond_init(&b->finished, 0);
+    if(pthread_create(&b->thread, 0, batcher_thread, b)) error("Thread creation failed");
+    return b;
+}
+
+/* Blocks until the batch holding im has run.  Safe to call from any thread;
+ * the caller owns the returned detections and frees them with
+ * free_detections. */
+detection *batcher_detect(batcher *b, image im, float thresh, float hier, float nms, int *nboxes)
+{
+    batch_request r = {0};
+    r.im = im;
+    r.thresh = thresh;
+    r.hier = hier;
+    r.nms = nms;
+
+    pthread_mutex_lock(&b->mutex);
+    r.queued = what_time_is_it_now();
+    if(b->tail) b->tail->next = &r;
+    else b->head = &r;
+    b->tail = &r;
+    ++b->pending;
+    pthread_cond_signal(&b->queued);
+    while(!r.done) pthread_cond_wait(&b->finished, &b->mutex);
+    pthread_mutex_unlock(&b->mutex);
+
+    if(nboxes) *nboxes = r.nboxes;
+    return r.dets;
+}
+
+static int double_comparator(const void *pa, const void *pb)
+{
+    double a = *(double *)pa;
+    double b = *(double *)pb;
+    return (a > b) - (a < b);
+}
+
+void print_batcher_stats(batcher *b, FILE *fp)
+{
+    int i;
+    pthread_mutex_lock(&b->mutex);
+    size_t n = b->requests < BATCHER_SAMPLES ? b->requests : BATCHER_SAMPLES;
+    double *sorted = calloc(n ? n : 1, sizeof(double));
+    memcpy(sorted, b->latency, n*sizeof(double));
+    size_t requests = b->requests;
+    size_t batches = b->batches;
+    size_t *sizes = calloc(b->max_batch + 1, sizeof(size_t));
+    memcpy(sizes, b->batch_sizes, (b->max_batch + 1)*sizeof(size_t));
+    pthread_mutex_unlock(&b->mutex);
+
+    qsort(sorted, n, sizeof(double), double_comparator);
+    fprintf(fp, "Batcher: %lu requests in %lu batches, average batch %.2f of %d\n",
+            (unsigned long)requests, (unsigned long)batches, batches ? (double)requests/batches : 0, b->max_batch);
+    if(n){
+        fprintf(fp, "Latency over last %lu: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", (unsigned long)n,
+                1000*sorted[n/2], 1000*sorted[n*9/10], 1000*sorted[n*99/100], 1000*sorted[n-1]);
+    }
+    fprintf(fp, "Batch sizes:");
+    for(i = 1; i <= b->max_batch; ++i){
+        if(sizes[i]) fprintf(fp, " %d:%lu", i, (unsigned long)sizes[i]);
+    }
+    fprintf(fp, "\n");
+    free(sizes);
+    free(sorted);
+}
+
+/* Serves whatever is still queued, then stops the dispatcher.  The network
+ * is left to the caller. */
+void free_batcher(batcher *b)
+{
+    pthread_mutex_lock(&b->mutex);
+    b->quit = 1;
+    pthread_cond_signal(&b->queued);
+    pthread_mutex_unlock(&b->mutex);
+    pthread_join(b->thread, 0);
+    pthread_mutex_destroy(&b->mutex);
+    pthread_cond_destroy(&b->queued);
+    pthread_cond_destroy(&b->finished);
+    free(b->batch_sizes);
+    free(b->latency);
+    free(b);
+}
@@ -5,7 +5,7 @@
 
 layer make_batchnorm_layer(int batch, int w, int h, int c)
 {
-    fprintf(stderr, "Batch Normalization Layer: %d x %d x %d image\n", w,h,c);
+    if(!quiet_build) fprintf(stderr, "Batch Normalization Layer: %d x %d x %d image\n", w,h,c);
     layer l = {0};
     l.type = BATCHNORM;
     l.batch = batch;
@@ -28,12 +28,14 @@ layer make_batchnorm_layer(int batch, int w, int h, int c)
 
     l.mean = calloc(c, sizeof(float));
     l.variance = calloc(c, sizeof(float));
+    l.x_norm = calloc(h * w * c * batch, sizeof(float));
 
     l.rolling_mean = calloc(c, sizeof(float));
     l.rolling_variance = calloc(c, sizeof(float));
 
     l.forward = forward_batchnorm_layer;
     l.backward = backward_batchnorm_layer;
+    l.update = update_batchnorm_layer;
 #ifdef GPU
     l.forward_gpu = forward_batchnorm_layer_gpu;
     l.backward_gpu = backward_batchnorm_layer_gpu;
@@ -132,43 +134,157 @@ void resize_batchnorm_layer(layer *layer, int w, int h)
     fprintf(stderr, "Not implemented\n");
 }
 
+/* Mean and unbiased variance of every channel in a single read.  Each plane
+ * of a channel is summed around its first value, then the planes are merged
+ * with Chan's update of Welford's method, which keeps the variance accurate
+ * without a second pass over the data. */
+static void channel_statistics(float *x, int batch, int filters, int spatial, float *mean, float *variance)
+{
+    int f;
+    #pragma omp parallel for
+    for(f = 0; f < filters; ++f){
+        int b, i;
+        double n = 0, m = 0, m2 = 0;
+        for(b = 0; b < batch; ++b){
+            float *p = x + ((size_t)b*filters + f)*spatial;
+            float shift = p[0];
+            float sum = 0, squares = 0;
+            for(i = 0; i < spatial; ++i){
+                float d = p[i] - shift;
+                sum += d;
+                squares += d*d;
+            }
+            double pm = shift + (double)sum/spatial;
+            double pm2 = squares - (double)sum*sum/spatial;
+            double d = pm - m;
+            m += d*spatial/(n + spatial);
+            m2 += (pm2 > 0 ? pm2 : 0) + d*d*n*spatial/(n + spatial);
+            n += spatial;
+        }
+        mean[f] = m;
+        variance[f] = n > 1 ? m2/(n - 1) : 0;
+    }
+}
+
+/* Normalizes, scales and shifts in one sweep.  x_norm, when given, also gets
+ * the normalized values for the backward pass. */
+static void normalize_scale_shift(float *x, float *mean, float *variance, float *scales, float *biases,
+        int batch, int filters, int spatial, float *x_norm, float *y)
+{
+    int f;
+    #pragma omp parallel for
+    for(f = 0; f < filters; ++f){
+        int b, i;
+        float inv = 1./(sqrt(variance[f]) + .000001f);
+        float shift = -mean[f]*inv;
+        for(b = 0; b < batch; ++b){
+            size_t offset = ((size_t)b*filters + f)*spatial;
+            float *in = x + offset;
+            float *out = y + offset;
+            if(x_norm){
+                float *norm = x_norm + offset;
+                for(i = 0; i < spatial; ++i){
+                    float v = in[i]*inv + shift;
+                    norm[i] = v;
+                    out[i] = v*scales[f] + biases[f];
+                }
+            } else {
+                float a = inv*scales[f];
+                float c = shift*scales[f] + biases[f];
+                for(i = 0; i < spatial; ++i) out[i] = in[i]*a + c;
+            }
+        }
+    }
+}
+
 void forward_batchnorm_layer(layer l, network net)
 {
-    if(l.type == BATCHNORM) copy_cpu(l.outputs*l.batch, net.input, 1, l.output, 1);
-    copy_cpu(l.outputs*l.batch, l.output, 1, l.x, 1);
+    // a standalone batchnorm layer reads its input in place of a copy
+    float *x = (l.type == BATCHNORM) ? net.input : l.output;
+    int spatial = l.out_h*l.out_w;
     if(net.train){
-        mean_cpu(l.output, l.batch, l.out_c, l.out_h*l.out_w, l.mean);
-        variance_cpu(l.output, l.mean, l.batch, l.out_c, l.out_h*l.out_w, l.variance);
+        channel_statistics(x, l.batch, l.out_c, spatial, l.mean, l.variance);
 
         scal_cpu(l.out_c, .99, l.rolling_mean, 1);
         axpy_cpu(l.out_c, .01, l.mean, 1, l.rolling_mean, 1);
         scal_cpu(l.out_c, .99, l.rolling_variance, 1);
         axpy_cpu(l.out_c, .01, l.variance, 1, l.rolling_variance, 1);
 
-        normalize_cpu(l.output, l.mean, l.variance, l.batch, l.out_c, l.out_h*l.out_w);   
-        copy_cpu(l.outputs*l.batch, l.output, 1, l.x_norm, 1);
+        normalize_scale_shift(x, l.mean, l.variance, l.scales, l.biases, l.batch, l.out_c, spatial, l.x_norm, l.output);
     } else {
-        normalize_cpu(l.output, l.rolling_mean, l.rolling_variance, l.batch, l.out_c, l.out_h*l.out_w);
+        normalize_scale_shift(x, l.rolling_mean, l.rolling_variance, l.scales, l.biases, l.batch, l.out_c, spatial, 0, l.output);
     }
-    scale_bias(l.output, l.scales, l.batch, l.out_c, l.out_h*l.out_w);
-    add_bias(l.output, l.biases, l.batch, l.out_c, l.out_h*l.out_w);
 }
 
+/* Two sweeps over delta.  The first sums delta and delta*x_norm per channel,
+ * which give the bias and scale gradients and, since x - mean is x_norm
+ * times the forward's denominator, the mean and variance gradients too.  The
+ * second applies them, so the pre-normalization input is never needed.
+ * Outside training the statistics are constants and only the scaled delta
+ * passes through. */
 void backward_batchnorm_layer(layer l, network net)
 {
-    if(!net.train){
-        l.mean = l.rolling_mean;
-        l.variance = l.rolling_variance;
+    int spatial = l.out_h*l.out_w;
+    int n = l.batch*spatial;
+    float *dst = (l.type == BATCHNORM && net.delta) ? net.delta : l.delta;
+    int f;
+    #pragma omp parallel for
+    for(f = 0; f < l.out_c; ++f){
+        int b, i;
+        float sum = 0, dot = 0;
+        for(b = 0; b < l.batch; ++b){
+            size_t offset = ((size_t)b*l.out_c + f)*spatial;
+            float *d = l.delta + offset;
+            float *norm = l.x_norm + offset;
+            for(i = 0; i < spatial; ++i){
+                sum += d[i];
+                if(net.train) dot += d[i]*norm[i];
+            }
+        }
+        l.bias_updates[f] += sum;
+
+        float a, c = 0, k = 0;
+        if(net.train){
+            l.scale_updates[f] += dot;
+            float inv = 1./sqrt(l.variance[f] + .00001f);
+            float denom = sqrt(l.variance[f]) + .000001f;
+            float mean_delta = -l.scales[f]*sum*inv;
+            float variance_delta = -.5*l.scales[f]*dot*denom*pow(l.variance[f] + .00001f, (float)(-3./2.));
+            a = l.scales[f]*inv;
+            k = variance_delta*2.*denom/n;
+            c = mean_delta/n;
+        } else {
+            a = l.scales[f]/(sqrt(l.rolling_variance[f]) + .000001f);
+        }
+        for(b = 0; b < l.batch; ++b){
+            size_t offset = ((size_t)b*l.out_c + f)*spatial;
+            float *d = l.delta + offset;
+            float *out = dst + offset;
+            if(net.train){
+                float *norm = l.x_norm + offset;
+                for(i = 0; i < spatial; ++i) out[i] = d[i]*a + norm[i]*k + c;
+            } else {
+                for(i = 0; i < spatial; ++i) out[i] = d[i]*a;
+            }
+        }
     }
-    backward_bias(l.bias_updates, l.delta, l.batch, l.out_c, l.out_w*l.out_h);
-    backward_scale_cpu(l.x_norm, l.delta, l.batch, l.out_c, l.out_w*l.out_h, l.scale_updates);
+}
 
-    scale_bias(l.delta, l.scales, l.batch, l.out_c, l.out_h*l.out_w);
+/* The bias and scale step of update_convolutional_layer: there are no
+ * weights, so nothing is decayed. */
+void update_batchnorm_layer(layer l, update_args a)
+{
+    float learning_rate = a.learning_rate*l.learning_rate_scale;
+    if(a.adam && l.bias_m){
+        adam_update_cpu(l.biases, l.bias_updates, l.bias_m, l.bias_v, a.B1, a.B2, a.eps, 0, learning_rate, l.c, a.batch, a.t, a.adamw);
+        adam_update_cpu(l.scales, l.scale_updates, l.scale_m, l.scale_v, a.B1, a.B2, a.eps, 0, learning_rate, l.c, a.batch, a.t, a.adamw);
+        return;
+    }
+    axpy_cpu(l.c, learning_rate/a.batch, l.bias_updates, 1, l.biases, 1);
+    scal_cpu(l.c, a.momentum, l.bias_updates, 1);
 
-    mean_delta_cpu(l.delta, l.variance, l.batch, l.out_c, l.out_w*l.out_h, l.mean_delta);
-    variance_delta_cpu(l.x, l.delta, l.mean, l.variance, l.batch, l.out_c, l.out_w*l.out_h, l.variance_delta);
-    normalize_delta_cpu(l.x, l.mean, l.variance, l.mean_delta, l.variance_delta, l.batch, l.out_c, l.out_w*l.out_h, l.delta);
-    if(l.type == BATCHNORM) copy_cpu(l.outputs*l.batch, l.delta, 1, net.delta, 1);
+    axpy_cpu(l.c, learning_rate/a.batch, l.scale_updates, 1, l.scales, 1);
+    scal_cpu(l.c, a.momentum, l.scale_updates, 1);
 }
 
 #ifdef GPU
@@ -8,6 +8,7 @@
 layer make_batchnorm_layer(int batch, int w, int h, int c);
 void forward_batchnorm_layer(layer l, network net);
 void backward_batchnorm_layer(layer l, network net);
+void update_batchnorm_layer(layer l, update_args a);
 
 #ifdef GPU
 void forward_batchnorm_layer_gpu(layer l, network net);
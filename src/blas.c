@@ -187,6 +187,40 @@ void scal_cpu(int N, float ALPHA, float *X, int INCX)
     for(i = 0; i < N; ++i) X[i*INCX] *= ALPHA;
 }
 
+/* Decays DX by X, steps X along it and scales it by the momentum, in one
+ * pass instead of an axpy, an axpy and a scal. */
+void momentum_update_cpu(int N, float RATE, float MOMENTUM, float DECAY, float *X, float *DX)
+{
+    int i;
+    for(i = 0; i < N; ++i){
+        float d = DX[i] - DECAY*X[i];
+        X[i] += RATE*d;
+        DX[i] = MOMENTUM*d;
+    }
+}
+
+/* adam_update_gpu in one pass: folds the gradient into the moments, steps
+ * with their bias corrected ratio and clears the gradient.  Decoupled decay
+ * shrinks the weights directly, as AdamW does, instead of adding to the
+ * gradient. */
+void adam_update_cpu(float *w, float *d, float *m, float *v, float B1, float B2, float eps, float decay, float rate, int n, int batch, int t, int decoupled)
+{
+    int i;
+    float c1 = 1.f/(1.f - powf(B1, t));
+    float c2 = 1.f/(1.f - powf(B2, t));
+    float coupled = decoupled ? 0 : decay*batch;
+    float shrink = decoupled ? 1.f - rate*decay : 1.f;
+    for(i = 0; i < n; ++i){
+        float g = d[i] - coupled*w[i];
+        float mi = B1*m[i] + (1.f - B1)*g;
+        float vi = B2*v[i] + (1.f - B2)*g*g;
+        m[i] = mi;
+        v[i] = vi;
+        w[i] = shrink*w[i] + rate*(mi*c1)/(sqrtf(vi*c2) + eps);
+        d[i] = 0;
+    }
+}
+
 void fill_cpu(int N, float ALPHA, float *X, int INCX)
 {
     int i;
@@ -18,6 +18,8 @@ void const_cpu(int N, float ALPHA, float *X, int INCX);
 void constrain_gpu(int N, float ALPHA, float * X, int INCX);
 void pow_cpu(int N, float ALPHA, float *X, int INCX, float *Y, int INCY);
 void mul_cpu(int N, float *X, int INCX, float *Y, int INCY);
+void momentum_update_cpu(int N, float RATE, float MOMENTUM, float DECAY, float *X, float *DX);
+void adam_update_cpu(float *w, float *d, float *m, float *v, float B1, float B2, float eps, float decay, float rate, int n, int batch, int t, int decoupled);
 
 int test_gpu_blas();
 void shortcut_cpu(int batch, int w1, int h1, int c1, float *add, int w2, int h2, int c2, float s1, float s2, float *out);
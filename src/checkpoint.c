@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parser.h"
+#include "cuda.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Saves weights without holding up training.  checkpoint_weights serializes
+ * the network into memory, which is all the training thread waits for, and a
+ * writer thread puts the bytes on disk.  Each file is written to a temporary
+ * next to it, synced and renamed over the target, so a crash mid-write
+ * never leaves a torn checkpoint behind.  A snapshot still waiting for a file
+ * that a newer snapshot also targets is dropped, since only the newest of
+ * them would survive anyway.
+ *
+ * Snapshots after the first know their size, so they go straight into a
+ * buffer the writer has finished with instead of a stream that keeps
+ * growing, which keeps the stall close to one pass over the weights. */
+
+typedef struct checkpoint_job{
+    char *filename;
+    char *data;
+    size_t size;
+    struct checkpoint_job *next;
+} checkpoint_job;
+
+struct checkpointer{
+    int max_pending;
+    int pending;
+    int quit;
+    checkpoint_job *head;
+    checkpoint_job *tail;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    pthread_cond_t written;
+
+    int snapshots;
+    int written_files;
+    int superseded;
+    int failures;
+    double stall_time;
+    double max_stall;
+    double write_time;
+    double max_write;
+    size_t bytes;
+
+    size_t snapshot_size;
+    char *spare;
+};
+
+static int write_checkpoint(checkpoint_job *job)
+{
+    char *tmp = calloc(strlen(job->filename) + 5, sizeof(char));
+    sprintf(tmp, "%s.tmp", job->filename);
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp != 0;
+    if(ok) ok = fwrite(job->data, 1, job->size, fp) == job->size;
+    if(ok) ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if(fp && fclose(fp)) ok = 0;
+    if(ok) ok = rename(tmp, job->filename) == 0;
+    if(!ok){
+        fprintf(stderr, "Checkpoint %s failed: %s\n", job->filename, strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+static void free_job(checkpoint_job *job)
+{
+    free(job->filename);
+    free(job->data);
+    free(job);
+}
+
+static void *checkpoint_thread(void *ptr)
+{
+    checkpointer *c = ptr;
+    TRACE_THREAD_NAME("checkpoint");
+    pthread_mutex_lock(&c->mutex);
+    while(1){
+        while(!c->quit && !c->head) pthread_cond_wait(&c->queued, &c->mutex);
+        if(!c->head) break;
+        checkpoint_job *job = c->head;
+        c->head = job->next;
+        if(!c->head) c->tail = 0;
+        pthread_mutex_unlock(&c->mutex);
+
+        TRACE_BEGIN("write_checkpoint", "io", -1);
+        double start = what_time_is_it_now();
+        int ok = write_checkpoint(job);
+        double elapsed = what_time_is_it_now() - start;
+        TRACE_END();
+
+        pthread_mutex_lock(&c->mutex);
+        --c->pending;
+        if(ok){
+            ++c->written_files;
+            c->bytes += job->size;
+        } else {
+            ++c->failures;
+        }
+        c->write_time += elapsed;
+        if(elapsed > c->max_write) c->max_write = elapsed;
+        pthread_cond_broadcast(&c->written);
+        if(!c->spare && job->size == c->snapshot_size){
+            c->spare = job->data;
+            job->data = 0;
+        }
+        free_job(job);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
+/* At most max_pending snapshots wait in memory; past that checkpoint_weights
+ * blocks until the writer catches up. */
+checkpointer *make_checkpointer(int max_pending)
+{
+    checkpointer *c = calloc(1, sizeof(checkpointer));
+    c->max_pending = max_pending < 1 ? 1 : max_pending;
+    pthread_mutex_init(&c->mutex, 0);
+    pthread_cond_init(&c->queued, 0);
+    pthread_cond_init(&c->written, 0);
+    if(pthread_create(&c->thread, 0, checkpoint_thread, c)) error("Thread creation failed");
+    return c;
+}
+
+void checkpoint_weights(checkpointer *c, network *net, char *filename)
+{
+    double start = what_time_is_it_now();
+#ifdef GPU
+    if(net->gpu_index >= 0){
+        cuda_set_device(net->gpu_index);
+    }
+#endif
+    fprintf(stderr, "Saving weights to %s\n", filename);
+    TRACE_BEGIN("snapshot_weights", "io", -1);
+    checkpoint_job *job = calloc(1, sizeof(checkpoint_job));
+    job->filename = copy_string(filename);
+
+    pthread_mutex_lock(&c->mutex);
+    size_t expected = c->snapshot_size;
+    char *buffer = c->spare;
+    c->spare = 0;
+    pthread_mutex_unlock(&c->mutex);
+
+    if(expected){
+        // one spare byte for the terminator fmemopen insists on writing
+        if(!buffer) buffer = malloc(expected + 1);
+        FILE *fp = fmemopen(buffer, expected + 1, "wb");
+        if(!fp) error("Couldn't open snapshot stream");
+        save_weights_to_stream(net, fp, net->n);
+        long written = ftell(fp);
+        fclose(fp);
+        if(written == expected){
+            job->data = buffer;
+            job->size = expected;
+        } else {
+            free(buffer);
+        }
+    } else {
+        free(buffer);
+    }
+    if(!job->data){
+        // open_memstream also leaves room for a terminator, so the buffer can be reused as is
+        FILE *fp = open_memstream(&job->data, &job->size);
+        if(!fp) error("Couldn't open snapshot stream");
+        save_weights_to_stream(net, fp, net->n);
+        fclose(fp);
+    }
+    TRACE_END();
+
+    pthread_mutex_lock(&c->mutex);
+    c->snapshot_size = job->size;
+    checkpoint_job *j;
+    for(j = c->head; j; j = j->next){
+        if(0 == strcmp(j->filename, filename)){
+            // swap the newer bytes into the queued job, keeping its place
+            char *data = j->data;
+            j->data = job->data;
+            j->size = job->size;
+            job->data = data;
+            ++c->superseded;
+            break;
+        }
+    }
+    if(j){
+        free_job(job);
+    } else {
+        while(c->pending >= c->max_pending) pthread_cond_wait(&c->written, &c->mutex);
+        if(c->tail) c->tail->next = job;
+        else c->head = job;
+        c->tail = job;
+        ++c->pending;
+        pthread_cond_signal(&c->queued);
+    }
+    double stall = what_time_is_it_now() - start;
+    ++c->snapshots;
+    c->stall_time += stall;
+    if(stall > c->max_stall) c->max_stall = stall;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/* Blocks until everything queued so far is on disk. */
+void flush_checkpoints(checkpointer *c)
+{
+    pthread_mutex_lock(&c->mutex);
+    while(c->pending) pthread_cond_wait(&c->written, &c->mutex);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void print_checkpoint_stats(checkpointer *c, FILE *fp)
+{
+    pthread_mutex_lock(&c->mutex);
+    fprintf(fp, "Checkpoints: %d snapshots, %d written (%.1f MB), %d superseded, %d failed\n",
+            c->snapshots, c->written_files, c->bytes/(1024.*1024.), c->superseded, c->failures);
+    fprintf(fp, "Training stall: average %.2f ms, max %.2f ms; write: average %.2f ms, max %.2f ms\n",
+            c->snapshots ? 1000*c->stall_time/c->snapshots : 0, 1000*c->max_stall,
+            c->written_files + c->failures ? 1000*c->write_time/(c->written_files + c->failures) : 0, 1000*c->max_write);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/* Writes whatever is still queued before returning. */
+void free_checkpointer(checkpointer *c)
+{
+    pthread_mutex_lock(&c->mutex);
+    c->quit = 1;
+    pthread_cond_signal(&c->queued);
+    pthread_mutex_unlock(&c->mutex);
+    pthread_join(c->thread, 0);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->queued);
+    pthread_cond_destroy(&c->written);
+    free(c->spare);
+    free(c);
+}
@@ -0,0 +1,721 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "network.h"
+#include "utils.h"
+
+/* Writes a network's forward pass out as a standalone C file for batch 1.
+ * Every shape is a literal at its call site and the kernels are forced
+ * inline, so the compiler specializes each layer's loops for its sizes.
+ * Batchnorm is folded into the weights and biases, layer outputs share one
+ * static arena planned from when each output is last read, and the weights
+ * are either embedded in the source or loaded from a flat file written next
+ * to it.  Unless told otherwise the generated file is compiled with the main
+ * it carries and its outputs are checked against forward_network. */
+
+#define CODEGEN_MAGIC 0x47434b44  /* "DKCG" */
+#define CODEGEN_ALIGN 16          /* floats, so every array starts on 64 bytes */
+
+typedef struct{
+    network *net;
+    char *name;
+    char *macro;
+    int *value;
+    int *last_use;
+    int *is_output;
+    size_t *offset;
+    size_t arena;
+    size_t workspace;
+    float *weights;
+    size_t nweights;
+    size_t *weight_offset;
+    size_t *bias_offset;
+} codegen;
+
+static size_t align_floats(size_t n)
+{
+    return (n + CODEGEN_ALIGN - 1)/CODEGEN_ALIGN*CODEGEN_ALIGN;
+}
+
+static char *activation_expression(ACTIVATION a)
+{
+    switch(a){
+        case LOGISTIC:
+            return "1.f/(1.f + expf(-x))";
+        case LOGGY:
+            return "2.f/(1.f + expf(-x)) - 1";
+        case RELU:
+            return "x*(x>0)";
+        case ELU:
+            return "(x >= 0)*x + (x < 0)*(expf(x)-1)";
+        case RELIE:
+            return "(x>0) ? x : .01f*x";
+        case RAMP:
+            return "x*(x>0)+.1f*x";
+        case LEAKY:
+            return "(x>0) ? x : .1f*x";
+        case TANH:
+            return "tanhf(x)";
+        case LINEAR:
+            return "x";
+        default:
+            return 0;
+    }
+}
+
+static int has_weights(layer l)
+{
+    return l.type == CONVOLUTIONAL || l.type == DILATED_CONVOLUTIONAL || l.type == CONNECTED;
+}
+
+static int weight_count(layer l)
+{
+    return (l.type == CONNECTED) ? l.inputs*l.outputs : l.nweights;
+}
+
+static void check_supported(layer l, int i)
+{
+    char *reason = 0;
+    switch(l.type){
+        case CONVOLUTIONAL:
+        case DILATED_CONVOLUTIONAL:
+            if(l.binary || l.xnor) reason = "binary weights";
+            break;
+        case UPSAMPLE:
+            if(l.reverse) reason = "reverse upsampling";
+            break;
+        case SOFTMAX:
+            if(l.softmax_tree || l.spatial) reason = "tree or spatial softmax";
+            break;
+        case CONNECTED:
+        case SHORTCUT:
+        case MAXPOOL:
+        case AVGPOOL:
+        case ROUTE:
+        case YOLO:
+        case DROPOUT:
+            break;
+        default:
+            reason = "layer type";
+    }
+    if(!reason && (has_weights(l) || l.type == SHORTCUT) && !activation_expression(l.activation)){
+        reason = "activation";
+    }
+    if(reason){
+        fprintf(stderr, "codegen: layer %d (%s) is not supported: %s\n", i, get_layer_string(l.type), reason);
+        error("Can't generate code for this network");
+    }
+}
+
+/* Folds batchnorm into the filters:
+ *   (w*x - mean)/(sqrt(var) + .000001)*scale + bias = s*w*x + (bias - s*mean) */
+static void fold_weights(codegen *g)
+{
+    int i, f, j;
+    network *net = g->net;
+    size_t size = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!has_weights(l)) continue;
+        int filters = (l.type == CONNECTED) ? l.outputs : l.n;
+        size += align_floats(weight_count(l)) + align_floats(filters);
+    }
+    g->weights = calloc(size ? size : 1, sizeof(float));
+    g->nweights = size;
+
+    size_t offset = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!has_weights(l)) continue;
+        int filters = (l.type == CONNECTED) ? l.outputs : l.n;
+        int count = weight_count(l);
+        int per_filter = count/filters;
+        float *w = g->weights + offset;
+        float *b = w + align_floats(count);
+        memcpy(w, l.weights, count*sizeof(float));
+        memcpy(b, l.biases, filters*sizeof(float));
+        if(l.batch_normalize){
+            for(f = 0; f < filters; ++f){
+                float s = l.scales[f]/(sqrt(l.rolling_variance[f]) + .000001f);
+                for(j = 0; j < per_filter; ++j) w[f*per_filter + j] *= s;
+                b[f] = l.biases[f] - l.rolling_mean[f]*s;
+            }
+        }
+        g->weight_offset[i] = offset;
+        g->bias_offset[i] = offset + align_floats(count);
+        offset += align_floats(count) + align_floats(filters);
+    }
+}
+
+static void read_value(codegen *g, int value, int i)
+{
+    if(value >= 0 && g->last_use[value] < i) g->last_use[value] = i;
+}
+
+/* Dropout is a no-op at inference and keeps its input's buffer; everything
+ * else gets a slot in the arena at the lowest offset free for its lifetime.
+ * The yolo layers and the last layer are the outputs and stay put. */
+static void plan_memory(codegen *g)
+{
+    int i, j;
+    network *net = g->net;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        int input = i ? g->value[i-1] : -1;
+        g->value[i] = (l.type == DROPOUT) ? input : i;
+        g->last_use[i] = i;
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j) read_value(g, g->value[l.input_layers[j]], i);
+        } else {
+            read_value(g, input, i);
+        }
+        if(l.type == SHORTCUT) read_value(g, g->value[l.index], i);
+        if(has_weights(l) && l.size != 1 && l.type != CONNECTED){
+            size_t columns = (size_t)l.out_w*l.out_h*l.size*l.size*l.c/l.groups;
+            if(columns > g->workspace) g->workspace = columns;
+        }
+        if(l.type == YOLO || i == net->n - 1) g->is_output[i] = 1;
+    }
+    for(i = 0; i < net->n; ++i){
+        if(g->is_output[i] && g->value[i] >= 0) g->last_use[g->value[i]] = net->n;
+    }
+
+    for(i = 0; i < net->n; ++i){
+        if(g->value[i] != i) continue;
+        size_t size = align_floats(net->layers[i].outputs);
+        size_t offset = 0;
+        int moved = 1;
+        while(moved){
+            moved = 0;
+            for(j = 0; j < i; ++j){
+                if(g->value[j] != j || g->last_use[j] < i) continue;
+                size_t start = g->offset[j];
+                size_t end = start + align_floats(net->layers[j].outputs);
+                if(offset < end && start < offset + size){
+                    offset = end;
+                    moved = 1;
+                }
+            }
+        }
+        g->offset[i] = offset;
+        if(offset + size > g->arena) g->arena = offset + size;
+    }
+}
+
+static char *buffer(codegen *g, int value)
+{
+    static char names[4][256];
+    static int next = 0;
+    char *s = names[next];
+    next = (next + 1) % 4;
+    if(value < 0) sprintf(s, "input");
+    else sprintf(s, "%s_arena + %zu", g->name, g->offset[value]);
+    return s;
+}
+
+static void emit_activation(FILE *fp, ACTIVATION a, int n)
+{
+    if(a == LINEAR) return;
+    fprintf(fp, "        for(i = 0; i < %d; ++i){\n", n);
+    fprintf(fp, "            float x = out[i];\n");
+    fprintf(fp, "            out[i] = %s;\n", activation_expression(a));
+    fprintf(fp, "        }\n");
+}
+
+static void emit_preamble(FILE *fp, codegen *g, char *cfgfile, int embed)
+{
+    network *net = g->net;
+    int i, outputs = 0;
+    for(i = 0; i < net->n; ++i) outputs += g->is_output[i];
+
+    fprintf(fp, "/* Generated by darknet codegen from %s: %d layers, %dx%dx%d input, batch 1.\n", cfgfile, net->n, net->w, net->h, net->c);
+    fprintf(fp, " *\n");
+    if(!embed) fprintf(fp, " *   int %s_load(const char *filename);  weights written next to this file, 0 on success\n", g->name);
+    fprintf(fp, " *   void %s_forward(const float *input);  %s_INPUTS floats, laid out like a darknet image\n", g->name, g->macro);
+    fprintf(fp, " *   const float *%s_output(int i, int *size);  the yolo layers in order, then the last layer\n", g->name);
+    fprintf(fp, " *\n");
+    fprintf(fp, " * Build with -D%s_MAIN for a program that runs it on raw float files. */\n", g->macro);
+    fprintf(fp, "#ifdef %s_MAIN\n#define _POSIX_C_SOURCE 199309L\n#include <stdlib.h>\n#include <time.h>\n#endif\n", g->macro);
+    fprintf(fp, "#include <stdio.h>\n#include <string.h>\n#include <math.h>\n#include <float.h>\n\n");
+    fprintf(fp, "#define %s_W %d\n#define %s_H %d\n#define %s_C %d\n", g->macro, net->w, g->macro, net->h, g->macro, net->c);
+    fprintf(fp, "#define %s_INPUTS %d\n#define %s_OUTPUTS %d\n\n", g->macro, net->inputs, g->macro, outputs);
+
+    fprintf(fp,
+"#if defined(__GNUC__)\n"
+"#define KERNEL static inline __attribute__((always_inline))\n"
+"#define ALIGNED __attribute__((aligned(64)))\n"
+"#else\n"
+"#define KERNEL static inline\n"
+"#define ALIGNED\n"
+"#endif\n"
+"\n"
+"KERNEL void bias_fill(float *out, const float *biases, int n, int spatial)\n"
+"{\n"
+"    int i, j;\n"
+"    for(i = 0; i < n; ++i){\n"
+"        for(j = 0; j < spatial; ++j) out[i*spatial + j] = biases[i];\n"
+"    }\n"
+"}\n"
+"\n"
+"/* darknet's im2col, with the dilated layer's tap spacing: tap k of a\n"
+" * filter lands at (k+1)*dilation - 1. */\n"
+"KERNEL void im2col(const float *restrict im, int channels, int height, int width,\n"
+"        int size, int stride, int pad, int dilation, int out_h, int out_w, float *restrict col)\n"
+"{\n"
+"    int c, h, w;\n"
+"    for(c = 0; c < channels*size*size; ++c){\n"
+"        int w_offset = (c %% size + 1)*dilation - 1 - pad;\n"
+"        int h_offset = ((c / size) %% size + 1)*dilation - 1 - pad;\n"
+"        const float *channel = im + (c / size / size)*height*width;\n"
+"        for(h = 0; h < out_h; ++h){\n"
+"            int row = h_offset + h*stride;\n"
+"            float *dst = col + (c*out_h + h)*out_w;\n"
+"            for(w = 0; w < out_w; ++w){\n"
+"                int column = w_offset + w*stride;\n"
+"                dst[w] = (row < 0 || column < 0 || row >= height || column >= width) ? 0 : channel[row*width + column];\n"
+"            }\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void gemm_nn(int M, int N, int K, const float *restrict A, const float *restrict B, float *restrict C)\n"
+"{\n"
+"    int i, j, k;\n"
+"    for(i = 0; i < M; ++i){\n"
+"        for(k = 0; k < K; ++k){\n"
+"            float a = A[i*K + k];\n"
+"            for(j = 0; j < N; ++j) C[i*N + j] += a*B[k*N + j];\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void connected(const float *restrict in, const float *restrict weights, float *restrict out, int inputs, int outputs)\n"
+"{\n"
+"    int i, j;\n"
+"    for(j = 0; j < outputs; ++j){\n"
+"        float sum = 0;\n"
+"        for(i = 0; i < inputs; ++i) sum += in[i]*weights[j*inputs + i];\n"
+"        out[j] += sum;\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void maxpool(const float *restrict in, int c, int h, int w, int size, int stride, int pad,\n"
+"        int out_h, int out_w, float *restrict out)\n"
+"{\n"
+"    int k, i, j, n, m;\n"
+"    for(k = 0; k < c; ++k){\n"
+"        for(i = 0; i < out_h; ++i){\n"
+"            for(j = 0; j < out_w; ++j){\n"
+"                float max = -FLT_MAX;\n"
+"                for(n = 0; n < size; ++n){\n"
+"                    int row = i*stride + n - pad;\n"
+"                    if(row < 0 || row >= h) continue;\n"
+"                    for(m = 0; m < size; ++m){\n"
+"                        int column = j*stride + m - pad;\n"
+"                        if(column < 0 || column >= w) continue;\n"
+"                        float val = in[column + w*(row + h*k)];\n"
+"                        max = (val > max) ? val : max;\n"
+"                    }\n"
+"                }\n"
+"                out[j + out_w*(i + out_h*k)] = max;\n"
+"            }\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void avgpool(const float *restrict in, int c, int spatial, float *restrict out)\n"
+"{\n"
+"    int k, i;\n"
+"    for(k = 0; k < c; ++k){\n"
+"        float sum = 0;\n"
+"        for(i = 0; i < spatial; ++i) sum += in[k*spatial + i];\n"
+"        out[k] = sum/spatial;\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void upsample(const float *restrict in, int w, int h, int c, int stride, float scale, float *restrict out)\n"
+"{\n"
+"    int k, j, i;\n"
+"    for(k = 0; k < c; ++k){\n"
+"        for(j = 0; j < h*stride; ++j){\n"
+"            for(i = 0; i < w*stride; ++i){\n"
+"                out[k*w*h*stride*stride + j*w*stride + i] = scale*in[k*w*h + (j/stride)*w + i/stride];\n"
+"            }\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void shortcut(const float *restrict add, int w1, int h1, int c1, float *restrict out, int w2, int h2, int c2,\n"
+"        float s1, float s2)\n"
+"{\n"
+"    int stride = w1/w2 < 1 ? 1 : w1/w2;\n"
+"    int sample = w2/w1 < 1 ? 1 : w2/w1;\n"
+"    int minw = (w1 < w2) ? w1 : w2;\n"
+"    int minh = (h1 < h2) ? h1 : h2;\n"
+"    int minc = (c1 < c2) ? c1 : c2;\n"
+"    int i, j, k;\n"
+"    for(k = 0; k < minc; ++k){\n"
+"        for(j = 0; j < minh; ++j){\n"
+"            for(i = 0; i < minw; ++i){\n"
+"                int out_index = i*sample + w2*(j*sample + h2*k);\n"
+"                int add_index = i*stride + w1*(j*stride + h1*k);\n"
+"                out[out_index] = s1*out[out_index] + s2*add[add_index];\n"
+"            }\n"
+"        }\n"
+"    }\n"
+"}\n"
+"\n"
+"KERNEL void logistic(float *x, int n)\n"
+"{\n"
+"    int i;\n"
+"    for(i = 0; i < n; ++i) x[i] = 1.f/(1.f + expf(-x[i]));\n"
+"}\n"
+"\n"
+"KERNEL void softmax(const float *restrict in, int n, int groups, float temp, float *restrict out)\n"
+"{\n"
+"    int g, i;\n"
+"    for(g = 0; g < groups; ++g){\n"
+"        const float *x = in + g*n;\n"
+"        float *y = out + g*n;\n"
+"        float largest = -FLT_MAX, sum = 0;\n"
+"        for(i = 0; i < n; ++i) if(x[i] > largest) largest = x[i];\n"
+"        for(i = 0; i < n; ++i){\n"
+"            y[i] = expf(x[i]/temp - largest/temp);\n"
+"            sum += y[i];\n"
+"        }\n"
+"        for(i = 0; i < n; ++i) y[i] /= sum;\n"
+"    }\n"
+"}\n"
+"\n");
+    fprintf(fp, "static float %s_arena[%zu] ALIGNED;\n", g->name, g->arena);
+    fprintf(fp, "static float %s_workspace[%zu] ALIGNED;\n", g->name, g->workspace ? g->workspace : 1);
+}
+
+static void emit_weights(FILE *fp, codegen *g, int embed)
+{
+    size_t i;
+    if(!embed){
+        fprintf(fp, "static float %s_weights[%zu] ALIGNED;\n\n", g->name, g->nweights ? g->nweights : 1);
+        fprintf(fp, "int %s_load(const char *filename)\n{\n", g->name);
+        fprintf(fp, "    unsigned int header[2];\n");
+        fprintf(fp, "    FILE *fp = fopen(filename, \"rb\");\n");
+        fprintf(fp, "    if(!fp) return -1;\n");
+        fprintf(fp, "    int ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == 0x%x && header[1] == %zuu\n", CODEGEN_MAGIC, g->nweights);
+        fprintf(fp, "        && fread(%s_weights, sizeof(float), %zu, fp) == %zu;\n", g->name, g->nweights, g->nweights);
+        fprintf(fp, "    fclose(fp);\n");
+        fprintf(fp, "    return ok ? 0 : -1;\n}\n\n");
+        return;
+    }
+    fprintf(fp, "static const float %s_weights[%zu] ALIGNED = {", g->name, g->nweights ? g->nweights : 1);
+    for(i = 0; i < g->nweights; ++i){
+        if(i % 6 == 0) fprintf(fp, "\n   ");
+        fprintf(fp, " %af,", g->weights[i]);
+    }
+    if(!g->nweights) fprintf(fp, "0");
+    fprintf(fp, "\n};\n\n");
+}
+
+static void emit_layer(FILE *fp, codegen *g, int i)
+{
+    int j;
+    layer l = g->net->layers[i];
+    int input = i ? g->value[i-1] : -1;
+    char *name = g->name;
+
+    if(l.type == DROPOUT){
+        fprintf(fp, "    /* %d: dropout, nothing to do at inference */\n", i);
+        return;
+    }
+    fprintf(fp, "    {\n");
+    if(l.type == CONVOLUTIONAL || l.type == DILATED_CONVOLUTIONAL){
+        int dilation = (l.type == DILATED_CONVOLUTIONAL) ? l.dilate_rate : 1;
+        int m = l.n/l.groups;
+        int k = l.size*l.size*l.c/l.groups;
+        int n = l.out_w*l.out_h;
+        fprintf(fp, "        /* %d: %s %d %dx%d/%d", i, get_layer_string(l.type), l.n, l.size, l.size, l.stride);
+        if(dilation > 1) fprintf(fp, " dilation %d", dilation);
+        if(l.groups > 1) fprintf(fp, " groups %d", l.groups);
+        fprintf(fp, ", %dx%dx%d -> %dx%dx%d */\n", l.w, l.h, l.c, l.out_w, l.out_h, l.out_c);
+        fprintf(fp, "        const float *in = %s;\n", buffer(g, input));
+        fprintf(fp, "        float *out = %s;\n", buffer(g, i));
+        fprintf(fp, "        bias_fill(out, %s_weights + %zu, %d, %d);\n", name, g->bias_offset[i], l.n, n);
+        for(j = 0; j < l.groups; ++j){
+            int im = j*l.c/l.groups*l.h*l.w;
+            size_t weights = g->weight_offset[i] + j*l.nweights/l.groups;
+            if(l.size == 1){
+                // like forward_convolutional_layer, a 1x1 filter multiplies the input as it is
+                fprintf(fp, "        gemm_nn(%d, %d, %d, %s_weights + %zu, in + %d, out + %d);\n",
+                        m, n, k, name, weights, im, j*n*m);
+            } else {
+                fprintf(fp, "        im2col(in + %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %s_workspace);\n",
+                        im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, dilation, l.out_h, l.out_w, name);
+                fprintf(fp, "        gemm_nn(%d, %d, %d, %s_weights + %zu, %s_workspace, out + %d);\n",
+                        m, n, k, name, weights, name, j*n*m);
+            }
+        }
+        emit_activation(fp, l.activation, l.outputs);
+    } else if(l.type == CONNECTED){
+        fprintf(fp, "        /* %d: connected %d -> %d */\n", i, l.inputs, l.outputs);
+        fprintf(fp, "        const float *in = %s;\n", buffer(g, input));
+        fprintf(fp, "        float *out = %s;\n", buffer(g, i));
+        fprintf(fp, "        bias_fill(out, %s_weights + %zu, %d, 1);\n", name, g->bias_offset[i], l.outputs);
+        fprintf(fp, "        connected(in, %s_weights + %zu, out, %d, %d);\n", name, g->weight_offset[i], l.inputs, l.outputs);
+        emit_activation(fp, l.activation, l.outputs);
+    } else if(l.type == MAXPOOL){
+        fprintf(fp, "        /* %d: max %dx%d/%d, %dx%dx%d -> %dx%dx%d */\n", i, l.size, l.size, l.stride, l.w, l.h, l.c, l.out_w, l.out_h, l.out_c);
+        fprintf(fp, "        maxpool(%s, %d, %d, %d, %d, %d, %d, %d, %d, %s);\n",
+                buffer(g, input), l.c, l.h, l.w, l.size, l.stride, l.pad, l.out_h, l.out_w, buffer(g, i));
+    } else if(l.type == AVGPOOL){
+        fprintf(fp, "        /* %d: avg %dx%dx%d -> %d */\n", i, l.w, l.h, l.c, l.c);
+        fprintf(fp, "        avgpool(%s, %d, %d, %s);\n", buffer(g, input), l.c, l.h*l.w, buffer(g, i));
+    } else if(l.type == ROUTE){
+        int offset = 0;
+        fprintf(fp, "        /* %d: route", i);
+        for(j = 0; j < l.n; ++j) fprintf(fp, " %d", l.input_layers[j]);
+        fprintf(fp, " */\n");
+        for(j = 0; j < l.n; ++j){
+            fprintf(fp, "        memcpy(%s + %d, %s, %zu);\n", buffer(g, i), offset,
+                    buffer(g, g->value[l.input_layers[j]]), l.input_sizes[j]*sizeof(float));
+            offset += l.input_sizes[j];
+        }
+    } else if(l.type == SHORTCUT){
+        fprintf(fp, "        /* %d: shortcut from %d */\n", i, l.index);
+        fprintf(fp, "        float *out = %s;\n", buffer(g, i));
+        fprintf(fp, "        memcpy(out, %s, %zu);\n", buffer(g, input), l.outputs*sizeof(float));
+        fprintf(fp, "        shortcut(%s, %d, %d, %d, out, %d, %d, %d, %af, %af);\n",
+                buffer(g, g->value[l.index]), l.w, l.h, l.c, l.out_w, l.out_h, l.out_c, l.alpha, l.beta);
+        emit_activation(fp, l.activation, l.outputs);
+    } else if(l.type == UPSAMPLE){
+        fprintf(fp, "        /* %d: upsample %dx, %dx%dx%d -> %dx%dx%d */\n", i, l.stride, l.w, l.h, l.c, l.out_w, l.out_h, l.out_c);
+        fprintf(fp, "        upsample(%s, %d, %d, %d, %d, %af, %s);\n", buffer(g, input), l.w, l.h, l.c, l.stride, l.scale, buffer(g, i));
+    } else if(l.type == YOLO){
+        int entry = l.w*l.h;
+        fprintf(fp, "        /* %d: yolo %dx%d, %d anchors, %d classes */\n", i, l.w, l.h, l.n, l.classes);
+        fprintf(fp, "        float *out = %s;\n", buffer(g, i));
+        fprintf(fp, "        memcpy(out, %s, %zu);\n", buffer(g, input), l.outputs*sizeof(float));
+        for(j = 0; j < l.n; ++j){
+            int start = j*entry*(4 + l.classes + 1);
+            fprintf(fp, "        logistic(out + %d, %d);\n", start, 2*entry);
+            fprintf(fp, "        logistic(out + %d, %d);\n", start + 4*entry, (1 + l.classes)*entry);
+        }
+    } else if(l.type == SOFTMAX){
+        fprintf(fp, "        /* %d: softmax %d */\n", i, l.inputs);
+        fprintf(fp, "        softmax(%s, %d, %d, %af, %s);\n", buffer(g, input), l.inputs/l.groups, l.groups, l.temperature, buffer(g, i));
+    }
+    fprintf(fp, "    }\n");
+}
+
+static void emit_api(FILE *fp, codegen *g)
+{
+    int i, n = 0;
+    network *net = g->net;
+    int loops = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if((has_weights(l) || l.type == SHORTCUT) && l.activation != LINEAR) loops = 1;
+    }
+    fprintf(fp, "void %s_forward(const float *input)\n{\n", g->name);
+    if(loops) fprintf(fp, "    int i;\n");
+    for(i = 0; i < net->n; ++i) emit_layer(fp, g, i);
+    fprintf(fp, "}\n\n");
+
+    fprintf(fp, "const float *%s_output(int i, int *size)\n{\n    switch(i){\n", g->name);
+    for(i = 0; i < net->n; ++i){
+        if(!g->is_output[i]) continue;
+        fprintf(fp, "        case %d: *size = %d; return %s;\n", n++, net->layers[i].outputs, buffer(g, g->value[i]));
+    }
+    fprintf(fp, "    }\n    *size = 0;\n    return 0;\n}\n\n");
+}
+
+static void emit_main(FILE *fp, codegen *g, int embed)
+{
+    char *w = g->name;
+    char *usage = embed ? "input.raw output.raw [repeat]" : "weights input.raw output.raw [repeat]";
+    fprintf(fp, "#ifdef %s_MAIN\n", g->macro);
+    fprintf(fp, "static float %s_input[%s_INPUTS];\n\n", w, g->macro);
+    fprintf(fp, "int main(int argc, char **argv)\n{\n");
+    fprintf(fp, "    int i, arg = %d;\n", embed ? 1 : 2);
+    fprintf(fp, "    if(argc < arg + 2){\n        fprintf(stderr, \"usage: %%s %s\\n\", argv[0]);\n        return 1;\n    }\n", usage);
+    if(!embed) fprintf(fp, "    if(%s_load(argv[1])){\n        fprintf(stderr, \"Couldn't load %%s\\n\", argv[1]);\n        return 1;\n    }\n", w);
+    fprintf(fp, "    FILE *fp = fopen(argv[arg], \"rb\");\n");
+    fprintf(fp, "    if(!fp || fread(%s_input, sizeof(float), %s_INPUTS, fp) != %s_INPUTS){\n", w, g->macro, g->macro);
+    fprintf(fp, "        fprintf(stderr, \"Couldn't read %%d floats from %%s\\n\", %s_INPUTS, argv[arg]);\n        return 1;\n    }\n", g->macro);
+    fprintf(fp, "    fclose(fp);\n");
+    fprintf(fp, "    int repeat = (argc > arg + 2) ? atoi(argv[arg + 2]) : 1;\n");
+    fprintf(fp, "    if(repeat < 1) repeat = 1;\n");
+    fprintf(fp, "    struct timespec start, end;\n");
+    fprintf(fp, "    clock_gettime(CLOCK_MONOTONIC, &start);\n");
+    fprintf(fp, "    for(i = 0; i < repeat; ++i) %s_forward(%s_input);\n", w, w);
+    fprintf(fp, "    clock_gettime(CLOCK_MONOTONIC, &end);\n");
+    fprintf(fp, "    fprintf(stderr, \"%%.3f ms per forward\\n\", ((end.tv_sec - start.tv_sec)*1e3 + (end.tv_nsec - start.tv_nsec)/1e6)/repeat);\n");
+    fprintf(fp, "    fp = fopen(argv[arg + 1], \"wb\");\n");
+    fprintf(fp, "    if(!fp) return 1;\n");
+    fprintf(fp, "    for(i = 0; i < %s_OUTPUTS; ++i){\n", g->macro);
+    fprintf(fp, "        int size;\n");
+    fprintf(fp, "        const float *out = %s_output(i, &size);\n", w);
+    fprintf(fp, "        fwrite(out, sizeof(float), size, fp);\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    return fclose(fp) ? 1 : 0;\n}\n#endif\n");
+}
+
+static char *identifier(char *path)
+{
+    char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char *s = calloc(strlen(base) + 5, sizeof(char));
+    if(!isalpha((unsigned char)base[0]) && base[0] != '_') strcpy(s, "net_");
+    char *p = s + strlen(s);
+    for(; *base && *base != '.'; ++base) *p++ = isalnum((unsigned char)*base) ? *base : '_';
+    return s;
+}
+
+/* The build uses -Ofast, which folds isnan, isinf and x != x away, so
+ * this looks for the all ones exponent of a NaN or infinity in the bits. */
+static int is_finite_bits(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return ((bits >> 23) & 0xff) != 0xff;
+}
+
+/* Runs forward_network and the generated program on the same input and
+ * compares every output.  A NaN or infinity on either side fails. */
+static void verify_codegen(codegen *g, char *source, char *binary, char *weightsfile)
+{
+    int i, j;
+    network *net = g->net;
+    char input[4096], output[4096], command[16384];
+    snprintf(input, sizeof(input), "%s.input", binary);
+    snprintf(output, sizeof(output), "%s.output", binary);
+
+    char *cc = getenv("CC");
+    snprintf(command, sizeof(command), "%s -O3 -march=native -D%s_MAIN -o %s %s -lm", cc ? cc : "cc", g->macro, binary, source);
+    fprintf(stderr, "%s\n", command);
+    if(system(command)) error("Couldn't compile the generated code");
+
+    float *X = calloc(net->inputs, sizeof(float));
+    srand(2222222);
+    for(i = 0; i < net->inputs; ++i) X[i] = rand_uniform(0, 1);
+    FILE *fp = fopen(input, "wb");
+    if(!fp) file_error(input);
+    fwrite(X, sizeof(float), net->inputs, fp);
+    fclose(fp);
+
+    int repeat = 5;
+    network_predict(net, X);
+    double start = what_time_is_it_now();
+    for(i = 0; i < repeat; ++i) network_predict(net, X);
+    double reference = (what_time_is_it_now() - start)/repeat;
+
+    snprintf(command, sizeof(command), "%s%s %s%s%s %s %d", strchr(binary, '/') ? "" : "./", binary,
+            weightsfile ? weightsfile : "", weightsfile ? " " : "", input, output, repeat);
+    fprintf(stderr, "%s\n", command);
+    if(system(command)) error("The generated program failed");
+
+    fp = fopen(output, "rb");
+    if(!fp) file_error(output);
+    size_t count = 0;
+    float max_error = 0;
+    int failed = 0;
+    for(i = 0; i < net->n; ++i){
+        if(!g->is_output[i]) continue;
+        layer l = net->layers[i];
+        float *got = calloc(l.outputs, sizeof(float));
+        if(fread(got, sizeof(float), l.outputs, fp) != (size_t)l.outputs) error("Generated program wrote too little");
+        for(j = 0; j < l.outputs; ++j){
+            int finite = is_finite_bits(got[j]) && is_finite_bits(l.output[j]);
+            float diff = finite ? fabs(got[j] - l.output[j]) : 0;
+            if(diff > max_error) max_error = diff;
+            if(!finite || diff > 1e-3 + 1e-3*fabs(l.output[j])){
+                if(!failed) fprintf(stderr, "First mismatch at layer %d output %d (index %zu of the outputs compared): generated %f, forward_network %f\n",
+                        i, j, count + j, got[j], l.output[j]);
+                ++failed;
+            }
+        }
+        count += l.outputs;
+        free(got);
+    }
+    fclose(fp);
+    unlink(input);
+    unlink(output);
+    free(X);
+
+    fprintf(stderr, "forward_network: %.3f ms per forward\n", 1000*reference);
+    fprintf(stderr, "Compared %zu outputs against forward_network: max difference %g, %d out of tolerance or not finite\n", count, max_error, failed);
+    if(failed) error("Generated code does not match forward_network");
+}
+
+void codegen_network(char *cfgfile, char *weightfile, char *outfile, char *name, int embed, int verify)
+{
+    int i;
+    network *net = load_network(cfgfile, weightfile, 0);
+    set_batch_network(net, 1);
+    for(i = 0; i < net->n; ++i) check_supported(net->layers[i], i);
+
+    codegen g = {0};
+    g.net = net;
+    g.name = name ? copy_string(name) : identifier(outfile);
+    g.macro = copy_string(g.name);
+    for(i = 0; g.macro[i]; ++i) g.macro[i] = toupper((unsigned char)g.macro[i]);
+    g.value = calloc(net->n, sizeof(int));
+    g.last_use = calloc(net->n, sizeof(int));
+    g.is_output = calloc(net->n, sizeof(int));
+    g.offset = calloc(net->n, sizeof(size_t));
+    g.weight_offset = calloc(net->n, sizeof(size_t));
+    g.bias_offset = calloc(net->n, sizeof(size_t));
+    fold_weights(&g);
+    plan_memory(&g);
+
+    // out.c builds into out, with its weights in out.dat
+    char *base = copy_string(outfile);
+    size_t length = strlen(base);
+    if(length > 2 && 0 == strcmp(base + length - 2, ".c")) base[length - 2] = 0;
+    else strcat(base = realloc(base, length + 5), ".out");
+    char *weightsfile = 0;
+    if(!embed){
+        weightsfile = calloc(strlen(base) + 5, sizeof(char));
+        sprintf(weightsfile, "%s.dat", base);
+        FILE *fp = fopen(weightsfile, "wb");
+        if(!fp) file_error(weightsfile);
+        uint32_t header[2] = {CODEGEN_MAGIC, g.nweights};
+        fwrite(header, sizeof(header), 1, fp);
+        fwrite(g.weights, sizeof(float), g.nweights, fp);
+        if(fclose(fp)) file_error(weightsfile);
+    }
+
+    FILE *fp = fopen(outfile, "w");
+    if(!fp) file_error(outfile);
+    emit_preamble(fp, &g, cfgfile, embed);
+    emit_weights(fp, &g, embed);
+    emit_api(fp, &g);
+    emit_main(fp, &g, embed);
+    if(fclose(fp)) file_error(outfile);
+
+    size_t activations = 0;
+    for(i = 0; i < net->n; ++i) if(g.value[i] == i) activations += net->layers[i].outputs;
+    fprintf(stderr, "Generated %s (%s_forward): %d layers, arena %.1f MB for %.1f MB of layer outputs, workspace %.1f MB, %.1f MB of weights%s\n",
+            outfile, g.name, net->n, g.arena*sizeof(float)/(1024.*1024.), activations*sizeof(float)/(1024.*1024.),
+            g.workspace*sizeof(float)/(1024.*1024.), g.nweights*sizeof(float)/(1024.*1024.),
+            embed ? " embedded" : "");
+    if(weightsfile) fprintf(stderr, "Weights in %s\n", weightsfile);
+
+    if(verify) verify_codegen(&g, outfile, base, weightsfile);
+
+    free(base);
+    free(weightsfile);
+    free(g.name);
+    free(g.macro);
+    free(g.value);
+    free(g.last_use);
+    free(g.is_output);
+    free(g.offset);
+    free(g.weight_offset);
+    free(g.bias_offset);
+    free(g.weights);
+    free_network(net);
+}
@@ -11,7 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize, int adam)
+layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize, int adam, int init)
 {
     int i;
     layer l = {0};
@@ -44,7 +44,7 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
 
     //float scale = 1./sqrt(inputs);
     float scale = sqrt(2./inputs);
-    for(i = 0; i < outputs*inputs; ++i){
+    for(i = 0; i < outputs*inputs && init; ++i){
         l.weights[i] = scale*rand_uniform(-1, 1);
     }
 
@@ -75,7 +75,6 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
         l.rolling_mean = calloc(outputs, sizeof(float));
         l.rolling_variance = calloc(outputs, sizeof(float));
 
-        l.x = calloc(batch*outputs, sizeof(float));
         l.x_norm = calloc(batch*outputs, sizeof(float));
     }
 
@@ -125,7 +124,7 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
     }
 #endif
     l.activation = activation;
-    fprintf(stderr, "connected                            %4d  ->  %4d\n", inputs, outputs);
+    if(!quiet_build) fprintf(stderr, "connected                            %4d  ->  %4d\n", inputs, outputs);
     return l;
 }
 
@@ -135,6 +134,17 @@ void update_connected_layer(layer l, update_args a)
     float momentum = a.momentum;
     float decay = a.decay;
     int batch = a.batch;
+
+    if(a.adam && l.m){
+        float bias_decay = a.adamw ? 0 : decay;
+        adam_update_cpu(l.weights, l.weight_updates, l.m, l.v, a.B1, a.B2, a.eps, decay, learning_rate, l.inputs*l.outputs, batch, a.t, a.adamw);
+        adam_update_cpu(l.biases, l.bias_updates, l.bias_m, l.bias_v, a.B1, a.B2, a.eps, bias_decay, learning_rate, l.outputs, batch, a.t, a.adamw);
+        if(l.batch_normalize){
+            adam_update_cpu(l.scales, l.scale_updates, l.scale_m, l.scale_v, a.B1, a.B2, a.eps, bias_decay, learning_rate, l.outputs, batch, a.t, a.adamw);
+        }
+        return;
+    }
+
     axpy_cpu(l.outputs, learning_rate/batch, l.bias_updates, 1, l.biases, 1);
     scal_cpu(l.outputs, momentum, l.bias_updates, 1);
 
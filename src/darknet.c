@@ -3,6 +3,9 @@
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 extern void predict_classifier(char *datacfg, char *cfgfile, char *weightfile, char *filename, int top);
 extern void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen);
@@ -21,6 +24,7 @@ extern void run_go(int argc, char **argv);
 extern void run_art(int argc, char **argv);
 extern void run_super(int argc, char **argv);
 extern void run_lsd(int argc, char **argv);
+extern void run_serve(int argc, char **argv);
 
 void average(int argc, char *argv[])
 {
@@ -113,16 +117,25 @@ long numops(network *net)
     return ops;
 }
 
-void speed(char *cfgfile, int tics)
+void speed(char *cfgfile, int tics, int profile, int counters, int train, char *csv, int parallel)
 {
     if (tics == 0) tics = 1000;
     network *net = parse_network_cfg(cfgfile);
     set_batch_network(net, 1);
+    if(train) net->subdivisions = 1;
+    if(parallel) set_network_parallel_layers(net, parallel);
+    if(profile || csv) enable_network_profiler(net);
+    if(counters) enable_network_counters(net);
     int i;
     double time=what_time_is_it_now();
     image im = make_image(net->w, net->h, net->c*net->batch);
     for(i = 0; i < tics; ++i){
-        network_predict(net, im.data);
+        if(train){
+            memcpy(net->input, im.data, net->inputs*net->batch*sizeof(float));
+            train_network_datum(net);
+        } else {
+            network_predict(net, im.data);
+        }
     }
     double t = what_time_is_it_now() - time;
     long ops = numops(net);
@@ -131,6 +144,10 @@ void speed(char *cfgfile, int tics)
     printf("FLOPS: %.2f Bn\n", (float)ops/1000000000.*tics/t);
     printf("Speed: %f sec/eval\n", t/tics);
     printf("Speed: %f Hz\n", tics/t);
+    if(net->prof){
+        print_network_profile(net, stdout);
+        if(csv) save_network_profile(net, csv);
+    }
 }
 
 void operations(char *cfgfile)
@@ -188,6 +205,43 @@ void partial(char *cfgfile, char *weightfile, char *outfile, int max)
     save_weights_upto(net, outfile, max);
 }
 
+/* Legacy .weights in, indexed weight file out, or the other way around,
+ * depending on what weightfile is. */
+void convert_weights(char *cfgfile, char *weightfile, char *outfile)
+{
+    gpu_index = -1;
+    network *net = load_network(cfgfile, weightfile, 0);
+    if(is_weight_file(weightfile)){
+        save_weights(net, outfile);
+    } else {
+        save_weight_file(net, outfile);
+        if(!verify_weight_file(outfile)) error("Converted weight file does not verify");
+    }
+    free_network(net);
+}
+
+/* Compiles a plan and times a cold start from the cfg against one from the
+ * plan. */
+void compile_plan(char *cfgfile, char *weightfile, char *planfile, int batch)
+{
+    gpu_index = -1;
+    compile_network_plan(cfgfile, weightfile, planfile, batch);
+
+    double start = what_time_is_it_now();
+    network *net = load_network(cfgfile, weightfile, 0);
+    set_batch_network(net, batch);
+    double from_cfg = what_time_is_it_now() - start;
+    free_network(net);
+
+    start = what_time_is_it_now();
+    net = load_network(planfile, 0, 0);
+    double from_plan = what_time_is_it_now() - start;
+    free_network(net);
+
+    printf("Start up from %s: %.1f ms, from %s: %.1f ms (%.1fx)\n",
+            cfgfile, 1000*from_cfg, planfile, 1000*from_plan, from_plan > 0 ? from_cfg/from_plan : 0);
+}
+
 void print_weights(char *cfgfile, char *weightfile, int n)
 {
     gpu_index = -1;
@@ -405,6 +459,237 @@ void test_dconv_backprop_cpu();
 void test_dconv_forward_gpu();
 void test_dconv_forward_cpu();
 void test_new_dconv_forward_cpu();
+int test_maxpool_layer();
+
+void memory_report(char *cfgfile, int batch)
+{
+    size_t before = heap_bytes();
+    network *net = parse_network_cfg(cfgfile);
+    size_t measured = heap_bytes() - before;
+    size_t accounted = network_memory(net, net->batch, 1);
+    print_network_memory(net, batch ? batch : net->batch, stdout);
+    if(before || measured){
+        printf("\nHeap check at batch %d: %.2f MB allocated, %.2f MB accounted for (%.1f%% allocator overhead)\n",
+                net->batch, measured/(1024.*1024.), accounted/(1024.*1024.),
+                accounted ? 100.*((double)measured - accounted)/accounted : 0);
+    }
+    free_network(net);
+}
+
+/* Runs one prediction per model, round robin, through a registry holding
+ * budget MB and reports how often it had to reload. */
+void registry_report(float budget, char **files, int n, int rounds)
+{
+    int i, j;
+    model_registry *r = make_model_registry(budget*1024*1024);
+    float *X = 0;
+    double start = what_time_is_it_now();
+    for(i = 0; i < rounds; ++i){
+        for(j = 0; j < n; ++j){
+            network *net = registry_acquire(r, files[2*j], files[2*j+1]);
+            X = realloc(X, net->inputs*sizeof(float));
+            memset(X, 0, net->inputs*sizeof(float));
+            network_predict(net, X);
+            registry_release(r, net);
+        }
+    }
+    printf("%d predictions over %d models in %f seconds\n", rounds*n, n, what_time_is_it_now() - start);
+    print_registry_stats(r, stdout);
+    free(X);
+    free_model_registry(r);
+}
+
+/* Times data-parallel training steps on random images for each replica
+ * count in the list: weak scaling gives every replica batch images, strong
+ * scaling splits batch images between them. */
+void scaling_report(char *cfgfile, char *replica_list, int batch, int steps)
+{
+    int mode, i, j, k;
+    gpu_index = -1;
+    int counts[64];
+    int ncounts = 0;
+    char *p = replica_list;
+    while(p && ncounts < 64){
+        counts[ncounts++] = atoi(p);
+        p = strchr(p, ',');
+        if(p) ++p;
+    }
+    printf("%-7s %9s %9s %12s %8s %10s %9s\n", "scaling", "replicas", "batch", "images/sec", "speedup", "efficiency", "reduce");
+    for(mode = 0; mode < 2; ++mode){
+        double base = 0;
+        for(i = 0; i < ncounts; ++i){
+            int n = counts[i];
+            int local = mode ? batch/n : batch;
+            if(n < 1 || local < 1) continue;
+            network **nets = calloc(n, sizeof(network *));
+            for(j = 0; j < n; ++j){
+                srand(0);
+                nets[j] = parse_network_cfg(cfgfile);
+                nets[j]->subdivisions = 1;
+                set_batch_network(nets[j], local);
+                resize_network(nets[j], nets[j]->w, nets[j]->h);
+            }
+            data d = {0};
+            d.X = make_matrix(n*local, nets[0]->inputs);
+            d.y = make_matrix(n*local, nets[0]->truths);
+            for(j = 0; j < d.X.rows; ++j){
+                for(k = 0; k < d.X.cols; ++k) d.X.vals[j][k] = rand_uniform(0, 1);
+            }
+            replica_group *g = make_replica_group(nets, n);
+            train_replicas(g, d);
+            double reduce = replica_reduce_time(g);
+            double start = what_time_is_it_now();
+            for(j = 0; j < steps; ++j) train_replicas(g, d);
+            double elapsed = what_time_is_it_now() - start;
+            reduce = replica_reduce_time(g) - reduce;
+            double rate = steps*n*local/elapsed;
+            // relative to one replica, extrapolated linearly if the list doesn't start at 1
+            if(!base) base = rate/n;
+            double speedup = rate/base;
+            printf("%-7s %9d %9d %12.2f %8.2f %9.0f%% %8.1f%%\n", mode ? "strong" : "weak", n, local, rate,
+                    speedup, 100*speedup/n, 100*reduce/elapsed);
+            free_replica_group(g);
+            free_data(d);
+            for(j = 0; j < n; ++j) free_network(nets[j]);
+            free(nets);
+        }
+    }
+}
+
+/* Times SGD, Adam and AdamW steps over every parameter of a network, once
+ * through each layer's own update and once through update_network, which
+ * packs the parameters into one arena on its first step. */
+void optimizer_report(char *cfgfile, int steps)
+{
+    int mode, packed, i, j;
+    char *names[] = {"sgd", "adam", "adamw"};
+    gpu_index = -1;
+    if(steps < 1) steps = 1;
+    printf("%-9s %-7s %10s %10s %12s %8s\n", "optimizer", "path", "params", "ms/step", "Mparams/s", "GB/s");
+    for(mode = 0; mode < 3; ++mode){
+        for(packed = 0; packed < 2; ++packed){
+            srand(0);
+            network *net = parse_network_cfg(cfgfile);
+            net->adam = mode > 0;
+            net->adamw = mode == 2;
+            if(!net->B1) net->B1 = .9;
+            if(!net->B2) net->B2 = .999;
+            if(!net->eps) net->eps = .0000001;
+
+            size_t params = 0;
+            for(i = 0; i < net->n; ++i){
+                size_t sizes[5];
+                layer *l = net->layers + i;
+                if(layer_parameter_sizes(*l, sizes) <= 0) continue;
+                if(l->update) params += sizes[0] + sizes[1] + (l->scales ? sizes[2] : 0);
+                if(!net->adam || l->m) continue;
+                // what parsing with adam=1 would have allocated
+                l->m = calloc(sizes[0], sizeof(float));
+                l->v = calloc(sizes[0], sizeof(float));
+                l->bias_m = calloc(sizes[1], sizeof(float));
+                l->bias_v = calloc(sizes[1], sizeof(float));
+                l->scale_m = calloc(sizes[2], sizeof(float));
+                l->scale_v = calloc(sizes[2], sizeof(float));
+            }
+            double elapsed = 0;
+            for(j = 0; j <= steps; ++j){
+                update_args a = {0};
+                a.batch = net->batch*net->subdivisions;
+                a.learning_rate = net->learning_rate;
+                a.momentum = net->momentum;
+                a.decay = net->decay;
+                a.adam = net->adam;
+                a.adamw = net->adamw;
+                a.B1 = net->B1;
+                a.B2 = net->B2;
+                a.eps = net->eps;
+                a.t = j + 1;
+                double start = what_time_is_it_now();
+                if(packed){
+                    update_network(net);
+                } else {
+                    for(i = 0; i < net->n; ++i) if(net->layers[i].update) net->layers[i].update(net->layers[i], a);
+                }
+                // the first step warms the caches, and packs the arena
+                if(j) elapsed += what_time_is_it_now() - start;
+            }
+            elapsed /= steps;
+            // every array is read and written once: weights and updates, plus both moments for adam
+            double bytes = params*sizeof(float)*2*(net->adam ? 4 : 2);
+            printf("%-9s %-7s %10zu %10.3f %12.1f %8.2f\n", names[mode], packed ? "arena" : "layers", params,
+                    1000*elapsed, params/elapsed/1e6, bytes/elapsed/1e9);
+            free_network(net);
+        }
+    }
+}
+
+/* Starts n copies of darknet with the given arguments as the ranks of one
+ * process group on this machine and waits for all of them. */
+int launch_ranks(int n, char *self, char **args, int nargs)
+{
+    int i, failed = 0;
+    char value[32];
+    sprintf(value, "%d", n);
+    setenv("WORLD_SIZE", value, 1);
+    setenv("MASTER_ADDR", getenv("MASTER_ADDR") ? getenv("MASTER_ADDR") : "127.0.0.1", 1);
+    if(!getenv("MASTER_PORT")){
+        sprintf(value, "%d", 29500 + getpid()%1000);
+        setenv("MASTER_PORT", value, 1);
+    }
+    char **child = calloc(nargs + 2, sizeof(char *));
+    child[0] = self;
+    for(i = 0; i < nargs; ++i) child[i+1] = args[i];
+    pid_t *pids = calloc(n, sizeof(pid_t));
+    for(i = 0; i < n; ++i){
+        pids[i] = fork();
+        if(pids[i] < 0) error("fork failed");
+        if(pids[i] == 0){
+            sprintf(value, "%d", i);
+            setenv("RANK", value, 1);
+            execvp(self, child);
+            perror(self);
+            _exit(127);
+        }
+    }
+    for(i = 0; i < n; ++i){
+        int status;
+        waitpid(pids[i], &status, 0);
+        if(!WIFEXITED(status) || WEXITSTATUS(status)){
+            fprintf(stderr, "Rank %d failed\n", i);
+            failed = 1;
+        }
+    }
+    free(pids);
+    free(child);
+    return failed;
+}
+
+/* Checks and times ring_all_reduce on a buffer of n floats. */
+int all_reduce_report(size_t n, int rounds)
+{
+    size_t i;
+    int r;
+    process_group *g = make_process_group();
+    int rank = process_group_rank(g);
+    int world = process_group_size(g);
+    float *x = calloc(n, sizeof(float));
+    for(i = 0; i < n; ++i) x[i] = rank + i%7;
+    ring_all_reduce(g, x, n);
+    int wrong = 0;
+    for(i = 0; i < n; ++i){
+        float expected = (world - 1)/2. + i%7;
+        if(fabs(x[i] - expected) > 1e-5) ++wrong;
+    }
+    double start = what_time_is_it_now();
+    for(r = 0; r < rounds; ++r) ring_all_reduce(g, x, n);
+    double elapsed = (what_time_is_it_now() - start)/rounds;
+    double size = n*sizeof(float);
+    printf("Rank %d of %d: %zu floats, %d wrong, %.3f ms per all-reduce, %.2f GB/s bus bandwidth\n", rank, world, n, wrong,
+            1000*elapsed, elapsed > 0 ? 2.*(world - 1)/world*size/elapsed/1e9 : 0);
+    free(x);
+    free_process_group(g);
+    return wrong != 0;
+}
 
 int main(int argc, char **argv)
 {
@@ -438,6 +723,8 @@ int main(int argc, char **argv)
         run_super(argc, argv);
     } else if (0 == strcmp(argv[1], "lsd")){
         run_lsd(argc, argv);
+    } else if (0 == strcmp(argv[1], "serve") || 0 == strcmp(argv[1], "serve_client") || 0 == strcmp(argv[1], "serve_bench")){
+        run_serve(argc, argv);
     } else if (0 == strcmp(argv[1], "detector")){
         run_detector(argc, argv);
     } else if (0 == strcmp(argv[1], "detect")){
@@ -489,13 +776,71 @@ int main(int argc, char **argv)
     } else if (0 == strcmp(argv[1], "ops")){
         operations(argv[2]);
     } else if (0 == strcmp(argv[1], "speed")){
-        speed(argv[2], (argc > 3 && argv[3]) ? atoi(argv[3]) : 0);
+        int profile = find_arg(argc, argv, "-profile");
+        int counters = find_arg(argc, argv, "-counters");
+        int train = find_arg(argc, argv, "-train");
+        char *csv = find_char_arg(argc, argv, "-csv", 0);
+        int parallel = find_int_arg(argc, argv, "-parallel", 0);
+        speed(argv[2], (argc > 3 && argv[3]) ? atoi(argv[3]) : 0, profile, counters, train, csv, parallel);
+    } else if (0 == strcmp(argv[1], "registry")){
+        int rounds = find_int_arg(argc, argv, "-rounds", 3);
+        while(argc > 0 && !argv[argc-1]) --argc;
+        if(argc < 5 || (argc - 3) % 2){
+            fprintf(stderr, "usage: %s registry [budget MB] [cfg] [weights] ([cfg] [weights] ...) [-rounds n]\n", argv[0]);
+            return 0;
+        }
+        registry_report(atof(argv[2]), argv + 3, (argc - 3)/2, rounds);
+    } else if (0 == strcmp(argv[1], "memory")){
+        memory_report(argv[2], (argc > 3) ? atoi(argv[3]) : 0);
     } else if (0 == strcmp(argv[1], "oneoff")){
         oneoff(argv[2], argv[3], argv[4]);
     } else if (0 == strcmp(argv[1], "oneoff2")){
         oneoff2(argv[2], argv[3], argv[4], atoi(argv[5]));
     } else if (0 == strcmp(argv[1], "print")){
         print_weights(argv[2], argv[3], atoi(argv[4]));
+    } else if (0 == strcmp(argv[1], "compile")){
+        int batch = find_int_arg(argc, argv, "-batch", 1);
+        compile_plan(argv[2], argv[3], argv[4], batch);
+    } else if (0 == strcmp(argv[1], "launch")){
+        if(argc < 4){
+            fprintf(stderr, "usage: %s launch [ranks] [darknet arguments...]\n", argv[0]);
+            return 0;
+        }
+        return launch_ranks(atoi(argv[2]), argv[0], argv + 3, argc - 3);
+    } else if (0 == strcmp(argv[1], "allreduce")){
+        int rounds = find_int_arg(argc, argv, "-rounds", 10);
+        return all_reduce_report((argc > 2 && argv[2]) ? atol(argv[2]) : 1 << 22, rounds);
+    } else if (0 == strcmp(argv[1], "scaling")){
+        char *replicas = find_char_arg(argc, argv, "-replicas", "1,2,4");
+        int batch = find_int_arg(argc, argv, "-batch", 8);
+        int steps = find_int_arg(argc, argv, "-steps", 3);
+        scaling_report(argv[2], replicas, batch, steps);
+    } else if (0 == strcmp(argv[1], "optimizer")){
+        int steps = find_int_arg(argc, argv, "-steps", 10);
+        optimizer_report(argv[2], steps);
+    } else if (0 == strcmp(argv[1], "test_maxpool")){
+        return test_maxpool_layer();
+    } else if (0 == strcmp(argv[1], "nms")){
+        int boxes = find_int_arg(argc, argv, "-boxes", 10647);
+        int classes = find_int_arg(argc, argv, "-classes", 80);
+        float thresh = find_float_arg(argc, argv, "-thresh", .45);
+        float density = find_float_arg(argc, argv, "-density", .05);
+        int rounds = find_int_arg(argc, argv, "-rounds", 3);
+        nms_report(boxes, classes, thresh, density, rounds);
+    } else if (0 == strcmp(argv[1], "codegen")){
+        char *name = find_char_arg(argc, argv, "-name", 0);
+        int embed = find_arg(argc, argv, "-embed");
+        int verify = !find_arg(argc, argv, "-noverify");
+        if(argc < 5){
+            fprintf(stderr, "usage: %s codegen [cfg] [weights] [out.c] [-name prefix] [-embed] [-noverify]\n", argv[0]);
+            return 0;
+        }
+        gpu_index = -1;
+        codegen_network(argv[2], argv[3], argv[4], name, embed, verify);
+    } else if (0 == strcmp(argv[1], "convert_weights")){
+        convert_weights(argv[2], argv[3], argv[4]);
+    } else if (0 == strcmp(argv[1], "verify_weights")){
+        return !verify_weight_file(argv[2]);
     } else if (0 == strcmp(argv[1], "partial")){
         partial(argv[2], argv[3], argv[4], atoi(argv[5]));
     } else if (0 == strcmp(argv[1], "average")){
@@ -2,6 +2,7 @@
 #include "utils.h"
 #include "image.h"
 #include "cuda.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -1010,6 +1011,8 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, in
 void *load_thread(void *ptr)
 {
     //printf("Loading data: %d\n", rand());
+    TRACE_THREAD_NAME("load_thread");
+    TRACE_BEGIN("load_thread", "data", -1);
     load_args a = *(struct load_args*)ptr;
     if(a.exposure == 0) a.exposure = 1;
     if(a.saturation == 0) a.saturation = 1;
@@ -1047,6 +1050,7 @@ void *load_thread(void *ptr)
         *a.d = load_data_tag(a.paths, a.n, a.m, a.classes, a.min, a.max, a.size, a.angle, a.aspect, a.hue, a.saturation, a.exposure);
     }
     free(ptr);
+    TRACE_END();
     return 0;
 }
 
@@ -1062,6 +1066,8 @@ pthread_t load_data_in_thread(load_args args)
 void *load_threads(void *ptr)
 {
     int i;
+    TRACE_THREAD_NAME("load_threads");
+    TRACE_BEGIN("load_threads", "data", -1);
     load_args args = *(load_args *)ptr;
     if (args.threads == 0) args.threads = 1;
     data *out = args.d;
@@ -1085,6 +1091,7 @@ void *load_threads(void *ptr)
     }
     free(buffers);
     free(threads);
+    TRACE_END();
     return 0;
 }
 
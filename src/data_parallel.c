@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+#include "network.h"
+#include "data.h"
+#include "trace.h"
+#include "utils.h"
+#include "parameter_arena.h"
+
+/* Data-parallel training on CPU cores.  Each replica runs on its own thread,
+ * pinned to its own group of cores, and trains on its share of the batch.
+ * Before the update every gradient and batchnorm statistic is averaged
+ * across the replicas by an all-reduce in which each thread reduces one
+ * slice of the packed gradients and writes the result back to every
+ * replica, so all replicas take the same step and stay identical without
+ * ever copying weights around. */
+
+struct replica_group{
+    network **nets;
+    int n;
+    pthread_t *threads;
+    pthread_barrier_t start;
+    pthread_barrier_t reduced;
+    pthread_barrier_t done;
+    int quit;
+
+    float **grads;  /* each replica's gradient region */
+    size_t total;
+
+    data d;
+    float *errors;
+    double reduce_time;
+};
+
+typedef struct{
+    replica_group *g;
+    int index;
+} replica_args;
+
+/* Packing puts the gradients, plus the rolling statistics so batchnorm
+ * agrees too, in one region per replica. */
+static void find_gradients(replica_group *g)
+{
+    int i, j;
+    float *arrays[5];
+    size_t sizes[5];
+    network *net = g->nets[0];
+    for(j = 0; j < net->n; ++j){
+        if(layer_gradient_arrays(net->layers[j], arrays, sizes) < 0){
+            fprintf(stderr, "Data-parallel training does not support %s layers\n", get_layer_string(net->layers[j].type));
+            error("Unsupported layer");
+        }
+    }
+    g->grads = calloc(g->n, sizeof(float *));
+    for(i = 0; i < g->n; ++i){
+        pack_network_parameters(g->nets[i]);
+        g->grads[i] = g->nets[i]->arena->grads;
+    }
+    g->total = net->arena->size;
+}
+
+/* Averages slice index of the gradients over the replicas. */
+static void all_reduce_slice(replica_group *g, int index)
+{
+    int r;
+    size_t k;
+    size_t lo = g->total*index/g->n/ARENA_ALIGN*ARENA_ALIGN;
+    size_t hi = index == g->n - 1 ? g->total : g->total*(index + 1)/g->n/ARENA_ALIGN*ARENA_ALIGN;
+    float scale = 1./g->n;
+    float *sum = g->grads[0];
+    for(r = 1; r < g->n; ++r){
+        float *x = g->grads[r];
+        for(k = lo; k < hi; ++k) sum[k] += x[k];
+    }
+    for(k = lo; k < hi; ++k) sum[k] *= scale;
+    for(r = 1; r < g->n; ++r) memcpy(g->grads[r] + lo, sum + lo, (hi - lo)*sizeof(float));
+}
+
+static void pin_replica(replica_group *g, int index)
+{
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int group = cores/g->n;
+    if(group < 1) group = 1;
+#ifdef __linux__
+    int i;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(i = 0; i < group; ++i) CPU_SET((index*group + i) % cores, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+#ifdef OPENMP
+    omp_set_num_threads(group);
+#endif
+}
+
+static float train_shard(network *net, data d)
+{
+    int i;
+    int batch = net->batch;
+    int n = d.X.rows/batch;
+    float sum = 0;
+    net->train = 1;
+    for(i = 0; i < n; ++i){
+        get_next_batch(d, batch, i*batch, net->input, net->truth);
+        *net->seen += batch;
+        forward_network(net);
+        backward_network(net);
+        sum += *net->cost;
+    }
+    return sum/(n*batch);
+}
+
+static void *replica_thread(void *ptr)
+{
+    replica_args args = *(replica_args *)ptr;
+    free(ptr);
+    replica_group *g = args.g;
+    int i = args.index;
+    char name[32];
+    sprintf(name, "replica %d", i);
+    TRACE_THREAD_NAME(name);
+    pin_replica(g, i);
+    while(1){
+        pthread_barrier_wait(&g->start);
+        if(g->quit) break;
+        network *net = g->nets[i];
+        data part = get_data_part(g->d, i, g->n);
+        size_t seen = *net->seen;
+
+        TRACE_BEGIN("train_shard", "train", -1);
+        g->errors[i] = train_shard(net, part);
+        TRACE_END();
+
+        pthread_barrier_wait(&g->reduced);
+        double start = what_time_is_it_now();
+        TRACE_BEGIN("all_reduce", "train", -1);
+        all_reduce_slice(g, i);
+        TRACE_END();
+        if(i == 0) g->reduce_time += what_time_is_it_now() - start;
+        pthread_barrier_wait(&g->reduced);
+
+        // every replica saw the whole batch, as far as the schedule is concerned
+        *net->seen = seen + (size_t)g->d.X.rows;
+        update_network(net);
+        pthread_barrier_wait(&g->done);
+    }
+    return 0;
+}
+
+/* The nets must start out identical, e.g. loaded after the same srand. */
+replica_group *make_replica_group(network **nets, int n)
+{
+    int i;
+    replica_group *g = calloc(1, sizeof(replica_group));
+    g->nets = nets;
+    g->n = n;
+    g->errors = calloc(n, sizeof(float));
+    g->threads = calloc(n, sizeof(pthread_t));
+    find_gradients(g);
+    pthread_barrier_init(&g->start, 0, n + 1);
+    pthread_barrier_init(&g->done, 0, n + 1);
+    pthread_barrier_init(&g->reduced, 0, n);
+    for(i = 0; i < n; ++i){
+        replica_args *args = calloc(1, sizeof(replica_args));
+        args->g = g;
+        args->index = i;
+        if(pthread_create(g->threads + i, 0, replica_thread, args)) error("Thread creation failed");
+    }
+    return g;
+}
+
+/* d holds batch*subdivisions images for every replica.  Returns the average
+ * loss per image, like train_network. */
+float train_replicas(replica_group *g, data d)
+{
+    int i;
+    network *net = g->nets[0];
+    assert(d.X.rows == net->batch*net->subdivisions*g->n);
+    g->d = d;
+    pthread_barrier_wait(&g->start);
+    pthread_barrier_wait(&g->done);
+    float sum = 0;
+    for(i = 0; i < g->n; ++i) sum += g->errors[i];
+    return sum/g->n;
+}
+
+double replica_reduce_time(replica_group *g)
+{
+    return g->reduce_time;
+}
+
+void free_replica_group(replica_group *g)
+{
+    int i;
+    g->quit = 1;
+    pthread_barrier_wait(&g->start);
+    for(i = 0; i < g->n; ++i) pthread_join(g->threads[i], 0);
+    pthread_barrier_destroy(&g->start);
+    pthread_barrier_destroy(&g->reduced);
+    pthread_barrier_destroy(&g->done);
+    free(g->grads);
+    free(g->threads);
+    free(g->errors);
+    free(g);
+}
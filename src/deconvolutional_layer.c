@@ -33,7 +33,7 @@ void bilinear_init(layer l)
 }
 
 
-layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int adam)
+layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int adam, int init)
 {
     int i;
     layer l = {0};
@@ -58,7 +58,7 @@ layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size
     //float scale = n/(size*size*c);
     //printf("scale: %f\n", scale);
     float scale = .02;
-    for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_normal();
+    if(init) for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_normal();
     //bilinear_init(l);
     for(i = 0; i < n; ++i){
         l.biases[i] = 0;
@@ -97,7 +97,6 @@ layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size
 
         l.rolling_mean = calloc(n, sizeof(float));
         l.rolling_variance = calloc(n, sizeof(float));
-        l.x = calloc(l.batch*l.outputs, sizeof(float));
         l.x_norm = calloc(l.batch*l.outputs, sizeof(float));
     }
     if(adam){
@@ -161,7 +160,7 @@ layer make_deconvolutional_layer(int batch, int h, int w, int c, int n, int size
     l.activation = activation;
     l.workspace_size = get_workspace_size(l);
 
-    fprintf(stderr, "deconv%5d %2d x%2d /%2d  %4d x%4d x%4d   ->  %4d x%4d x%4d\n", n, size, size, stride, w, h, c, l.out_w, l.out_h, l.out_c);
+    if(!quiet_build) fprintf(stderr, "deconv%5d %2d x%2d /%2d  %4d x%4d x%4d   ->  %4d x%4d x%4d\n", n, size, size, stride, w, h, c, l.out_w, l.out_h, l.out_c);
 
     return l;
 }
@@ -194,7 +193,6 @@ void resize_deconvolutional_layer(layer *l, int h, int w)
     l->output = realloc(l->output, l->batch*l->outputs*sizeof(float));
     l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
     if(l->batch_normalize){
-        l->x = realloc(l->x, l->batch*l->outputs*sizeof(float));
         l->x_norm  = realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
     }
 
@@ -241,10 +239,10 @@ void forward_deconvolutional_layer(const layer l, network net)
     }
     if (l.batch_normalize) {
         forward_batchnorm_layer(l, net);
+        activate_array(l.output, l.batch*l.n*l.out_w*l.out_h, l.activation);
     } else {
-        add_bias(l.output, l.biases, l.batch, l.n, l.out_w*l.out_h);
+        add_bias_activate(l.output, l.biases, l.batch, l.n, l.out_w*l.out_h, l.activation);
     }
-    activate_array(l.output, l.batch*l.n*l.out_w*l.out_h, l.activation);
 }
 
 void backward_deconvolutional_layer(layer l, network net)
@@ -296,6 +294,17 @@ void update_deconvolutional_layer(layer l, update_args a)
     int batch = a.batch;
 
     int size = l.size*l.size*l.c*l.n;
+
+    if(a.adam && l.m){
+        float bias_decay = a.adamw ? 0 : decay;
+        adam_update_cpu(l.weights, l.weight_updates, l.m, l.v, a.B1, a.B2, a.eps, decay, learning_rate, size, batch, a.t, a.adamw);
+        adam_update_cpu(l.biases, l.bias_updates, l.bias_m, l.bias_v, a.B1, a.B2, a.eps, bias_decay, learning_rate, l.n, batch, a.t, a.adamw);
+        if(l.scales){
+            adam_update_cpu(l.scales, l.scale_updates, l.scale_m, l.scale_v, a.B1, a.B2, a.eps, bias_decay, learning_rate, l.n, batch, a.t, a.adamw);
+        }
+        return;
+    }
+
     axpy_cpu(l.n, learning_rate/batch, l.bias_updates, 1, l.biases, 1);
     scal_cpu(l.n, momentum, l.bias_updates, 1);
 
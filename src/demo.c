@@ -34,6 +34,7 @@ static float **predictions;
 static float *avg;
 static int demo_done = 0;
 static int demo_total = 0;
+static detection_pool *demo_pool;
 double demo_time;
 
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num);
@@ -79,8 +80,8 @@ detection *avg_predictions(network *net, int *nboxes)
             count += l.outputs;
         }
     }
-    detection *dets = get_network_boxes(net, buff[0].w, buff[0].h, demo_thresh, demo_hier, 0, 1, nboxes);
-    return dets;
+    *nboxes = fill_detection_pool(demo_pool, net, buff[0].w, buff[0].h, demo_thresh, demo_hier, 0, 1);
+    return demo_pool->dets;
 }
 
 void *detect_in_thread(void *ptr)
@@ -123,7 +124,7 @@ void *detect_in_thread(void *ptr)
     }
      */
 
-    if (nms > 0) do_nms_obj(dets, nboxes, l.classes, nms);
+    if (nms > 0) do_nms_obj_fast(dets, nboxes, l.classes, nms);
 
     printf("\033[2J");
     printf("\033[1;1H");
@@ -131,7 +132,6 @@ void *detect_in_thread(void *ptr)
     printf("Objects:\n\n");
     image display = buff[(buff_index+2) % 3];
     draw_detections(display, dets, nboxes, demo_thresh, demo_names, demo_alphabet, demo_classes);
-    free_detections(dets, nboxes);
 
     demo_index = (demo_index + 1)%demo_frame;
     running = 0;
@@ -206,6 +206,7 @@ void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const ch
         predictions[i] = calloc(demo_total, sizeof(float));
     }
     avg = calloc(demo_total, sizeof(float));
+    demo_pool = make_detection_pool(net);
 
     if(filename){
         printf("video file: %s\n", filename);
@@ -295,7 +295,7 @@ void test_dconv_forward_gpu()
     
     
     dilated_convolutional_layer l = make_dilated_conv_layer(
-        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate);
+        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate, 1);
     
     network net = *make_network(1);
     net.layers = &l;
@@ -381,7 +381,7 @@ void test_dconv_backprop_gpu()
     
     
     dilated_convolutional_layer l = make_dilated_conv_layer(
-        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate);
+        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate, 1);
     
     network net = *make_network(1);
     net.layers = &l;
@@ -126,7 +126,7 @@ void cudnn_convolutional_setup(layer *l)
 #endif
 #endif
 
-dilated_convolutional_layer make_dilated_conv_layer(int batch, int h, int w, int c, int n, int groups, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam, int dilate_rate)
+dilated_convolutional_layer make_dilated_conv_layer(int batch, int h, int w, int c, int n, int groups, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam, int dilate_rate, int init)
 {
     int i;
     dilated_convolutional_layer l = {0};
@@ -157,7 +157,7 @@ dilated_convolutional_layer make_dilated_conv_layer(int batch, int h, int w, int
 
     float scale = sqrt(2./(size*size*c/l.groups));
     
-    for(i = 0; i < l.nweights; ++i) l.weights[i] = scale*rand_normal();
+    if(init) for(i = 0; i < l.nweights; ++i) l.weights[i] = scale*rand_normal();
     int out_w = dilated_conv_out_width(l);
     int out_h = dilated_conv_out_height(l);
     l.out_h = out_h;
@@ -197,7 +197,6 @@ dilated_convolutional_layer make_dilated_conv_layer(int batch, int h, int w, int
 
         l.rolling_mean = calloc(n, sizeof(float));
         l.rolling_variance = calloc(n, sizeof(float));
-        l.x = calloc(l.batch*l.outputs, sizeof(float));
         l.x_norm = calloc(l.batch*l.outputs, sizeof(float));
     }
     if(adam){
@@ -273,7 +272,7 @@ dilated_convolutional_layer make_dilated_conv_layer(int batch, int h, int w, int
     l.workspace_size = get_workspace_size(l);
     l.activation = activation;
 
-    fprintf(stderr, "dilated_conv  %5d %2d x%2d /%2d  %4d x%4d x%4d   ->  %4d x%4d x%4d  %5.3f BFLOPs\n", n, size, size, stride, w, h, c, l.out_w, l.out_h, l.out_c, (2.0 * l.n * l.size*l.size*l.c/l.groups * l.out_h*l.out_w)/1000000000.);
+    if(!quiet_build) fprintf(stderr, "dilated_conv  %5d %2d x%2d /%2d  %4d x%4d x%4d   ->  %4d x%4d x%4d  %5.3f BFLOPs\n", n, size, size, stride, w, h, c, l.out_w, l.out_h, l.out_c, (2.0 * l.n * l.size*l.size*l.c/l.groups * l.out_h*l.out_w)/1000000000.);
 
     return l;
 }
@@ -310,7 +309,6 @@ void resize_dilated_conv_layer(dilated_convolutional_layer *l, int w, int h)
     l->output = realloc(l->output, l->batch*l->outputs*sizeof(float));
     l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
     if(l->batch_normalize){
-        l->x = realloc(l->x, l->batch*l->outputs*sizeof(float));
         l->x_norm  = realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
     }
 
@@ -404,11 +402,10 @@ void forward_dilated_conv_layer(dilated_convolutional_layer l, network net)
 
     if(l.batch_normalize){
         forward_batchnorm_layer(l, net);
+        activate_array(l.output, l.outputs*l.batch, l.activation);
     } else {
-        add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+        add_bias_activate(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w, l.activation);
     }
-
-    activate_array(l.output, l.outputs*l.batch, l.activation);
     if(l.binary || l.xnor) swap_binary(&l);
 }
 
@@ -487,6 +484,16 @@ void update_dilated_conv_layer(dilated_convolutional_layer l, update_args a)
     float decay = a.decay;
     int batch = a.batch;
 
+    if(a.adam && l.m){
+        float bias_decay = a.adamw ? 0 : decay;
+        adam_update_cpu(l.weights, l.weight_updates, l.m, l.v, a.B1, a.B2, a.eps, decay, learning_rate, l.nweights, batch, a.t, a.adamw);
+        adam_update_cpu(l.biases, l.bias_updates, l.bias_m, l.bias_v, a.B1, a.B2, a.eps, bias_decay, learning_rate, l.n, batch, a.t, a.adamw);
+        if(l.scales){
+            adam_update_cpu(l.scales, l.scale_updates, l.scale_m, l.scale_v, a.B1, a.B2, a.eps, bias_decay, learning_rate, l.n, batch, a.t, a.adamw);
+        }
+        return;
+    }
+
     axpy_cpu(l.n, learning_rate/batch, l.bias_updates, 1, l.biases, 1);
     scal_cpu(l.n, momentum, l.bias_updates, 1);
 
@@ -529,7 +536,7 @@ void test_dconv_forward_cpu()
     int dilate_rate = 2;
     
     dilated_convolutional_layer l = make_dilated_conv_layer(
-        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate);
+        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate, 1);
     
     network net = *make_network(1);
     net.layers = &l;
@@ -602,7 +609,7 @@ void test_new_dconv_forward_cpu()
     int dilate_rate = 2;
     
     dilated_convolutional_layer l = make_dilated_conv_layer(
-        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate);
+        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate, 1);
     
     network net = *make_network(1);
     net.layers = &l;
@@ -658,7 +665,7 @@ void test_dconv_backprop_cpu()
     
     
     dilated_convolutional_layer l = make_dilated_conv_layer(
-        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate);
+        batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, adam, dilate_rate, 1);
     
     network net = *make_network(1);
     net.layers = &l;
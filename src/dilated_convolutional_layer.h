@@ -30,7 +30,7 @@ void cudnn_convolutional_setup(layer *l);
 #endif
 #endif
 
-dilated_convolutional_layer make_dilated_conv_layer(int batch, int h, int w, int c, int n, int groups, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam, int dilate_rate);
+dilated_convolutional_layer make_dilated_conv_layer(int batch, int h, int w, int c, int n, int groups, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam, int dilate_rate, int init);
 void resize_dilated_conv_layer(dilated_convolutional_layer *layer, int w, int h);
 void forward_dilated_conv_layer(const dilated_convolutional_layer layer, network net);
 void update_dilated_conv_layer(dilated_convolutional_layer layer, update_args a);
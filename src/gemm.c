@@ -88,14 +88,40 @@ void gemm_nn(int M, int N, int K, float ALPHA,
     }
 }
 
+/* Rows of A go four at a time so each row of B is read once per four
+ * outputs rather than once per output. */
 void gemm_nt(int M, int N, int K, float ALPHA, 
         float *A, int lda, 
         float *B, int ldb,
         float *C, int ldc)
 {
-    int i,j,k;
+    int i;
+    int blocks = M/4;
     #pragma omp parallel for
-    for(i = 0; i < M; ++i){
+    for(i = 0; i < blocks; ++i){
+        int j, k;
+        float *a0 = A + 4*i*lda;
+        float *a1 = a0 + lda;
+        float *a2 = a1 + lda;
+        float *a3 = a2 + lda;
+        float *c = C + 4*i*ldc;
+        for(j = 0; j < N; ++j){
+            float *b = B + j*ldb;
+            float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+            for(k = 0; k < K; ++k){
+                sum0 += ALPHA*a0[k]*b[k];
+                sum1 += ALPHA*a1[k]*b[k];
+                sum2 += ALPHA*a2[k]*b[k];
+                sum3 += ALPHA*a3[k]*b[k];
+            }
+            c[j] += sum0;
+            c[ldc + j] += sum1;
+            c[2*ldc + j] += sum2;
+            c[3*ldc + j] += sum3;
+        }
+    }
+    for(i = 4*blocks; i < M; ++i){
+        int j, k;
         for(j = 0; j < N; ++j){
             register float sum = 0;
             for(k = 0; k < K; ++k){
@@ -26,9 +26,9 @@ static void increment_layer(layer *l, int steps)
 #endif
 }
 
-layer make_gru_layer(int batch, int inputs, int outputs, int steps, int batch_normalize, int adam)
+layer make_gru_layer(int batch, int inputs, int outputs, int steps, int batch_normalize, int adam, int init)
 {
-    fprintf(stderr, "GRU Layer: %d inputs, %d outputs\n", inputs, outputs);
+    if(!quiet_build) fprintf(stderr, "GRU Layer: %d inputs, %d outputs\n", inputs, outputs);
     batch = batch / steps;
     layer l = {0};
     l.batch = batch;
@@ -37,35 +37,35 @@ layer make_gru_layer(int batch, int inputs, int outputs, int steps, int batch_no
     l.inputs = inputs;
 
     l.uz = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.uz) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.uz) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam, init);
     l.uz->batch = batch;
 
     l.wz = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.wz) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.wz) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam, init);
     l.wz->batch = batch;
 
     l.ur = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.ur) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.ur) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam, init);
     l.ur->batch = batch;
 
     l.wr = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.wr) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.wr) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam, init);
     l.wr->batch = batch;
 
 
 
     l.uh = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.uh) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.uh) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam, init);
     l.uh->batch = batch;
 
     l.wh = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.wh) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.wh) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam, init);
     l.wh->batch = batch;
 
     l.batch_normalize = batch_normalize;
@@ -125,8 +125,95 @@ void update_gru_layer(layer l, update_args a)
     update_connected_layer(*(l.wh), a);
 }
 
+/* The input path doesn't depend on the state, so every step of it is one
+ * GEMM: the sub-layer seen as a batch of batch*steps rows. */
+static void forward_all_steps(layer l, network net, int steps)
+{
+    l.batch *= steps;
+    forward_connected_layer(l, net);
+}
+
+/* The update and reset gates of a step and the reset state wh reads. */
+static void gru_gates(int n, const float *restrict uz, const float *restrict wz, const float *restrict ur, const float *restrict wr,
+        const float *restrict state, float *restrict z, float *restrict r, float *restrict forgot)
+{
+    int j;
+    for(j = 0; j < n; ++j){
+        z[j] = fast_logistic(uz[j] + wz[j]);
+        r[j] = fast_logistic(ur[j] + wr[j]);
+        forgot[j] = state[j]*r[j];
+    }
+}
+
+/* The candidate state and the new state, weighted_sum_cpu's blend. */
+static void gru_state(int n, int tanh, const float *restrict uh, const float *restrict wh, const float *restrict z,
+        float *restrict h, float *restrict state, float *restrict output)
+{
+    int j;
+    for(j = 0; j < n; ++j){
+        float x = uh[j] + wh[j];
+        h[j] = tanh ? fast_tanh(x) : fast_logistic(x);
+        output[j] = z[j]*state[j] + (1-z[j])*h[j];
+        state[j] = output[j];
+    }
+}
+
+/* Batchnorm takes statistics per step, so only layers without it can
+ * project all steps at once. */
+static void forward_gru_fused(layer l, network net)
+{
+    network s = net;
+    s.train = net.train;
+    int i;
+    layer uz = *(l.uz);
+    layer ur = *(l.ur);
+    layer uh = *(l.uh);
+
+    layer wz = *(l.wz);
+    layer wr = *(l.wr);
+    layer wh = *(l.wh);
+
+    if(net.train) {
+        layer *gates[] = {&uz, &ur, &uh, &wz, &wr, &wh};
+        for (i = 0; i < 6; ++i) fill_cpu(l.outputs * l.batch * l.steps, 0, gates[i]->delta, 1);
+        fill_cpu(l.outputs * l.batch * l.steps, 0, l.delta, 1);
+        copy_cpu(l.outputs*l.batch, l.state, 1, l.prev_state, 1);
+    }
+
+    s.input = net.input;
+    forward_all_steps(uz, s, l.steps);
+    forward_all_steps(ur, s, l.steps);
+    forward_all_steps(uh, s, l.steps);
+
+    for (i = 0; i < l.steps; ++i) {
+        s.input = l.state;
+        forward_connected_layer(wz, s);
+        forward_connected_layer(wr, s);
+
+        gru_gates(l.outputs*l.batch, uz.output, wz.output, ur.output, wr.output, l.state, l.z_cpu, l.r_cpu, l.forgot_state);
+
+        s.input = l.forgot_state;
+        forward_connected_layer(wh, s);
+
+        gru_state(l.outputs*l.batch, l.tanh, uh.output, wh.output, l.z_cpu, l.h_cpu, l.state, l.output);
+
+        l.output += l.outputs*l.batch;
+        increment_layer(&uz, 1);
+        increment_layer(&ur, 1);
+        increment_layer(&uh, 1);
+
+        increment_layer(&wz, 1);
+        increment_layer(&wr, 1);
+        increment_layer(&wh, 1);
+    }
+}
+
 void forward_gru_layer(layer l, network net)
 {
+    if(!l.batch_normalize) {
+        forward_gru_fused(l, net);
+        return;
+    }
     network s = net;
     s.train = net.train;
     int i;
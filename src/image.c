@@ -1439,15 +1439,8 @@ void test_resize(char *filename)
 }
 
 
-image load_image_stb(char *filename, int channels)
+image load_image_bytes(unsigned char *data, int w, int h, int c)
 {
-    int w, h, c;
-    unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
-    if (!data) {
-        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n", filename, stbi_failure_reason());
-        exit(0);
-    }
-    if(channels) c = channels;
     int i,j,k;
     image im = make_image(w, h, c);
     for(k = 0; k < c; ++k){
@@ -1459,6 +1452,32 @@ image load_image_stb(char *filename, int channels)
             }
         }
     }
+    return im;
+}
+
+image load_image_stb(char *filename, int channels)
+{
+    int w, h, c;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n", filename, stbi_failure_reason());
+        exit(0);
+    }
+    if(channels) c = channels;
+    image im = load_image_bytes(data, w, h, c);
+    free(data);
+    return im;
+}
+
+/* Decodes an encoded image held in memory.  Returns an empty image instead of
+ * exiting, since the bytes usually come from somebody else. */
+image load_image_memory(unsigned char *buf, int len, int channels)
+{
+    int w, h, c;
+    unsigned char *data = stbi_load_from_memory(buf, len, &w, &h, &c, channels);
+    if (!data) return make_empty_image(0, 0, 0);
+    if(channels) c = channels;
+    image im = load_image_bytes(data, w, h, c);
     free(data);
     return im;
 }
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "network.h"
+#include "scheduler.h"
+#include "utils.h"
+
+/* An instance is a network struct whose layers point at the base network's
+ * weights, biases, scales and rolling statistics but own everything forward
+ * writes: outputs, batchnorm inputs, loss scratch, recurrent state and the
+ * workspace.  Instances only run inference, so deltas are kept only where
+ * forward writes them anyway (loss layers and the sublayers of recurrent
+ * layers).  Each instance may be used by one thread at a time; any number of
+ * instances can run at once over one set of weights.
+ *
+ * The base network must outlive its instances and must not be resized or
+ * reloaded while they exist. */
+
+static float *own_floats(float *base, size_t n)
+{
+    return base ? calloc(n, sizeof(float)) : 0;
+}
+
+static int forward_writes_delta(LAYER_TYPE type)
+{
+    return type == YOLO || type == REGION || type == DETECTION
+        || type == SOFTMAX || type == LOGXENT || type == COST;
+}
+
+static layer *instance_sublayer(layer *base);
+
+static layer instance_layer(layer base, int keep_delta)
+{
+    layer l = base;
+    size_t out = (size_t)l.batch*l.outputs;
+    size_t in = (size_t)l.batch*l.inputs;
+    size_t steps = (l.steps > 0) ? l.steps : 1;
+
+    switch(l.type){
+        case RNN:
+        case CRNN:
+            l.input_layer = instance_sublayer(base.input_layer);
+            l.self_layer = instance_sublayer(base.self_layer);
+            l.output_layer = instance_sublayer(base.output_layer);
+            l.output = l.output_layer->output;
+            l.delta = l.output_layer->delta;
+            if(l.type == RNN){
+                l.state = own_floats(base.state, out);
+                l.prev_state = own_floats(base.prev_state, out);
+            } else {
+                l.state = own_floats(base.state, (size_t)l.hidden*l.batch*(steps+1));
+            }
+            return l;
+        case GRU:
+            l.uz = instance_sublayer(base.uz);
+            l.wz = instance_sublayer(base.wz);
+            l.ur = instance_sublayer(base.ur);
+            l.wr = instance_sublayer(base.wr);
+            l.uh = instance_sublayer(base.uh);
+            l.wh = instance_sublayer(base.wh);
+            l.output = own_floats(base.output, out*steps);
+            l.delta = own_floats(base.delta, out*steps);
+            l.state = own_floats(base.state, out);
+            l.prev_state = own_floats(base.prev_state, out);
+            l.forgot_state = own_floats(base.forgot_state, out);
+            l.forgot_delta = own_floats(base.forgot_delta, out);
+            l.r_cpu = own_floats(base.r_cpu, out);
+            l.z_cpu = own_floats(base.z_cpu, out);
+            l.h_cpu = own_floats(base.h_cpu, out);
+            return l;
+        case LSTM:
+            l.uf = instance_sublayer(base.uf);
+            l.ui = instance_sublayer(base.ui);
+            l.ug = instance_sublayer(base.ug);
+            l.uo = instance_sublayer(base.uo);
+            l.wf = instance_sublayer(base.wf);
+            l.wi = instance_sublayer(base.wi);
+            l.wg = instance_sublayer(base.wg);
+            l.wo = instance_sublayer(base.wo);
+            l.output = own_floats(base.output, out*steps);
+            l.cell_cpu = own_floats(base.cell_cpu, out*steps);
+            l.state = own_floats(base.state, out);
+            l.prev_state_cpu = own_floats(base.prev_state_cpu, out);
+            l.prev_cell_cpu = own_floats(base.prev_cell_cpu, out);
+            l.f_cpu = own_floats(base.f_cpu, out);
+            l.i_cpu = own_floats(base.i_cpu, out);
+            l.g_cpu = own_floats(base.g_cpu, out);
+            l.o_cpu = own_floats(base.o_cpu, out);
+            l.c_cpu = own_floats(base.c_cpu, out);
+            l.h_cpu = own_floats(base.h_cpu, out);
+            l.temp_cpu = own_floats(base.temp_cpu, out);
+            l.temp2_cpu = own_floats(base.temp2_cpu, out);
+            l.temp3_cpu = own_floats(base.temp3_cpu, out);
+            l.dc_cpu = own_floats(base.dc_cpu, out);
+            l.dh_cpu = own_floats(base.dh_cpu, out);
+            return l;
+        default:
+            break;
+    }
+
+    // the dropout case is patched up by the caller, it aliases the previous layer
+    l.output = (l.type == DROPOUT) ? 0 : own_floats(base.output, out);
+    l.delta = (keep_delta && l.type != DROPOUT) ? own_floats(base.delta, out) : 0;
+    l.x = own_floats(base.x, out);
+    l.x_norm = keep_delta ? own_floats(base.x_norm, out) : 0;
+    l.binary_input = own_floats(base.binary_input, in);
+    l.binary_weights = own_floats(base.binary_weights, l.nweights);
+    l.loss = own_floats(base.loss, in);
+    l.rand = 0;
+    l.squared = own_floats(base.squared, out);
+    l.norms = own_floats(base.norms, out);
+    l.cost = own_floats(base.cost, 1);
+    if(l.type == L2NORM) l.scales = own_floats(base.scales, in);
+    return l;
+}
+
+static layer *instance_sublayer(layer *base)
+{
+    layer *l = malloc(sizeof(layer));
+    *l = instance_layer(*base, 1);
+    return l;
+}
+
+static void free_instance_layer(layer l);
+
+static void free_instance_sublayer(layer *l)
+{
+    free_instance_layer(*l);
+    free(l);
+}
+
+static void free_instance_layer(layer l)
+{
+    switch(l.type){
+        case RNN:
+        case CRNN:
+            free_instance_sublayer(l.input_layer);
+            free_instance_sublayer(l.self_layer);
+            free_instance_sublayer(l.output_layer);
+            free(l.state);
+            if(l.type == RNN) free(l.prev_state);
+            return;
+        case GRU:
+            free_instance_sublayer(l.uz);
+            free_instance_sublayer(l.wz);
+            free_instance_sublayer(l.ur);
+            free_instance_sublayer(l.wr);
+            free_instance_sublayer(l.uh);
+            free_instance_sublayer(l.wh);
+            free(l.output);
+            free(l.delta);
+            free(l.state);
+            free(l.prev_state);
+            free(l.forgot_state);
+            free(l.forgot_delta);
+            free(l.r_cpu);
+            free(l.z_cpu);
+            free(l.h_cpu);
+            return;
+        case LSTM:
+            free_instance_sublayer(l.uf);
+            free_instance_sublayer(l.ui);
+            free_instance_sublayer(l.ug);
+            free_instance_sublayer(l.uo);
+            free_instance_sublayer(l.wf);
+            free_instance_sublayer(l.wi);
+            free_instance_sublayer(l.wg);
+            free_instance_sublayer(l.wo);
+            free(l.output);
+            free(l.cell_cpu);
+            free(l.state);
+            free(l.prev_state_cpu);
+            free(l.prev_cell_cpu);
+            free(l.f_cpu);
+            free(l.i_cpu);
+            free(l.g_cpu);
+            free(l.o_cpu);
+            free(l.c_cpu);
+            free(l.h_cpu);
+            free(l.temp_cpu);
+            free(l.temp2_cpu);
+            free(l.temp3_cpu);
+            free(l.dc_cpu);
+            free(l.dh_cpu);
+            return;
+        default:
+            break;
+    }
+    if(l.type != DROPOUT){
+        free(l.output);
+        free(l.delta);
+    }
+    free(l.x);
+    free(l.x_norm);
+    free(l.binary_input);
+    free(l.binary_weights);
+    free(l.loss);
+    free(l.squared);
+    free(l.norms);
+    free(l.cost);
+    if(l.type == L2NORM) free(l.scales);
+}
+
+network *make_network_instance(network *base)
+{
+#ifdef GPU
+    if(base->gpu_index >= 0) error("Network instances only run on the CPU");
+#endif
+    int i;
+    size_t workspace_size = 0;
+    network *net = calloc(1, sizeof(network));
+    *net = *base;
+    net->layers = calloc(net->n, sizeof(layer));
+    for(i = 0; i < net->n; ++i){
+        layer l = instance_layer(base->layers[i], forward_writes_delta(base->layers[i].type));
+        if(l.type == DROPOUT && i > 0){
+            l.output = net->layers[i-1].output;
+            l.delta = net->layers[i-1].delta;
+        }
+        net->layers[i] = l;
+        if(l.workspace_size > workspace_size) workspace_size = l.workspace_size;
+    }
+    net->input = calloc(net->inputs*net->batch, sizeof(float));
+    net->truth = calloc(net->truths*net->batch, sizeof(float));
+    net->delta = 0;
+    net->workspace = workspace_size ? calloc(1, workspace_size) : 0;
+    net->cost = calloc(1, sizeof(float));
+    net->output = get_network_output_layer(net).output;
+    net->train = 0;
+    net->prof = 0;
+    net->sched = 0;
+    return net;
+}
+
+void free_network_instance(network *net)
+{
+    int i;
+    for(i = 0; i < net->n; ++i){
+        free_instance_layer(net->layers[i]);
+    }
+    free(net->layers);
+    free(net->input);
+    free(net->truth);
+    free(net->workspace);
+    free(net->cost);
+    free_layer_scheduler(net->sched);
+    free(net);
+}
@@ -11,7 +11,7 @@
 
 layer make_l2norm_layer(int batch, int inputs)
 {
-    fprintf(stderr, "l2norm                                         %4d\n",  inputs);
+    if(!quiet_build) fprintf(stderr, "l2norm                                         %4d\n",  inputs);
     layer l = {0};
     l.type = L2NORM;
     l.batch = batch;
@@ -48,6 +48,10 @@ void free_layer(layer l)
     if(l.x_norm)             free(l.x_norm);
     if(l.m)                  free(l.m);
     if(l.v)                  free(l.v);
+    if(l.bias_m)             free(l.bias_m);
+    if(l.bias_v)             free(l.bias_v);
+    if(l.scale_m)            free(l.scale_m);
+    if(l.scale_v)            free(l.scale_v);
     if(l.z_cpu)              free(l.z_cpu);
     if(l.r_cpu)              free(l.r_cpu);
     if(l.h_cpu)              free(l.h_cpu);
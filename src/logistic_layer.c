@@ -11,7 +11,7 @@
 
 layer make_logistic_layer(int batch, int inputs)
 {
-    fprintf(stderr, "logistic x entropy                             %4d\n",  inputs);
+    if(!quiet_build) fprintf(stderr, "logistic x entropy                             %4d\n",  inputs);
     layer l = {0};
     l.type = LOGXENT;
     l.batch = batch;
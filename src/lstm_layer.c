@@ -26,9 +26,9 @@ static void increment_layer(layer *l, int steps)
 #endif
 }
 
-layer make_lstm_layer(int batch, int inputs, int outputs, int steps, int batch_normalize, int adam)
+layer make_lstm_layer(int batch, int inputs, int outputs, int steps, int batch_normalize, int adam, int init)
 {
-    fprintf(stderr, "LSTM Layer: %d inputs, %d outputs\n", inputs, outputs);
+    if(!quiet_build) fprintf(stderr, "LSTM Layer: %d inputs, %d outputs\n", inputs, outputs);
     batch = batch / steps;
     layer l = { 0 };
     l.batch = batch;
@@ -37,43 +37,43 @@ layer make_lstm_layer(int batch, int inputs, int outputs, int steps, int batch_n
     l.inputs = inputs;
 
     l.uf = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.uf) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.uf) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam, init);
     l.uf->batch = batch;
 
     l.ui = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.ui) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.ui) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam, init);
     l.ui->batch = batch;
 
     l.ug = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.ug) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.ug) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam, init);
     l.ug->batch = batch;
 
     l.uo = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.uo) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.uo) = make_connected_layer(batch*steps, inputs, outputs, LINEAR, batch_normalize, adam, init);
     l.uo->batch = batch;
 
     l.wf = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.wf) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.wf) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam, init);
     l.wf->batch = batch;
 
     l.wi = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.wi) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.wi) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam, init);
     l.wi->batch = batch;
 
     l.wg = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.wg) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.wg) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam, init);
     l.wg->batch = batch;
 
     l.wo = malloc(sizeof(layer));
-    fprintf(stderr, "\t\t");
-    *(l.wo) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam);
+    if(!quiet_build) fprintf(stderr, "\t\t");
+    *(l.wo) = make_connected_layer(batch*steps, outputs, outputs, LINEAR, batch_normalize, adam, init);
     l.wo->batch = batch;
 
     l.batch_normalize = batch_normalize;
@@ -153,8 +153,97 @@ void update_lstm_layer(layer l, update_args a)
     update_connected_layer(*(l.uo), a);
 }
 
+/* The input path doesn't depend on the state, so every step of it is one
+ * GEMM: the sub-layer seen as a batch of batch*steps rows. */
+static void forward_all_steps(layer l, network net, int steps)
+{
+    l.batch *= steps;
+    forward_connected_layer(l, net);
+}
+
+/* Everything after the gate GEMMs of a step in one pass: the gates, the cell
+ * and the output.  The sub-layer outputs keep the pre-activations that
+ * backward_lstm_layer squashes again.  The buffers are all distinct, which
+ * the compiler can't check for a dozen of them by itself. */
+static void lstm_cell(int n, const float *restrict wf, const float *restrict uf, const float *restrict wi, const float *restrict ui,
+        const float *restrict wg, const float *restrict ug, const float *restrict wo, const float *restrict uo,
+        float *restrict cell, float *restrict cells, float *restrict hidden, float *restrict output)
+{
+    int j;
+    for(j = 0; j < n; ++j){
+        float f = fast_logistic(wf[j] + uf[j]);
+        float in = fast_logistic(wi[j] + ui[j]);
+        float g = fast_tanh(wg[j] + ug[j]);
+        float o = fast_logistic(wo[j] + uo[j]);
+        float c = cell[j]*f + in*g;
+        float h = fast_tanh(c)*o;
+        cell[j] = c;
+        cells[j] = c;
+        hidden[j] = h;
+        output[j] = h;
+    }
+}
+
+/* Batchnorm takes statistics per step, so only layers without it can
+ * project all steps at once. */
+static void forward_lstm_fused(layer l, network state)
+{
+    network s = { 0 };
+    s.train = state.train;
+    int i;
+    layer wf = *(l.wf);
+    layer wi = *(l.wi);
+    layer wg = *(l.wg);
+    layer wo = *(l.wo);
+
+    layer uf = *(l.uf);
+    layer ui = *(l.ui);
+    layer ug = *(l.ug);
+    layer uo = *(l.uo);
+
+    if (state.train) {
+        layer *gates[] = {&wf, &wi, &wg, &wo, &uf, &ui, &ug, &uo};
+        for (i = 0; i < 8; ++i) fill_cpu(l.outputs * l.batch * l.steps, 0, gates[i]->delta, 1);
+        fill_cpu(l.outputs * l.batch * l.steps, 0, l.delta, 1);
+    }
+
+    s.input = state.input;
+    forward_all_steps(uf, s, l.steps);
+    forward_all_steps(ui, s, l.steps);
+    forward_all_steps(ug, s, l.steps);
+    forward_all_steps(uo, s, l.steps);
+
+    for (i = 0; i < l.steps; ++i) {
+        s.input = l.h_cpu;
+        forward_connected_layer(wf, s);
+        forward_connected_layer(wi, s);
+        forward_connected_layer(wg, s);
+        forward_connected_layer(wo, s);
+
+        lstm_cell(l.outputs*l.batch, wf.output, uf.output, wi.output, ui.output, wg.output, ug.output, wo.output, uo.output,
+                l.c_cpu, l.cell_cpu, l.h_cpu, l.output);
+
+        l.output    += l.outputs*l.batch;
+        l.cell_cpu  += l.outputs*l.batch;
+
+        increment_layer(&wf, 1);
+        increment_layer(&wi, 1);
+        increment_layer(&wg, 1);
+        increment_layer(&wo, 1);
+
+        increment_layer(&uf, 1);
+        increment_layer(&ui, 1);
+        increment_layer(&ug, 1);
+        increment_layer(&uo, 1);
+    }
+}
+
 void forward_lstm_layer(layer l, network state)
 {
+    if (!l.batch_normalize) {
+        forward_lstm_fused(l, state);
+        return;
+    }
     network s = { 0 };
     s.train = state.train;
     int i;
@@ -35,7 +35,6 @@ maxpool_layer make_maxpool_layer(int batch, int h, int w, int c, int size, int s
     l.size = size;
     l.stride = stride;
     int output_size = l.out_h * l.out_w * l.out_c * batch;
-    l.indexes = calloc(output_size, sizeof(int));
     l.output =  calloc(output_size, sizeof(float));
     l.delta =   calloc(output_size, sizeof(float));
     l.forward = forward_maxpool_layer;
@@ -47,7 +46,7 @@ maxpool_layer make_maxpool_layer(int batch, int h, int w, int c, int size, int s
     l.output_gpu  = cuda_make_array(l.output, output_size);
     l.delta_gpu   = cuda_make_array(l.delta, output_size);
     #endif
-    fprintf(stderr, "max          %d x %d / %d  %4d x%4d x%4d   ->  %4d x%4d x%4d\n", size, size, stride, w, h, c, l.out_w, l.out_h, l.out_c);
+    if(!quiet_build) fprintf(stderr, "max          %d x %d / %d  %4d x%4d x%4d   ->  %4d x%4d x%4d\n", size, size, stride, w, h, c, l.out_w, l.out_h, l.out_c);
     return l;
 }
 
@@ -62,7 +61,6 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     l->outputs = l->out_w * l->out_h * l->c;
     int output_size = l->outputs * l->batch;
 
-    l->indexes = realloc(l->indexes, output_size * sizeof(int));
     l->output = realloc(l->output, output_size * sizeof(float));
     l->delta = realloc(l->delta, output_size * sizeof(float));
 
@@ -76,52 +74,159 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     #endif
 }
 
-void forward_maxpool_layer(const maxpool_layer l, network net)
+/* Index into the input of the first largest tap of output (i, j) of plane
+ * (b, k), or -1 if the window lies outside the input. */
+static int maxpool_argmax(const maxpool_layer l, const float *input, int b, int k, int i, int j)
 {
-    int b,i,j,k,m,n;
-    int w_offset = -l.pad;
-    int h_offset = -l.pad;
+    int m,n;
+    float max = -FLT_MAX;
+    int max_i = -1;
+    for(n = 0; n < l.size; ++n){
+        for(m = 0; m < l.size; ++m){
+            int cur_h = -l.pad + i*l.stride + n;
+            int cur_w = -l.pad + j*l.stride + m;
+            int index = cur_w + l.w*(cur_h + l.h*(k + b*l.c));
+            int valid = (cur_h >= 0 && cur_h < l.h &&
+                         cur_w >= 0 && cur_w < l.w);
+            float val = (valid != 0) ? input[index] : -FLT_MAX;
+            max_i = (val > max) ? index : max_i;
+            max   = (val > max) ? val   : max;
+        }
+    }
+    return max_i;
+}
 
-    int h = l.out_h;
-    int w = l.out_w;
-    int c = l.c;
+/* 2x2/2 without padding never leaves the input. */
+static void maxpool_2x2s2(const maxpool_layer l, const float *in, float *out)
+{
+    int i,j;
+    for(i = 0; i < l.out_h; ++i){
+        const float *a = in + 2*i*l.w;
+        const float *b = a + l.w;
+        float *o = out + i*l.out_w;
+        for(j = 0; j < l.out_w; ++j){
+            float x = (a[2*j+1] > a[2*j]) ? a[2*j+1] : a[2*j];
+            float y = (b[2*j+1] > b[2*j]) ? b[2*j+1] : b[2*j];
+            o[j] = (y > x) ? y : x;
+        }
+    }
+}
 
-    for(b = 0; b < l.batch; ++b){
-        for(k = 0; k < c; ++k){
-            for(i = 0; i < h; ++i){
-                for(j = 0; j < w; ++j){
-                    int out_index = j + w*(i + h*(k + c*b));
-                    float max = -FLT_MAX;
-                    int max_i = -1;
-                    for(n = 0; n < l.size; ++n){
-                        for(m = 0; m < l.size; ++m){
-                            int cur_h = h_offset + i*l.stride + n;
-                            int cur_w = w_offset + j*l.stride + m;
-                            int index = cur_w + l.w*(cur_h + l.h*(k + b*l.c));
-                            int valid = (cur_h >= 0 && cur_h < l.h &&
-                                         cur_w >= 0 && cur_w < l.w);
-                            float val = (valid != 0) ? net.input[index] : -FLT_MAX;
-                            max_i = (val > max) ? index : max_i;
-                            max   = (val > max) ? val   : max;
-                        }
-                    }
-                    l.output[out_index] = max;
-                    l.indexes[out_index] = max_i;
+/* Any shape: each tap is a run of outputs whose column stays inside the
+ * input, found up front, so the inner loop has no bounds checks and
+ * vectorizes when the stride is 1. */
+static void maxpool_plane(const maxpool_layer l, const float *in, float *out)
+{
+    int i,j,m,n;
+    int s = l.stride;
+    for(i = 0; i < l.out_h; ++i){
+        float *o = out + i*l.out_w;
+        for(j = 0; j < l.out_w; ++j) o[j] = -FLT_MAX;
+        for(n = 0; n < l.size; ++n){
+            int row = i*s - l.pad + n;
+            if(row < 0 || row >= l.h) continue;
+            const float *r = in + row*l.w;
+            for(m = 0; m < l.size; ++m){
+                int col = m - l.pad;
+                int lo = (col < 0) ? (-col + s - 1)/s : 0;
+                int hi = (l.w - col + s - 1)/s;
+                if(hi > l.out_w) hi = l.out_w;
+                for(j = lo; j < hi; ++j){
+                    float v = r[j*s + col];
+                    o[j] = (v > o[j]) ? v : o[j];
                 }
             }
         }
     }
 }
 
+/* No argmax is kept: backward finds it again from the input, so any
+ * forward, training or not, can be followed by a backward. */
+void forward_maxpool_layer(const maxpool_layer l, network net)
+{
+    int p;
+    int planes = l.batch*l.c;
+    int fast = l.size == 2 && l.stride == 2 && l.pad == 0;
+    #pragma omp parallel for
+    for(p = 0; p < planes; ++p){
+        const float *in = net.input + (size_t)p*l.h*l.w;
+        float *out = l.output + (size_t)p*l.out_h*l.out_w;
+        if(fast) maxpool_2x2s2(l, in, out);
+        else maxpool_plane(l, in, out);
+    }
+}
+
+/* Planes don't share inputs, so they can scatter in parallel. */
 void backward_maxpool_layer(const maxpool_layer l, network net)
 {
-    int i;
-    int h = l.out_h;
-    int w = l.out_w;
-    int c = l.c;
-    for(i = 0; i < h*w*c*l.batch; ++i){
-        int index = l.indexes[i];
-        net.delta[index] += l.delta[i];
+    int p;
+    int planes = l.batch*l.c;
+    #pragma omp parallel for
+    for(p = 0; p < planes; ++p){
+        int i, j;
+        int b = p / l.c;
+        int k = p % l.c;
+        float *delta = l.delta + (size_t)p*l.out_h*l.out_w;
+        for(i = 0; i < l.out_h; ++i){
+            for(j = 0; j < l.out_w; ++j){
+                int index = maxpool_argmax(l, net.input, b, k, i, j);
+                if(index >= 0) net.delta[index] += delta[j + i*l.out_w];
+            }
+        }
     }
 }
 
+/* Checks the input gradient after an inference forward, and after a
+ * resize, against the argmax written out by hand. */
+int test_maxpool_layer()
+{
+    int shapes[][5] = {{13, 13, 2, 2, 0}, {13, 13, 2, 1, 0}, {9, 7, 3, 2, 1}, {8, 8, 5, 1, 2}};
+    int s, pass, wrong = 0;
+    for(s = 0; s < sizeof(shapes)/sizeof(shapes[0]); ++s){
+        int *d = shapes[s];
+        maxpool_layer l = make_maxpool_layer(2, d[1], d[0], 3, d[2], d[3], d[4]);
+        for(pass = 0; pass < 2; ++pass){
+            if(pass) resize_maxpool_layer(&l, d[0] + 3, d[1] + 2);
+            int i, j, k, m, n;
+            network net = {0};
+            net.train = 0;
+            net.input = calloc(l.batch*l.inputs, sizeof(float));
+            net.delta = calloc(l.batch*l.inputs, sizeof(float));
+            float *expected = calloc(l.batch*l.inputs, sizeof(float));
+            for(i = 0; i < l.batch*l.inputs; ++i) net.input[i] = rand()%17;
+            for(i = 0; i < l.batch*l.outputs; ++i) l.delta[i] = rand()/(float)RAND_MAX;
+            forward_maxpool_layer(l, net);
+            backward_maxpool_layer(l, net);
+            for(k = 0; k < l.batch*l.c; ++k){
+                for(i = 0; i < l.out_h; ++i){
+                    for(j = 0; j < l.out_w; ++j){
+                        float max = -FLT_MAX;
+                        int max_i = -1;
+                        for(n = 0; n < l.size; ++n){
+                            for(m = 0; m < l.size; ++m){
+                                int y = i*l.stride - l.pad + n;
+                                int x = j*l.stride - l.pad + m;
+                                if(y < 0 || y >= l.h || x < 0 || x >= l.w) continue;
+                                int index = x + l.w*(y + l.h*k);
+                                if(net.input[index] > max){
+                                    max = net.input[index];
+                                    max_i = index;
+                                }
+                            }
+                        }
+                        int out = j + l.out_w*(i + l.out_h*k);
+                        if(l.output[out] != max) ++wrong;
+                        if(max_i >= 0) expected[max_i] += l.delta[out];
+                    }
+                }
+            }
+            for(i = 0; i < l.batch*l.inputs; ++i) if(expected[i] != net.delta[i]) ++wrong;
+            free(expected);
+            free(net.input);
+            free(net.delta);
+        }
+        free_layer(l);
+    }
+    printf("maxpool: %d wrong values\n", wrong);
+    return wrong != 0;
+}
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "memory_report.h"
+#include "network.h"
+#include "recompute.h"
+
+static char *category_names[MEMORY_CATEGORIES] = {"output", "delta", "weights", "grads", "optim",
+    "bn stats", "bn bufs", "indexes", "other", "workspace"};
+
+/* Everything forward needs; the rest only exists so backward and update can run. */
+int memory_for_inference(memory_category c)
+{
+    return c == MEMORY_OUTPUT || c == MEMORY_WEIGHTS || c == MEMORY_BN_STATS
+        || c == MEMORY_INDEXES || c == MEMORY_OTHER || c == MEMORY_WORKSPACE;
+}
+
+static void add_floats(size_t *bytes, memory_category c, void *p, size_t n)
+{
+    if(p) bytes[c] += n*sizeof(float);
+}
+
+/* Mirrors the callocs in the make_*_layer functions.  batch is the layer's own
+ * batch, which for recurrent layers is the per-step batch; their sublayers
+ * allocate for all steps at once. */
+void layer_memory(layer l, int batch, size_t *bytes)
+{
+    size_t out = (size_t)batch*l.outputs;
+    size_t in = (size_t)batch*l.inputs;
+    size_t steps = (l.steps > 0) ? l.steps : 1;
+    size_t nw = 0;
+    size_t nb = 0;
+    size_t nu;
+
+    switch(l.type){
+        case CONVOLUTIONAL:
+        case DILATED_CONVOLUTIONAL:
+        case DECONVOLUTIONAL:
+            nw = l.nweights;
+            nb = l.n;
+            break;
+        case CONNECTED:
+            nw = (size_t)l.inputs*l.outputs;
+            nb = l.outputs;
+            break;
+        case LOCAL:
+            nw = (size_t)l.size*l.size*l.c*l.n*l.out_h*l.out_w;
+            nb = l.outputs;
+            break;
+        case BATCHNORM:
+            nb = l.c;
+            break;
+        case YOLO:
+            nb = 2*l.total;
+            break;
+        case REGION:
+            nb = 2*l.n;
+            break;
+        case RNN:
+            layer_memory(*l.input_layer, batch*steps, bytes);
+            layer_memory(*l.self_layer, batch*steps, bytes);
+            layer_memory(*l.output_layer, batch*steps, bytes);
+            bytes[MEMORY_OTHER] += 2*out*sizeof(float);
+            return;
+        case CRNN:
+            layer_memory(*l.input_layer, batch*steps, bytes);
+            layer_memory(*l.self_layer, batch*steps, bytes);
+            layer_memory(*l.output_layer, batch*steps, bytes);
+            bytes[MEMORY_OTHER] += (size_t)l.hidden*batch*(steps+1)*sizeof(float);
+            return;
+        case GRU:
+            layer_memory(*l.uz, batch*steps, bytes);
+            layer_memory(*l.wz, batch*steps, bytes);
+            layer_memory(*l.ur, batch*steps, bytes);
+            layer_memory(*l.wr, batch*steps, bytes);
+            layer_memory(*l.uh, batch*steps, bytes);
+            layer_memory(*l.wh, batch*steps, bytes);
+            add_floats(bytes, MEMORY_OUTPUT, l.output, out*steps);
+            add_floats(bytes, MEMORY_DELTA, l.delta, out*steps);
+            bytes[MEMORY_OTHER] += 7*out*sizeof(float);
+            return;
+        case LSTM:
+            layer_memory(*l.uf, batch*steps, bytes);
+            layer_memory(*l.ui, batch*steps, bytes);
+            layer_memory(*l.ug, batch*steps, bytes);
+            layer_memory(*l.uo, batch*steps, bytes);
+            layer_memory(*l.wf, batch*steps, bytes);
+            layer_memory(*l.wi, batch*steps, bytes);
+            layer_memory(*l.wg, batch*steps, bytes);
+            layer_memory(*l.wo, batch*steps, bytes);
+            add_floats(bytes, MEMORY_OUTPUT, l.output, out*steps);
+            // state, previous state and cell, the cell history and eleven gate buffers
+            bytes[MEMORY_OTHER] += (14 + steps)*out*sizeof(float);
+            return;
+        default:
+            break;
+    }
+    nu = (l.type == YOLO) ? 2*l.n : nb;
+
+    // a dropout layer works in place on the previous layer's buffers
+    if(l.type != DROPOUT){
+        add_floats(bytes, MEMORY_OUTPUT, l.output, out);
+        add_floats(bytes, MEMORY_DELTA, l.delta, out);
+    }
+
+    add_floats(bytes, MEMORY_WEIGHTS, l.weights, nw);
+    add_floats(bytes, MEMORY_WEIGHTS, l.biases, nb);
+    if(l.type == L2NORM) add_floats(bytes, MEMORY_OTHER, l.scales, in);
+    else add_floats(bytes, MEMORY_WEIGHTS, l.scales, nb);
+
+    add_floats(bytes, MEMORY_GRADIENTS, l.weight_updates, nw);
+    add_floats(bytes, MEMORY_GRADIENTS, l.bias_updates, nu);
+    add_floats(bytes, MEMORY_GRADIENTS, l.scale_updates, nb);
+
+    add_floats(bytes, MEMORY_OPTIMIZER, l.m, nw);
+    add_floats(bytes, MEMORY_OPTIMIZER, l.v, nw);
+    add_floats(bytes, MEMORY_OPTIMIZER, l.bias_m, nb);
+    add_floats(bytes, MEMORY_OPTIMIZER, l.bias_v, nb);
+    add_floats(bytes, MEMORY_OPTIMIZER, l.scale_m, nb);
+    add_floats(bytes, MEMORY_OPTIMIZER, l.scale_v, nb);
+
+    add_floats(bytes, MEMORY_BN_STATS, l.mean, nb);
+    add_floats(bytes, MEMORY_BN_STATS, l.variance, nb);
+    add_floats(bytes, MEMORY_BN_STATS, l.rolling_mean, nb);
+    add_floats(bytes, MEMORY_BN_STATS, l.rolling_variance, nb);
+
+    add_floats(bytes, MEMORY_BN_BUFFERS, l.mean_delta, nb);
+    add_floats(bytes, MEMORY_BN_BUFFERS, l.variance_delta, nb);
+    add_floats(bytes, MEMORY_BN_BUFFERS, l.x, out);
+    add_floats(bytes, MEMORY_BN_BUFFERS, l.x_norm, out);
+
+    if(l.indexes) bytes[MEMORY_INDEXES] += out*sizeof(int);
+
+    add_floats(bytes, MEMORY_OTHER, l.binary_weights, nw);
+    if(l.cweights) bytes[MEMORY_OTHER] += nw*sizeof(char);
+    add_floats(bytes, MEMORY_OTHER, l.binary_input, in);
+    add_floats(bytes, MEMORY_OTHER, l.loss, in);
+    add_floats(bytes, MEMORY_OTHER, l.rand, in);
+    add_floats(bytes, MEMORY_OTHER, l.squared, out);
+    add_floats(bytes, MEMORY_OTHER, l.norms, out);
+    add_floats(bytes, MEMORY_OTHER, l.cost, 1);
+    if(l.type == YOLO && l.mask) bytes[MEMORY_OTHER] += l.n*sizeof(int);
+}
+
+/* Layer batches scale with the network batch, so a report for a batch other
+ * than the one in the cfg only needs the ratio. */
+static int layer_batch(network *net, layer l, int batch)
+{
+    if(net->batch <= 0) return l.batch;
+    return (int)((size_t)l.batch*batch/net->batch);
+}
+
+void network_memory_categories(network *net, int batch, size_t *bytes)
+{
+    int i;
+    size_t workspace = 0;
+    memset(bytes, 0, MEMORY_CATEGORIES*sizeof(size_t));
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        layer_memory(l, layer_batch(net, l, batch), bytes);
+        if(l.workspace_size > workspace) workspace = l.workspace_size;
+    }
+    bytes[MEMORY_OUTPUT] += (size_t)net->inputs*batch*sizeof(float);
+    bytes[MEMORY_OTHER] += (size_t)net->truths*batch*sizeof(float) + net->n*sizeof(layer);
+    bytes[MEMORY_WORKSPACE] += workspace;
+    recompute_memory(net, batch, bytes);
+}
+
+size_t network_memory(network *net, int batch, int train)
+{
+    size_t bytes[MEMORY_CATEGORIES];
+    size_t total = 0;
+    int c;
+    network_memory_categories(net, batch, bytes);
+    for(c = 0; c < MEMORY_CATEGORIES; ++c){
+        if(train || memory_for_inference(c)) total += bytes[c];
+    }
+    return total;
+}
+
+/* Bytes the allocator currently has handed out, used to check the accounting
+ * against what parse_network_cfg really allocated.  Includes per-chunk
+ * overhead, so it always reads a little high. */
+size_t heap_bytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+    struct mallinfo mi = mallinfo();
+    return (size_t)(unsigned)mi.uordblks + (size_t)(unsigned)mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static double mb(size_t bytes)
+{
+    return bytes / (1024.*1024.);
+}
+
+static size_t *sort_totals;
+
+static int memory_comparator(const void *pa, const void *pb)
+{
+    size_t a = sort_totals[*(int *)pa];
+    size_t b = sort_totals[*(int *)pb];
+    if(a > b) return -1;
+    if(a < b) return 1;
+    return *(int *)pa - *(int *)pb;
+}
+
+void print_network_memory(network *net, int batch, FILE *fp)
+{
+    int i, c;
+    int top = 5;
+    size_t totals[MEMORY_CATEGORIES];
+    size_t *train = calloc(net->n, sizeof(size_t));
+    int *order = calloc(net->n, sizeof(int));
+    size_t **layers = calloc(net->n, sizeof(size_t *));
+    size_t train_total = 0;
+    size_t infer_total = 0;
+
+    network_memory_categories(net, batch, totals);
+    for(c = 0; c < MEMORY_CATEGORIES; ++c){
+        train_total += totals[c];
+        if(memory_for_inference(c)) infer_total += totals[c];
+    }
+    for(i = 0; i < net->n; ++i){
+        layers[i] = calloc(MEMORY_CATEGORIES, sizeof(size_t));
+        layer_memory(net->layers[i], layer_batch(net, net->layers[i], batch), layers[i]);
+        for(c = 0; c < MEMORY_CATEGORIES; ++c) train[i] += layers[i][c];
+        order[i] = i;
+    }
+    sort_totals = train;
+    qsort(order, net->n, sizeof(int), memory_comparator);
+    if(top > net->n) top = net->n;
+
+    fprintf(fp, "\nMemory for batch %d (MB), * marks the %d largest layers\n", batch, top);
+    fprintf(fp, "  layer %-21s", "type");
+    for(c = 0; c < MEMORY_WORKSPACE; ++c) fprintf(fp, " %8s", category_names[c]);
+    fprintf(fp, "    infer    train\n");
+    for(i = 0; i < net->n; ++i){
+        int j;
+        int mark = 0;
+        size_t infer = 0;
+        for(j = 0; j < top; ++j) if(order[j] == i) mark = 1;
+        fprintf(fp, "%c %5d %-21s", mark ? '*' : ' ', i, get_layer_string(net->layers[i].type));
+        for(c = 0; c < MEMORY_WORKSPACE; ++c){
+            fprintf(fp, " %8.2f", mb(layers[i][c]));
+            if(memory_for_inference(c)) infer += layers[i][c];
+        }
+        fprintf(fp, " %8.2f %8.2f\n", mb(infer), mb(train[i]));
+    }
+
+    fprintf(fp, "\nLargest layers for training:\n");
+    for(i = 0; i < top; ++i){
+        int index = order[i];
+        fprintf(fp, "%4d. layer %3d %-21s %9.2f MB %6.2f%%\n", i+1, index,
+                get_layer_string(net->layers[index].type), mb(train[index]),
+                train_total ? 100.*train[index]/train_total : 0);
+    }
+
+    fprintf(fp, "\ncategory     inference MB  training MB\n");
+    for(c = 0; c < MEMORY_CATEGORIES; ++c){
+        fprintf(fp, "%-12s %12.2f %12.2f\n", category_names[c],
+                memory_for_inference(c) ? mb(totals[c]) : 0, mb(totals[c]));
+    }
+    fprintf(fp, "%-12s %12.2f %12.2f\n", "total", mb(infer_total), mb(train_total));
+
+    for(i = 0; i < net->n; ++i) free(layers[i]);
+    free(layers);
+    free(order);
+    free(train);
+}
@@ -0,0 +1,16 @@
+#ifndef MEMORY_REPORT_H
+#define MEMORY_REPORT_H
+#include "darknet.h"
+
+#define MEMORY_CATEGORIES 10
+
+typedef enum{
+    MEMORY_OUTPUT, MEMORY_DELTA, MEMORY_WEIGHTS, MEMORY_GRADIENTS, MEMORY_OPTIMIZER,
+    MEMORY_BN_STATS, MEMORY_BN_BUFFERS, MEMORY_INDEXES, MEMORY_OTHER, MEMORY_WORKSPACE
+} memory_category;
+
+void layer_memory(layer l, int batch, size_t *bytes);
+void network_memory_categories(network *net, int batch, size_t *bytes);
+int memory_for_inference(memory_category c);
+
+#endif
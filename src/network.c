@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <time.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include "network.h"
 #include "image.h"
 #include "data.h"
 #include "utils.h"
 #include "blas.h"
+#include "parameter_arena.h"
+#include "recompute.h"
 
 #include "crop_layer.h"
 #include "connected_layer.h"
@@ -32,6 +35,9 @@
 #include "shortcut_layer.h"
 #include "parser.h"
 #include "data.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "trace.h"
 
 load_args get_base_args(network *net)
 {
@@ -53,7 +59,14 @@ load_args get_base_args(network *net)
 
 network *load_network(char *cfg, char *weights, int clear)
 {
-    network *net = parse_network_cfg(cfg);
+    return load_network_custom(cfg, weights, clear, 0);
+}
+
+/* load_network with the cfg built for batch images at a time, or at its own
+ * batch if batch is 0.  Plans keep the batch they were compiled for. */
+network *load_network_custom(char *cfg, char *weights, int clear, int batch)
+{
+    network *net = is_network_plan(cfg) ? load_network_plan(cfg) : parse_network_cfg_custom(cfg, batch, 1);
     if(weights && weights[0] != 0){
         load_weights(net, weights);
     }
@@ -171,6 +184,8 @@ char *get_layer_string(LAYER_TYPE a)
             return "normalization";
         case BATCHNORM:
             return "batchnorm";
+        case UPSAMPLE:
+            return "upsample";
         default:
             break;
     }
@@ -188,6 +203,15 @@ network *make_network(int n)
     return net;
 }
 
+void set_network_parallel_layers(network *net, int n)
+{
+    net->parallel_layers = n;
+    if(n < 2){
+        free_layer_scheduler(net->sched);
+        net->sched = 0;
+    }
+}
+
 void forward_network(network *netp)
 {
 #ifdef GPU
@@ -198,19 +222,30 @@ void forward_network(network *netp)
 #endif
     network net = *netp;
     int i;
+    TRACE_BEGIN("forward_network", "network", -1);
+    if(schedule_forward(netp)){
+        calc_network_cost(netp);
+        TRACE_END();
+        return;
+    }
     for(i = 0; i < net.n; ++i){
         net.index = i;
         layer l = net.layers[i];
         if(l.delta){
             fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
         }
+        TRACE_BEGIN(get_layer_string(l.type), "forward", i);
+        double start = profile_start(net.prof);
         l.forward(l, net);
+        profile_stop(net.prof, i, l, PROFILE_FORWARD, start);
+        TRACE_END();
         net.input = l.output;
         if(l.truth) {
             net.truth = l.output;
         }
     }
     calc_network_cost(netp);
+    TRACE_END();
 }
 
 void update_network(network *netp)
@@ -221,6 +256,7 @@ void update_network(network *netp)
         return;
     }
 #endif
+    pack_network_parameters(netp);
     network net = *netp;
     int i;
     update_args a = {0};
@@ -229,18 +265,26 @@ void update_network(network *netp)
     a.momentum = net.momentum;
     a.decay = net.decay;
     a.adam = net.adam;
+    a.adamw = net.adamw;
     a.B1 = net.B1;
     a.B2 = net.B2;
     a.eps = net.eps;
     ++*net.t;
     a.t = *net.t;
 
+    TRACE_BEGIN("update_network", "network", -1);
+    update_parameter_arena(netp, a);
     for(i = 0; i < net.n; ++i){
         layer l = net.layers[i];
-        if(l.update){
+        if(l.update && !layer_in_arena(netp, i)){
+            TRACE_BEGIN(get_layer_string(l.type), "update", i);
+            double start = profile_start(net.prof);
             l.update(l, a);
+            profile_stop(net.prof, i, l, PROFILE_UPDATE, start);
+            TRACE_END();
         }
     }
+    TRACE_END();
 }
 
 void calc_network_cost(network *netp)
@@ -274,6 +318,7 @@ void backward_network(network *netp)
     network net = *netp;
     int i;
     network orig = net;
+    TRACE_BEGIN("backward_network", "network", -1);
     for(i = net.n-1; i >= 0; --i){
         layer l = net.layers[i];
         if(l.stopbackward) break;
@@ -285,8 +330,58 @@ void backward_network(network *netp)
             net.delta = prev.delta;
         }
         net.index = i;
+        if(net.recompute) recompute_segment(netp, i);
+        TRACE_BEGIN(get_layer_string(l.type), "backward", i);
+        double start = profile_start(net.prof);
         l.backward(l, net);
+        profile_stop(net.prof, i, l, PROFILE_BACKWARD, start);
+        TRACE_END();
+        if(net.dist) layer_backward_done(net.dist, netp, i);
     }
+    TRACE_END();
+}
+
+/* Lengths of layer l's weights, biases, scales, rolling mean and rolling
+ * variance.  Returns 1, or -1 for a layer with parameters of some other shape
+ * and 0 for a layer without any. */
+int layer_parameter_sizes(layer l, size_t *sizes)
+{
+    size_t n, weights;
+    if(l.type == CONVOLUTIONAL || l.type == DILATED_CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
+        n = l.n;
+        weights = l.nweights;
+    } else if(l.type == CONNECTED){
+        n = l.outputs;
+        weights = (size_t)l.inputs*l.outputs;
+    } else if(l.type == BATCHNORM){
+        n = l.c;
+        weights = 0;
+    } else {
+        return l.update ? -1 : 0;
+    }
+    sizes[0] = weights;
+    sizes[1] = sizes[2] = sizes[3] = sizes[4] = n;
+    return 1;
+}
+
+/* The arrays replicas of a network have to agree on after a backward pass:
+ * layer l's gradients and its batchnorm rolling statistics.  Fills in up to
+ * five and returns how many, or -1 for a layer with parameters of some other
+ * shape. */
+int layer_gradient_arrays(layer l, float **arrays, size_t *sizes)
+{
+    size_t lengths[5];
+    int known = layer_parameter_sizes(l, lengths);
+    if(known <= 0) return known;
+    float *candidates[] = {l.weight_updates, l.bias_updates, l.scale_updates, l.rolling_mean, l.rolling_variance};
+    int i, count = 0;
+    for(i = 0; i < 5; ++i){
+        if(!candidates[i] || !lengths[i]) continue;
+        arrays[count] = candidates[i];
+        sizes[count] = lengths[i];
+        ++count;
+    }
+    return count;
 }
 
 float train_network_datum(network *net)
@@ -296,7 +391,10 @@ float train_network_datum(network *net)
     forward_network(net);
     backward_network(net);
     float error = *net->cost;
-    if(((*net->seen)/net->batch)%net->subdivisions == 0) update_network(net);
+    if(((*net->seen)/net->batch)%net->subdivisions == 0){
+        if(net->dist) finish_gradients(net->dist, net);
+        update_network(net);
+    }
     return error;
 }
 
@@ -365,6 +463,9 @@ int resize_network(network *net, int w, int h)
     cuda_free(net->workspace);
 #endif
     int i;
+    TRACE_BEGIN("resize_network", "network", -1);
+    int replan = net->recompute != 0;
+    if(replan) unplan_recompute(net);
     //if(w == net->w && h == net->h) return 0;
     net->w = w;
     net->h = h;
@@ -374,8 +475,10 @@ int resize_network(network *net, int w, int h)
     //fflush(stderr);
     for (i = 0; i < net->n; ++i){
         layer l = net->layers[i];
-        if(l.type == CONVOLUTIONAL || l.type == DILATED_CONVOLUTIONAL){
+        if(l.type == CONVOLUTIONAL){
             resize_convolutional_layer(&l, w, h);
+        }else if(l.type == DILATED_CONVOLUTIONAL){
+            resize_dilated_conv_layer(&l, w, h);
         }else if(l.type == CROP){
             resize_crop_layer(&l, w, h);
         }else if(l.type == MAXPOOL){
@@ -436,7 +539,9 @@ int resize_network(network *net, int w, int h)
     free(net->workspace);
     net->workspace = calloc(1, workspace_size);
 #endif
+    if(replan) plan_recompute(net);
     //fprintf(stderr, " Done!\n");
+    TRACE_END();
     return 0;
 }
 
@@ -526,29 +631,55 @@ int num_detections(network *net, float thresh)
     return s;
 }
 
-detection *make_network_boxes(network *net, float thresh, int *num)
+/* The most detections the output layers can give at any threshold. */
+static int max_detections(network *net)
 {
-    layer l = net->layers[net->n - 1];
     int i;
-    int nboxes = num_detections(net, thresh);
-    if(num) *num = nboxes;
-    detection *dets = calloc(nboxes, sizeof(detection));
-    for(i = 0; i < nboxes; ++i){
-        dets[i].prob = calloc(l.classes, sizeof(float));
-        if(l.coords > 4){
-            dets[i].mask = calloc(l.coords-4, sizeof(float));
+    int s = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == YOLO || l.type == DETECTION || l.type == REGION) s += l.w*l.h*l.n;
+    }
+    return s;
+}
+
+/* n detections the caller owns, for free_detections: copies of the first
+ * p->size in the pool and empty rows after those. */
+static detection *owned_detections(detection_pool *p, int n)
+{
+    int i;
+    int masks = p->coords > 4 ? p->coords - 4 : 0;
+    detection *dets = calloc(n, sizeof(detection));
+    for(i = 0; i < n; ++i){
+        if(i < p->size) dets[i] = p->dets[i];
+        dets[i].prob = calloc(p->classes, sizeof(float));
+        if(i < p->size) memcpy(dets[i].prob, p->dets[i].prob, p->classes*sizeof(float));
+        if(masks){
+            dets[i].mask = calloc(masks, sizeof(float));
+            if(i < p->size) memcpy(dets[i].mask, p->dets[i].mask, masks*sizeof(float));
         }
     }
     return dets;
 }
 
+detection *make_network_boxes(network *net, float thresh, int *num)
+{
+    int nboxes = num_detections(net, thresh);
+    if(num) *num = nboxes;
+    detection_pool *p = make_detection_pool(net);
+    detection *dets = owned_detections(p, nboxes);
+    free_detection_pool(p);
+    return dets;
+}
+
 void fill_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection *dets)
 {
     int j;
     for(j = 0; j < net->n; ++j){
         layer l = net->layers[j];
         if(l.type == YOLO){
-            int count = get_yolo_detections(l, w, h, net->w, net->h, thresh, map, relative, dets);
+            int count = yolo_fused_output(net) ? decode_yolo_detections(l, w, h, net->w, net->h, thresh, map, relative, dets)
+                : get_yolo_detections(l, w, h, net->w, net->h, thresh, map, relative, dets);
             dets += count;
         }
         if(l.type == REGION){
@@ -562,10 +693,14 @@ void fill_network_boxes(network *net, int w, int h, float thresh, float hier, in
     }
 }
 
+/* A one frame detection pool, handed out as detections the caller owns. */
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num)
 {
-    detection *dets = make_network_boxes(net, thresh, num);
-    fill_network_boxes(net, w, h, thresh, hier, map, relative, dets);
+    detection_pool *p = make_detection_pool(net);
+    int nboxes = fill_detection_pool(p, net, w, h, thresh, hier, map, relative);
+    if(num) *num = nboxes;
+    detection *dets = owned_detections(p, nboxes);
+    free_detection_pool(p);
     return dets;
 }
 
@@ -579,6 +714,55 @@ void free_detections(detection *dets, int n)
     free(dets);
 }
 
+detection_pool *make_detection_pool(network *net)
+{
+    layer l = net->layers[net->n - 1];
+    detection_pool *p = calloc(1, sizeof(detection_pool));
+    p->classes = l.classes;
+    p->coords = l.coords;
+    p->capacity = max_detections(net);
+    p->dets = calloc(p->capacity, sizeof(detection));
+    p->probs = calloc((size_t)p->capacity*p->classes, sizeof(float));
+    if(p->coords > 4) p->masks = calloc((size_t)p->capacity*(p->coords-4), sizeof(float));
+    return p;
+}
+
+/* Clears the pool and fills it with the detections of the last forward,
+ * the same ones get_network_boxes returns, in p->dets[0..p->size).  Sorting
+ * or suppressing them in between is fine: every fill lays the rows out
+ * again.  Grows the pool if the network was resized larger. */
+int fill_detection_pool(detection_pool *p, network *net, int w, int h, float thresh, float hier, int *map, int relative)
+{
+    int i;
+    int nboxes = num_detections(net, thresh);
+    int masks = p->coords > 4 ? p->coords - 4 : 0;
+    if(nboxes > p->capacity){
+        p->capacity = nboxes;
+        p->dets = realloc(p->dets, p->capacity*sizeof(detection));
+        p->probs = realloc(p->probs, (size_t)p->capacity*p->classes*sizeof(float));
+        if(masks) p->masks = realloc(p->masks, (size_t)p->capacity*masks*sizeof(float));
+    }
+    memset(p->dets, 0, nboxes*sizeof(detection));
+    memset(p->probs, 0, (size_t)nboxes*p->classes*sizeof(float));
+    if(masks) memset(p->masks, 0, (size_t)nboxes*masks*sizeof(float));
+    for(i = 0; i < nboxes; ++i){
+        p->dets[i].prob = p->probs + (size_t)i*p->classes;
+        if(masks) p->dets[i].mask = p->masks + (size_t)i*masks;
+    }
+    fill_network_boxes(net, w, h, thresh, hier, map, relative, p->dets);
+    p->size = nboxes;
+    return nboxes;
+}
+
+void free_detection_pool(detection_pool *p)
+{
+    if(!p) return;
+    free(p->dets);
+    free(p->probs);
+    free(p->masks);
+    free(p);
+}
+
 float *network_predict_image(network *net, image im)
 {
     image imr = letterbox_image(im, net->w, net->h);
@@ -716,15 +900,38 @@ float network_accuracy_multi(network *net, data d, int n)
     return acc;
 }
 
+/* Arrays that point into a mapped weight file belong to the mapping. */
+static void forget_mapped_weights(network *net)
+{
+    int i;
+    char *lo = net->weights_map;
+    char *hi = lo + net->weights_map_size;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        float **arrays[] = {&l->biases, &l->scales, &l->rolling_mean, &l->rolling_variance, &l->weights};
+        int k;
+        for(k = 0; k < sizeof(arrays)/sizeof(arrays[0]); ++k){
+            char *p = (char *)*arrays[k];
+            if(p >= lo && p < hi) *arrays[k] = 0;
+        }
+    }
+}
+
 void free_network(network *net)
 {
     int i;
+    free_parameter_arena(net);
+    free_recompute_plan(net);
+    if(net->weights_map) forget_mapped_weights(net);
     for(i = 0; i < net->n; ++i){
         free_layer(net->layers[i]);
     }
+    if(net->weights_map) munmap(net->weights_map, net->weights_map_size);
     free(net->layers);
     if(net->input) free(net->input);
     if(net->truth) free(net->truth);
+    free_profiler(net->prof);
+    free_layer_scheduler(net->sched);
 #ifdef GPU
     if(net->input_gpu) cuda_free(net->input_gpu);
     if(net->truth_gpu) cuda_free(net->truth_gpu);
@@ -817,6 +1024,7 @@ void update_network_gpu(network *netp)
 {
     network net = *netp;
     cuda_set_device(net.gpu_index);
+    if(net.adamw) error("AdamW is only implemented on the CPU");
     int i;
     update_args a = {0};
     a.batch = net.batch*net.subdivisions;
@@ -824,6 +1032,7 @@ void update_network_gpu(network *netp)
     a.momentum = net.momentum;
     a.decay = net.decay;
     a.adam = net.adam;
+    a.adamw = net.adamw;
     a.B1 = net.B1;
     a.B2 = net.B2;
     a.eps = net.eps;
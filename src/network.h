@@ -24,6 +24,9 @@ int get_predicted_class_network(network *net);
 void print_network(network *net);
 int resize_network(network *net, int w, int h);
 void calc_network_cost(network *net);
+int layer_gradient_arrays(layer l, float **arrays, size_t *sizes);
+void layer_backward_done(process_group *g, network *net, int index);
+void finish_gradients(process_group *g, network *net);
 
 #endif
 
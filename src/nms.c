@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "darknet.h"
+#include "utils.h"
+
+/* Greedy NMS that decides exactly what do_nms_sort and do_nms_obj decide,
+ * without their per-class sort of every detection and all-pairs sweep.
+ * Candidates are bucketed by class first, so classes nobody scored cost
+ * nothing, and each bucket is sorted once.  Box edges and areas are kept as
+ * separate arrays and a kept box tests the rest of its bucket in a loop with
+ * no branches, which the compiler vectorizes.  Large buckets are also put on
+ * a uniform grid keyed by each box's left and top edge, so a kept box only
+ * looks at the cells it can overlap.  IoU is computed with the same float
+ * operations as box_iou; ties in score go to the earlier detection. */
+
+#define NMS_GRID_MIN 64     /* smaller buckets are swept in one piece */
+#define NMS_GRID_MAX 64     /* cells per side */
+
+typedef struct{
+    float score;
+    int index;
+} nms_candidate;
+
+/* One bucket laid out cell by cell, ranks ascending within a cell. */
+typedef struct{
+    int n;
+    float *l, *t, *r, *b, *area;
+    int *rank;
+    int *dead;
+    int *pos;           /* rank -> slot */
+    int *cells;         /* cell -> first slot, grid*grid + 1 entries */
+    int grid;
+    float x0, y0, inv_w, inv_h;
+    float max_w, max_h;
+} nms_bucket;
+
+static int candidate_comparator(const void *pa, const void *pb)
+{
+    const nms_candidate *a = pa;
+    const nms_candidate *b = pb;
+    if(a->score > b->score) return -1;
+    if(a->score < b->score) return 1;
+    return a->index - b->index;
+}
+
+static nms_bucket make_nms_bucket(int max)
+{
+    nms_bucket k = {0};
+    k.l = calloc(max, sizeof(float));
+    k.t = calloc(max, sizeof(float));
+    k.r = calloc(max, sizeof(float));
+    k.b = calloc(max, sizeof(float));
+    k.area = calloc(max, sizeof(float));
+    k.rank = calloc(max, sizeof(int));
+    k.dead = calloc(max, sizeof(int));
+    k.pos = calloc(max, sizeof(int));
+    k.cells = calloc(NMS_GRID_MAX*NMS_GRID_MAX + 1, sizeof(int));
+    return k;
+}
+
+static void free_nms_bucket(nms_bucket k)
+{
+    free(k.l);
+    free(k.t);
+    free(k.r);
+    free(k.b);
+    free(k.area);
+    free(k.rank);
+    free(k.dead);
+    free(k.pos);
+    free(k.cells);
+}
+
+static int cell_of(float v, float v0, float inv, int grid)
+{
+    int c = (int)((v - v0)*inv);
+    return c < 0 ? 0 : (c >= grid ? grid - 1 : c);
+}
+
+/* Lays the sorted candidates out on the grid. */
+static void fill_nms_bucket(nms_bucket *k, detection *dets, nms_candidate *c, int n)
+{
+    int i;
+    float min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+    k->n = n;
+    k->max_w = k->max_h = 0;
+    for(i = 0; i < n; ++i){
+        box a = dets[c[i].index].bbox;
+        float l = a.x - a.w/2;
+        float t = a.y - a.h/2;
+        if(!i || l < min_x) min_x = l;
+        if(!i || l > max_x) max_x = l;
+        if(!i || t < min_y) min_y = t;
+        if(!i || t > max_y) max_y = t;
+        if(a.w > k->max_w) k->max_w = a.w;
+        if(a.h > k->max_h) k->max_h = a.h;
+    }
+    int grid = (n < NMS_GRID_MIN) ? 1 : (int)sqrt(n/8.);
+    if(grid > NMS_GRID_MAX) grid = NMS_GRID_MAX;
+    if(grid < 1) grid = 1;
+    k->grid = grid;
+    k->x0 = min_x;
+    k->y0 = min_y;
+    k->inv_w = (max_x > min_x) ? grid/(max_x - min_x) : 0;
+    k->inv_h = (max_y > min_y) ? grid/(max_y - min_y) : 0;
+
+    int *cell = calloc(n, sizeof(int));
+    memset(k->cells, 0, (grid*grid + 1)*sizeof(int));
+    for(i = 0; i < n; ++i){
+        box a = dets[c[i].index].bbox;
+        cell[i] = cell_of(a.y - a.h/2, k->y0, k->inv_h, grid)*grid + cell_of(a.x - a.w/2, k->x0, k->inv_w, grid);
+        ++k->cells[cell[i] + 1];
+    }
+    for(i = 0; i < grid*grid; ++i) k->cells[i+1] += k->cells[i];
+    int *next = calloc(grid*grid, sizeof(int));
+    memcpy(next, k->cells, grid*grid*sizeof(int));
+    for(i = 0; i < n; ++i){
+        box a = dets[c[i].index].bbox;
+        int s = next[cell[i]]++;
+        k->l[s] = a.x - a.w/2;
+        k->r[s] = a.x + a.w/2;
+        k->t[s] = a.y - a.h/2;
+        k->b[s] = a.y + a.h/2;
+        k->area[s] = a.w*a.h;
+        k->rank[s] = i;
+        k->dead[s] = 0;
+        k->pos[i] = s;
+    }
+    free(next);
+    free(cell);
+}
+
+/* Marks every later slot in [start, end) that the box in slot s overlaps by
+ * more than thresh. */
+static void suppress_span(nms_bucket *k, int s, int start, int end, float thresh)
+{
+    int j;
+    float l = k->l[s], t = k->t[s], r = k->r[s], b = k->b[s], area = k->area[s];
+    int rank = k->rank[s];
+    for(j = start; j < end; ++j){
+        float w = ((r < k->r[j]) ? r : k->r[j]) - ((l > k->l[j]) ? l : k->l[j]);
+        float h = ((b < k->b[j]) ? b : k->b[j]) - ((t > k->t[j]) ? t : k->t[j]);
+        float inter = (w < 0 || h < 0) ? 0 : w*h;
+        float iou = inter/(area + k->area[j] - inter);
+        k->dead[j] |= (k->rank[j] > rank) & (iou > thresh);
+    }
+}
+
+static void run_nms_bucket(nms_bucket *k, float thresh)
+{
+    int i, y;
+    int grid = k->grid;
+    for(i = 0; i < k->n; ++i){
+        int s = k->pos[i];
+        if(k->dead[s]) continue;
+        if(grid == 1){
+            suppress_span(k, s, 0, k->n, thresh);
+            continue;
+        }
+        // boxes that can overlap start left of this one's right edge and at
+        // most the widest box left of its left edge, give or take rounding
+        float mx = 1e-5f*(fabsf(k->l[s]) + 2*k->max_w);
+        float my = 1e-5f*(fabsf(k->t[s]) + 2*k->max_h);
+        int x_lo = cell_of(k->l[s] - k->max_w - mx, k->x0, k->inv_w, grid);
+        int x_hi = cell_of(k->r[s], k->x0, k->inv_w, grid);
+        int y_lo = cell_of(k->t[s] - k->max_h - my, k->y0, k->inv_h, grid);
+        int y_hi = cell_of(k->b[s], k->y0, k->inv_h, grid);
+        for(y = y_lo; y <= y_hi; ++y){
+            // the cells of one row are adjacent, so the row is one span
+            suppress_span(k, s, k->cells[y*grid + x_lo], k->cells[y*grid + x_hi + 1], thresh);
+        }
+    }
+}
+
+/* Same result as do_nms_sort, and the detections keep their order. */
+void do_nms_sort_fast(detection *dets, int total, int classes, float thresh)
+{
+    int i, j;
+    int *counts = calloc(classes + 1, sizeof(int));
+    for(i = 0; i < total; ++i){
+        if(dets[i].objectness == 0) continue;
+        for(j = 0; j < classes; ++j) if(dets[i].prob[j] != 0) ++counts[j+1];
+    }
+    int max = 0;
+    for(j = 0; j < classes; ++j){
+        if(counts[j+1] > max) max = counts[j+1];
+        counts[j+1] += counts[j];
+    }
+    if(!max){
+        free(counts);
+        return;
+    }
+    nms_candidate *all = calloc(counts[classes], sizeof(nms_candidate));
+    int *next = calloc(classes, sizeof(int));
+    memcpy(next, counts, classes*sizeof(int));
+    for(i = 0; i < total; ++i){
+        if(dets[i].objectness == 0) continue;
+        for(j = 0; j < classes; ++j){
+            if(dets[i].prob[j] == 0) continue;
+            nms_candidate *c = all + next[j]++;
+            c->score = dets[i].prob[j];
+            c->index = i;
+        }
+    }
+
+    nms_bucket k = make_nms_bucket(max);
+    for(j = 0; j < classes; ++j){
+        int n = counts[j+1] - counts[j];
+        if(!n) continue;
+        nms_candidate *c = all + counts[j];
+        qsort(c, n, sizeof(nms_candidate), candidate_comparator);
+        fill_nms_bucket(&k, dets, c, n);
+        run_nms_bucket(&k, thresh);
+        for(i = 0; i < n; ++i){
+            if(k.dead[k.pos[i]]) dets[c[i].index].prob[j] = 0;
+        }
+    }
+    free_nms_bucket(k);
+    free(next);
+    free(all);
+    free(counts);
+}
+
+/* Same result as do_nms_obj, and the detections keep their order. */
+void do_nms_obj_fast(detection *dets, int total, int classes, float thresh)
+{
+    int i, j, n = 0;
+    nms_candidate *c = calloc(total + 1, sizeof(nms_candidate));
+    for(i = 0; i < total; ++i){
+        if(dets[i].objectness == 0) continue;
+        c[n].score = dets[i].objectness;
+        c[n].index = i;
+        ++n;
+    }
+    if(n){
+        qsort(c, n, sizeof(nms_candidate), candidate_comparator);
+        nms_bucket k = make_nms_bucket(n);
+        fill_nms_bucket(&k, dets, c, n);
+        run_nms_bucket(&k, thresh);
+        for(i = 0; i < n; ++i){
+            if(!k.dead[k.pos[i]]) continue;
+            detection *d = dets + c[i].index;
+            d->objectness = 0;
+            for(j = 0; j < classes; ++j) d->prob[j] = 0;
+        }
+        free_nms_bucket(k);
+    }
+    free(c);
+}
+
+static detection *random_detections(int total, int classes, float density)
+{
+    int i, j;
+    detection *dets = calloc(total, sizeof(detection));
+    for(i = 0; i < total; ++i){
+        detection *d = dets + i;
+        d->classes = classes;
+        d->prob = calloc(classes, sizeof(float));
+        d->bbox.x = rand_uniform(0, 1);
+        d->bbox.y = rand_uniform(0, 1);
+        // mostly small boxes with some large ones, like a multi-scale detector
+        float s = (rand()%8 == 0) ? rand_uniform(.2, .6) : rand_uniform(.02, .12);
+        d->bbox.w = s*rand_uniform(.5, 1.5);
+        d->bbox.h = s*rand_uniform(.5, 1.5);
+        d->objectness = (rand_uniform(0, 1) < .9) ? rand_uniform(0, 1) : 0;
+        if(d->objectness == 0) continue;
+        for(j = 0; j < classes; ++j){
+            if(rand_uniform(0, 1) < density) d->prob[j] = rand_uniform(.001, 1);
+        }
+    }
+    return dets;
+}
+
+static detection *copy_detections(detection *src, int total)
+{
+    int i;
+    detection *dets = calloc(total, sizeof(detection));
+    for(i = 0; i < total; ++i){
+        dets[i] = src[i];
+        dets[i].prob = calloc(src[i].classes, sizeof(float));
+        memcpy(dets[i].prob, src[i].prob, src[i].classes*sizeof(float));
+    }
+    return dets;
+}
+
+static int bbox_comparator(const void *pa, const void *pb)
+{
+    const detection *a = pa;
+    const detection *b = pb;
+    return memcmp(&a->bbox, &b->bbox, sizeof(box));
+}
+
+/* The reference moves detections around, so both sets are put in box order
+ * before they are compared. */
+static int same_detections(detection *a, detection *b, int total, int classes)
+{
+    int i;
+    qsort(a, total, sizeof(detection), bbox_comparator);
+    qsort(b, total, sizeof(detection), bbox_comparator);
+    for(i = 0; i < total; ++i){
+        if(memcmp(&a[i].bbox, &b[i].bbox, sizeof(box))) return 0;
+        if(a[i].objectness != b[i].objectness) return 0;
+        if(memcmp(a[i].prob, b[i].prob, classes*sizeof(float))) return 0;
+    }
+    return 1;
+}
+
+/* Times do_nms_sort and do_nms_obj against their fast versions on random
+ * detections and checks they agree. */
+void nms_report(int total, int classes, float thresh, float density, int rounds)
+{
+    int r, mode;
+    char *names[] = {"sort", "obj"};
+    if(rounds < 1) rounds = 1;
+    printf("%d boxes, %d classes, %.0f%% of class scores nonzero, iou threshold %.2f\n", total, classes, 100*density, thresh);
+    printf("%-5s %12s %12s %8s %10s\n", "nms", "old ms", "fast ms", "speedup", "identical");
+    for(mode = 0; mode < 2; ++mode){
+        double old_time = 0, new_time = 0;
+        int identical = 1;
+        srand(0);
+        for(r = 0; r < rounds; ++r){
+            detection *ref = random_detections(total, classes, density);
+            detection *fast = copy_detections(ref, total);
+            double start = what_time_is_it_now();
+            if(mode) do_nms_obj(ref, total, classes, thresh);
+            else do_nms_sort(ref, total, classes, thresh);
+            double mid = what_time_is_it_now();
+            if(mode) do_nms_obj_fast(fast, total, classes, thresh);
+            else do_nms_sort_fast(fast, total, classes, thresh);
+            new_time += what_time_is_it_now() - mid;
+            old_time += mid - start;
+            if(!same_detections(ref, fast, total, classes)) identical = 0;
+            free_detections(ref, total);
+            free_detections(fast, total);
+        }
+        printf("%-5s %12.3f %12.3f %7.1fx %10s\n", names[mode], 1000*old_time/rounds, 1000*new_time/rounds,
+                new_time > 0 ? old_time/new_time : 0, identical ? "yes" : "NO");
+    }
+}
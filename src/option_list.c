@@ -105,7 +105,7 @@ char *option_find_str(list *l, char *key, char *def)
 {
     char *v = option_find(l, key);
     if(v) return v;
-    if(def) fprintf(stderr, "%s: Using default '%s'\n", key, def);
+    if(def && !quiet_build) fprintf(stderr, "%s: Using default '%s'\n", key, def);
     return def;
 }
 
@@ -113,7 +113,7 @@ int option_find_int(list *l, char *key, int def)
 {
     char *v = option_find(l, key);
     if(v) return atoi(v);
-    fprintf(stderr, "%s: Using default '%d'\n", key, def);
+    if(!quiet_build) fprintf(stderr, "%s: Using default '%d'\n", key, def);
     return def;
 }
 
@@ -135,6 +135,6 @@ float option_find_float(list *l, char *key, float def)
 {
     char *v = option_find(l, key);
     if(v) return atof(v);
-    fprintf(stderr, "%s: Using default '%lf'\n", key, def);
+    if(!quiet_build) fprintf(stderr, "%s: Using default '%lf'\n", key, def);
     return def;
 }
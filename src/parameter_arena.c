@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parameter_arena.h"
+#include "network.h"
+#include "blas.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Packs every trainable array of a network into one aligned block.  The
+ * block has two regions laid out alike: the first holds each layer's
+ * weights, biases and scales, the second their updates at the same offsets
+ * followed by the layer's rolling statistics.  The layer fields are pointed
+ * into the block, so layers keep working unchanged, while the optimizer
+ * steps everything in one sweep and replicas average a layer, or the whole
+ * network, as a single span of the second region.  Networks trained with
+ * Adam get two more regions for the moments. */
+
+#define ARENA_CHUNK (1<<15)
+
+static size_t align_floats(size_t n)
+{
+    return (n + ARENA_ALIGN - 1)/ARENA_ALIGN*ARENA_ALIGN;
+}
+
+static void move_array(network *net, float **p, float *dst, size_t n)
+{
+    if(!*p) return;
+    char *lo = net->weights_map;
+    char *hi = lo + net->weights_map_size;
+    memcpy(dst, *p, n*sizeof(float));
+    if((char *)*p < lo || (char *)*p >= hi) free(*p);
+    *p = dst;
+}
+
+static void add_chunks(parameter_arena *a, int index, size_t offset, size_t size, int decay)
+{
+    size_t i;
+    for(i = 0; i < size; i += ARENA_CHUNK){
+        a->chunks = realloc(a->chunks, (a->nchunks + 1)*sizeof(arena_chunk));
+        arena_chunk *c = a->chunks + a->nchunks++;
+        c->offset = offset + i;
+        c->size = size - i < ARENA_CHUNK ? size - i : ARENA_CHUNK;
+        c->layer = index;
+        c->decay = decay;
+    }
+}
+
+/* Does nothing if the network is already packed. */
+void pack_network_parameters(network *net)
+{
+    int i, k;
+    size_t sizes[5];
+    if(net->arena) return;
+    parameter_arena *a = calloc(1, sizeof(parameter_arena));
+    a->views = calloc(net->n, sizeof(arena_view));
+
+    size_t total = 0;
+    for(i = 0; i < net->n; ++i){
+        if(layer_parameter_sizes(net->layers[i], sizes) <= 0) continue;
+        a->views[i].offset = total;
+        for(k = 0; k < 5; ++k) total += align_floats(sizes[k]);
+        a->views[i].size = total - a->views[i].offset;
+    }
+    a->size = total;
+    a->regions = net->adam ? 4 : 2;
+    size_t bytes = a->regions*total*sizeof(float);
+    if(posix_memalign((void **)&a->data, ARENA_ALIGN*sizeof(float), bytes + 1)) malloc_error();
+    memset(a->data, 0, bytes);
+    a->params = a->data;
+    a->grads = a->data + total;
+    if(net->adam){
+        a->m = a->data + 2*total;
+        a->v = a->data + 3*total;
+    }
+
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(layer_parameter_sizes(*l, sizes) <= 0) continue;
+        float **params[] = {&l->weights, &l->biases, &l->scales, 0, 0};
+        float **grads[] = {&l->weight_updates, &l->bias_updates, &l->scale_updates, &l->rolling_mean, &l->rolling_variance};
+        float **m[] = {&l->m, &l->bias_m, &l->scale_m};
+        float **v[] = {&l->v, &l->bias_v, &l->scale_v};
+        size_t offset = a->views[i].offset;
+        for(k = 0; k < 5; ++k){
+            if(params[k]) move_array(net, params[k], a->params + offset, sizes[k]);
+            move_array(net, grads[k], a->grads + offset, sizes[k]);
+            if(net->adam && k < 3){
+                // layers parsed without adam get their moments here
+                move_array(net, m[k], a->m + offset, sizes[k]);
+                move_array(net, v[k], a->v + offset, sizes[k]);
+                *m[k] = a->m + offset;
+                *v[k] = a->v + offset;
+            }
+            // only what the layer's own update would step
+            if(l->update && k < 3 && *params[k] && *grads[k]) add_chunks(a, i, offset, sizes[k], k == 0);
+            offset += align_floats(sizes[k]);
+        }
+    }
+    net->arena = a;
+}
+
+int layer_in_arena(network *net, int index)
+{
+    return net->arena && net->arena->views[index].size;
+}
+
+/* SGD with momentum and weight decay, or Adam, for every packed layer at
+ * once, the same step update_convolutional_layer and friends take.  AdamW
+ * leaves biases and scales undecayed. */
+void update_parameter_arena(network *net, update_args u)
+{
+    parameter_arena *a = net->arena;
+    int i;
+    if(u.adam && !a->m) error("Network was packed before Adam was turned on");
+    TRACE_BEGIN("update_parameter_arena", "update", -1);
+    #pragma omp parallel for
+    for(i = 0; i < a->nchunks; ++i){
+        arena_chunk c = a->chunks[i];
+        float rate = u.learning_rate*net->layers[c.layer].learning_rate_scale;
+        if(u.adam){
+            float decay = (c.decay || !u.adamw) ? u.decay : 0;
+            adam_update_cpu(a->params + c.offset, a->grads + c.offset, a->m + c.offset, a->v + c.offset,
+                    u.B1, u.B2, u.eps, decay, rate, c.size, u.batch, u.t, u.adamw);
+        } else {
+            float decay = c.decay ? u.decay*u.batch : 0;
+            momentum_update_cpu(c.size, rate/u.batch, u.momentum, decay, a->params + c.offset, a->grads + c.offset);
+        }
+    }
+    TRACE_END();
+}
+
+/* Takes the layers' arrays back from them before the block goes away. */
+void free_parameter_arena(network *net)
+{
+    parameter_arena *a = net->arena;
+    int i, k;
+    if(!a) return;
+    for(i = 0; i < net->n; ++i){
+        if(!a->views[i].size) continue;
+        layer *l = net->layers + i;
+        float **arrays[] = {&l->weights, &l->biases, &l->scales, &l->weight_updates, &l->bias_updates,
+            &l->scale_updates, &l->rolling_mean, &l->rolling_variance, &l->m, &l->bias_m, &l->scale_m,
+            &l->v, &l->bias_v, &l->scale_v};
+        for(k = 0; k < sizeof(arrays)/sizeof(arrays[0]); ++k){
+            float *p = *arrays[k];
+            if(p >= a->data && p < a->data + a->regions*a->size) *arrays[k] = 0;
+        }
+    }
+    free(a->data);
+    free(a->views);
+    free(a->chunks);
+    free(a);
+    net->arena = 0;
+}
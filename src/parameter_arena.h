@@ -0,0 +1,39 @@
+#ifndef PARAMETER_ARENA_H
+#define PARAMETER_ARENA_H
+#include "darknet.h"
+
+#define ARENA_ALIGN 16  /* floats, so every array starts on a 64 byte line */
+
+/* Where one layer's arrays sit, the same in both regions. */
+typedef struct{
+    size_t offset;
+    size_t size;
+} arena_view;
+
+/* A piece of one array the optimizer steps as a unit. */
+typedef struct{
+    size_t offset;
+    size_t size;
+    int layer;
+    int decay;
+} arena_chunk;
+
+struct parameter_arena{
+    float *data;
+    size_t size;        /* floats in each region */
+    float *params;      /* weights, biases and scales */
+    float *grads;       /* their updates, then the rolling statistics */
+    float *m;           /* Adam's moments, when the network uses it */
+    float *v;
+    int regions;
+    arena_view *views;  /* one per layer, empty for layers kept out */
+    arena_chunk *chunks;
+    int nchunks;
+};
+
+void pack_network_parameters(network *net);
+void update_parameter_arena(network *net, update_args a);
+int layer_in_arena(network *net, int index);
+void free_parameter_arena(network *net);
+
+#endif
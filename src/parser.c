@@ -2,6 +2,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "activation_layer.h"
 #include "logistic_layer.h"
@@ -35,14 +39,15 @@
 #include "shortcut_layer.h"
 #include "softmax_layer.h"
 #include "lstm_layer.h"
+#include "trace.h"
 #include "utils.h"
+#include "weight_file.h"
+#include "recompute.h"
 
-typedef struct{
-    char *type;
-    list *options;
-}section;
+__thread int quiet_build = 0;
 
 list *read_cfg(char *filename);
+list *read_cfg_stream(FILE *file);
 
 LAYER_TYPE string_to_layer_type(char * type)
 {
@@ -127,6 +132,7 @@ typedef struct size_params{
     int c;
     int index;
     int time_steps;
+    int init;
     network *net;
 } size_params;
 
@@ -146,7 +152,7 @@ local_layer parse_local(list *options, size_params params)
     batch=params.batch;
     if(!(h && w && c)) error("Layer before local layer must output image.");
 
-    local_layer layer = make_local_layer(batch,h,w,c,n,size,stride,pad,activation);
+    local_layer layer = make_local_layer(batch,h,w,c,n,size,stride,pad,activation, params.init);
 
     return layer;
 }
@@ -171,7 +177,7 @@ layer parse_deconvolutional(list *options, size_params params)
     int padding = option_find_int_quiet(options, "padding",0);
     if(pad) padding = size/2;
 
-    layer l = make_deconvolutional_layer(batch,h,w,c,n,size,stride,padding, activation, batch_normalize, params.net->adam);
+    layer l = make_deconvolutional_layer(batch,h,w,c,n,size,stride,padding, activation, batch_normalize, params.net->adam, params.init);
 
     return l;
 }
@@ -201,7 +207,7 @@ convolutional_layer parse_convolutional(list *options, size_params params)
     int binary = option_find_int_quiet(options, "binary", 0);
     int xnor = option_find_int_quiet(options, "xnor", 0);
 
-    convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, params.net->adam);
+    convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, params.net->adam, params.init);
     layer.flipped = option_find_int_quiet(options, "flipped", 0);
     layer.dot = option_find_float_quiet(options, "dot", 0);
 
@@ -230,7 +236,7 @@ dilated_convolutional_layer parse_dilated_convolutional(list *options, size_para
     int binary = option_find_int_quiet(options, "binary", 0);
     int xnor = option_find_int_quiet(options, "xnor", 0);
 
-    dilated_convolutional_layer layer = make_dilated_conv_layer(batch,h,w,c,n,groups,size,stride,pad,activation, batch_normalize, binary, xnor, params.net->adam, dilate_rate);
+    dilated_convolutional_layer layer = make_dilated_conv_layer(batch,h,w,c,n,groups,size,stride,pad,activation, batch_normalize, binary, xnor, params.net->adam, dilate_rate, params.init);
     layer.flipped = option_find_int_quiet(options, "flipped", 0);
     layer.dot = option_find_float_quiet(options, "dot", 0);
 
@@ -245,7 +251,7 @@ layer parse_crnn(list *options, size_params params)
     ACTIVATION activation = get_activation(activation_s);
     int batch_normalize = option_find_int_quiet(options, "batch_normalize", 0);
 
-    layer l = make_crnn_layer(params.batch, params.w, params.h, params.c, hidden_filters, output_filters, params.time_steps, activation, batch_normalize);
+    layer l = make_crnn_layer(params.batch, params.w, params.h, params.c, hidden_filters, output_filters, params.time_steps, activation, batch_normalize, params.init);
 
     l.shortcut = option_find_int_quiet(options, "shortcut", 0);
 
@@ -259,7 +265,7 @@ layer parse_rnn(list *options, size_params params)
     ACTIVATION activation = get_activation(activation_s);
     int batch_normalize = option_find_int_quiet(options, "batch_normalize", 0);
 
-    layer l = make_rnn_layer(params.batch, params.inputs, output, params.time_steps, activation, batch_normalize, params.net->adam);
+    layer l = make_rnn_layer(params.batch, params.inputs, output, params.time_steps, activation, batch_normalize, params.net->adam, params.init);
 
     l.shortcut = option_find_int_quiet(options, "shortcut", 0);
 
@@ -271,7 +277,7 @@ layer parse_gru(list *options, size_params params)
     int output = option_find_int(options, "output",1);
     int batch_normalize = option_find_int_quiet(options, "batch_normalize", 0);
 
-    layer l = make_gru_layer(params.batch, params.inputs, output, params.time_steps, batch_normalize, params.net->adam);
+    layer l = make_gru_layer(params.batch, params.inputs, output, params.time_steps, batch_normalize, params.net->adam, params.init);
     l.tanh = option_find_int_quiet(options, "tanh", 0);
 
     return l;
@@ -282,7 +288,7 @@ layer parse_lstm(list *options, size_params params)
     int output = option_find_int(options, "output", 1);
     int batch_normalize = option_find_int_quiet(options, "batch_normalize", 0);
 
-    layer l = make_lstm_layer(params.batch, params.inputs, output, params.time_steps, batch_normalize, params.net->adam);
+    layer l = make_lstm_layer(params.batch, params.inputs, output, params.time_steps, batch_normalize, params.net->adam, params.init);
 
     return l;
 }
@@ -294,7 +300,7 @@ layer parse_connected(list *options, size_params params)
     ACTIVATION activation = get_activation(activation_s);
     int batch_normalize = option_find_int_quiet(options, "batch_normalize", 0);
 
-    layer l = make_connected_layer(params.batch, params.inputs, output, activation, batch_normalize, params.net->adam);
+    layer l = make_connected_layer(params.batch, params.inputs, output, activation, batch_normalize, params.net->adam, params.init);
     return l;
 }
 
@@ -688,6 +694,9 @@ void parse_net_options(list *options, network *net)
     net->random = option_find_int_quiet(options, "random", 0);
 
     net->adam = option_find_int_quiet(options, "adam", 0);
+    // adamw=1 is adam with the weight decay applied to the weights directly
+    net->adamw = option_find_int_quiet(options, "adamw", 0);
+    if(net->adamw) net->adam = 1;
     if(net->adam){
         net->B1 = option_find_float(options, "B1", .9);
         net->B2 = option_find_float(options, "B2", .999);
@@ -704,6 +713,8 @@ void parse_net_options(list *options, network *net)
     net->min_ratio = option_find_float_quiet(options, "min_ratio", (float) net->min_crop / net->w);
     net->center = option_find_int_quiet(options, "center",0);
     net->clip = option_find_float_quiet(options, "clip", 0);
+    net->parallel_layers = option_find_int_quiet(options, "parallel_layers", 0);
+    net->checkpoint = option_find_int_quiet(options, "checkpoint", 0);
 
     net->angle = option_find_float_quiet(options, "angle", 0);
     net->aspect = option_find_float_quiet(options, "aspect", 1);
@@ -762,7 +773,21 @@ int is_network(section *s)
 
 network *parse_network_cfg(char *filename)
 {
-    list *sections = read_cfg(filename);
+    return parse_network_sections(read_cfg(filename), 0, 1);
+}
+
+/* The network in filename built for batch images at a time (per time step),
+ * or the cfg's batch if batch is 0.  With init 0 the weights are left
+ * zeroed for the caller to load or map. */
+network *parse_network_cfg_custom(char *filename, int batch, int init)
+{
+    return parse_network_sections(read_cfg(filename), batch, init);
+}
+
+/* Builds the network described by sections and frees them.  batch and init
+ * are as for parse_network_cfg_custom. */
+network *parse_network_sections(list *sections, int batch, int init)
+{
     node *n = sections->front;
     if(!n) error("Config file has no sections");
     network *net = make_network(sections->size - 1);
@@ -773,6 +798,7 @@ network *parse_network_cfg(char *filename)
     list *options = s->options;
     if(!is_network(s)) error("First section must be [net] or [network]");
     parse_net_options(options, net);
+    if(batch > 0) net->batch = batch*net->time_steps;
 
     params.h = net->h;
     params.w = net->w;
@@ -780,16 +806,17 @@ network *parse_network_cfg(char *filename)
     params.inputs = net->inputs;
     params.batch = net->batch;
     params.time_steps = net->time_steps;
+    params.init = init;
     params.net = net;
 
     size_t workspace_size = 0;
     n = n->next;
     int count = 0;
     free_section(s);
-    fprintf(stderr, "layer        filters         size              input                output\n");
+    if(!quiet_build) fprintf(stderr, "layer        filters         size              input                output\n");
     while(n){
         params.index = count;
-        fprintf(stderr, "%5d ", count);
+        if(!quiet_build) fprintf(stderr, "%5d ", count);
         s = (section *)n->val;
         options = s->options;
         layer l = {0};
@@ -862,6 +889,7 @@ network *parse_network_cfg(char *filename)
         l.truth = option_find_int_quiet(options, "truth", 0);
         l.onlyforward = option_find_int_quiet(options, "onlyforward", 0);
         l.stopbackward = option_find_int_quiet(options, "stopbackward", 0);
+        l.checkpoint = option_find_int_quiet(options, "checkpoint", 0);
         l.dontsave = option_find_int_quiet(options, "dontsave", 0);
         l.dontload = option_find_int_quiet(options, "dontload", 0);
         l.dontloadscales = option_find_int_quiet(options, "dontloadscales", 0);
@@ -905,6 +933,8 @@ network *parse_network_cfg(char *filename)
         net->workspace = calloc(1, workspace_size);
 #endif
     }
+    plan_recompute(net);
+    if(!quiet_build) print_recompute_plan(net, stderr);
     return net;
 }
 
@@ -912,6 +942,13 @@ list *read_cfg(char *filename)
 {
     FILE *file = fopen(filename, "r");
     if(file == 0) file_error(filename);
+    list *options = read_cfg_stream(file);
+    fclose(file);
+    return options;
+}
+
+list *read_cfg_stream(FILE *file)
+{
     char *line;
     int nu = 0;
     list *options = make_list();
@@ -939,7 +976,6 @@ list *read_cfg(char *filename)
                 break;
         }
     }
-    fclose(file);
     return options;
 }
 
@@ -1032,9 +1068,16 @@ void save_weights_upto(network *net, char *filename, int cutoff)
     }
 #endif
     fprintf(stderr, "Saving weights to %s\n", filename);
+    TRACE_BEGIN("save_weights", "io", -1);
     FILE *fp = fopen(filename, "wb");
     if(!fp) file_error(filename);
+    save_weights_to_stream(net, fp, cutoff);
+    fclose(fp);
+    TRACE_END();
+}
 
+void save_weights_to_stream(network *net, FILE *fp, int cutoff)
+{
     int major = 0;
     int minor = 2;
     int revision = 0;
@@ -1095,7 +1138,6 @@ void save_weights_upto(network *net, char *filename, int cutoff)
             fwrite(l.weights, sizeof(float), size, fp);
         }
     }
-    fclose(fp);
 }
 void save_weights(network *net, char *filename)
 {
@@ -1236,6 +1278,10 @@ void load_convolutional_weights(layer l, FILE *fp)
 
 void load_weights_upto(network *net, char *filename, int start, int cutoff)
 {
+    if(is_weight_file(filename)){
+        load_weight_file_upto(net, filename, start, cutoff);
+        return;
+    }
 #ifdef GPU
     if(net->gpu_index >= 0){
         cuda_set_device(net->gpu_index);
@@ -1245,7 +1291,13 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
     fflush(stdout);
     FILE *fp = fopen(filename, "rb");
     if(!fp) file_error(filename);
+    load_weights_from_stream(net, fp, start, cutoff);
+    fprintf(stderr, "Done!\n");
+    fclose(fp);
+}
 
+void load_weights_from_stream(network *net, FILE *fp, int start, int cutoff)
+{
     int major;
     int minor;
     int revision;
@@ -1320,8 +1372,6 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
 #endif
         }
     }
-    fprintf(stderr, "Done!\n");
-    fclose(fp);
 }
 
 void load_weights(network *net, char *filename)
@@ -1329,3 +1379,153 @@ void load_weights(network *net, char *filename)
     load_weights_upto(net, filename, 0, net->n);
 }
 
+typedef struct{
+    float *cursor;
+    float *end;
+} weight_map;
+
+/* Points *dst at the next n floats of the file instead of copying them. */
+static void map_array(weight_map *m, float **dst, size_t n)
+{
+    if(m->cursor + n > m->end) error("Weight file is shorter than the network");
+    free(*dst);
+    *dst = m->cursor;
+    m->cursor += n;
+}
+
+/* For arrays that get rearranged after loading. */
+static void copy_array(weight_map *m, float *dst, size_t n)
+{
+    if(m->cursor + n > m->end) error("Weight file is shorter than the network");
+    memcpy(dst, m->cursor, n*sizeof(float));
+    m->cursor += n;
+}
+
+static void map_normalization(weight_map *m, layer *l, int n)
+{
+    if(!l->batch_normalize || l->dontloadscales) return;
+    map_array(m, &l->scales, n);
+    map_array(m, &l->rolling_mean, n);
+    map_array(m, &l->rolling_variance, n);
+}
+
+static void map_convolutional_weights(weight_map *m, layer *l)
+{
+    map_array(m, &l->biases, l->n);
+    map_normalization(m, l, l->n);
+    if(l->flipped){
+        copy_array(m, l->weights, l->nweights);
+        transpose_matrix(l->weights, l->c*l->size*l->size, l->n);
+    } else {
+        map_array(m, &l->weights, l->nweights);
+    }
+}
+
+static void map_connected_weights(weight_map *m, layer *l, int transpose)
+{
+    map_array(m, &l->biases, l->outputs);
+    if(transpose){
+        copy_array(m, l->weights, l->outputs*l->inputs);
+        transpose_matrix(l->weights, l->inputs, l->outputs);
+    } else {
+        map_array(m, &l->weights, l->outputs*l->inputs);
+    }
+    map_normalization(m, l, l->outputs);
+}
+
+/* Same file and layout as load_weights, but the arrays point into a private
+ * mapping of the file, so processes serving the same weights share the page
+ * cache and nothing is read until a layer first touches it.  Writes (training,
+ * fusing) copy the touched pages.  free_network unmaps the file. */
+void map_weights(network *net, char *filename)
+{
+    if(net->arena) error("Can't map weights into a network packed for training");
+    if(is_weight_file(filename)){
+        map_weight_file(net, filename);
+        return;
+    }
+#ifdef GPU
+    if(net->gpu_index >= 0){
+        load_weights(net, filename);
+        return;
+    }
+#endif
+    fprintf(stderr, "Mapping weights from %s...", filename);
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) file_error(filename);
+    struct stat st;
+    if(fstat(fd, &st) < 0) file_error(filename);
+    size_t size = st.st_size;
+    if(size < 4*sizeof(int)) error("Weight file has no header");
+    char *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) file_error(filename);
+
+    int *header = (int *)base;
+    int major = header[0];
+    int minor = header[1];
+    size_t offset = 3*sizeof(int);
+    if ((major*10 + minor) >= 2 && major < 1000 && minor < 1000){
+        memcpy(net->seen, base + offset, sizeof(size_t));
+        offset += sizeof(size_t);
+    } else {
+        *net->seen = header[3];
+        offset += sizeof(int);
+    }
+    int transpose = (major > 1000) || (minor > 1000);
+
+    weight_map m = {(float *)(base + offset), (float *)(base + size)};
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->dontload) continue;
+        if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL || l->type == DILATED_CONVOLUTIONAL){
+            map_convolutional_weights(&m, l);
+        }
+        if(l->type == CONNECTED){
+            map_connected_weights(&m, l, transpose);
+        }
+        if(l->type == BATCHNORM){
+            map_array(&m, &l->scales, l->c);
+            map_array(&m, &l->rolling_mean, l->c);
+            map_array(&m, &l->rolling_variance, l->c);
+        }
+        if(l->type == CRNN){
+            map_convolutional_weights(&m, l->input_layer);
+            map_convolutional_weights(&m, l->self_layer);
+            map_convolutional_weights(&m, l->output_layer);
+        }
+        if(l->type == RNN){
+            map_connected_weights(&m, l->input_layer, transpose);
+            map_connected_weights(&m, l->self_layer, transpose);
+            map_connected_weights(&m, l->output_layer, transpose);
+        }
+        if(l->type == LSTM){
+            map_connected_weights(&m, l->wi, transpose);
+            map_connected_weights(&m, l->wf, transpose);
+            map_connected_weights(&m, l->wo, transpose);
+            map_connected_weights(&m, l->wg, transpose);
+            map_connected_weights(&m, l->ui, transpose);
+            map_connected_weights(&m, l->uf, transpose);
+            map_connected_weights(&m, l->uo, transpose);
+            map_connected_weights(&m, l->ug, transpose);
+        }
+        if(l->type == GRU){
+            map_connected_weights(&m, l->wz, transpose);
+            map_connected_weights(&m, l->wr, transpose);
+            map_connected_weights(&m, l->wh, transpose);
+            map_connected_weights(&m, l->uz, transpose);
+            map_connected_weights(&m, l->ur, transpose);
+            map_connected_weights(&m, l->uh, transpose);
+        }
+        if(l->type == LOCAL){
+            int locations = l->out_w*l->out_h;
+            map_array(&m, &l->biases, l->outputs);
+            map_array(&m, &l->weights, l->size*l->size*l->c*l->n*locations);
+        }
+    }
+    net->weights_map = base;
+    net->weights_map_size = size;
+    fprintf(stderr, "Done!\n");
+}
+
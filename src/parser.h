@@ -3,7 +3,17 @@
 #include "darknet.h"
 #include "network.h"
 
+typedef struct{
+    char *type;
+    list *options;
+}section;
+
 void save_network(network net, char *filename);
 void save_weights_double(network net, char *filename);
+void save_weights_to_stream(network *net, FILE *fp, int cutoff);
+void load_weights_from_stream(network *net, FILE *fp, int start, int cutoff);
+list *read_cfg_stream(FILE *file);
+network *parse_network_sections(list *sections, int batch, int init);
+void free_section(section *s);
 
 #endif
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "network.h"
+#include "parser.h"
+#include "option_list.h"
+#include "memory_report.h"
+#include "weight_file.h"
+#include "utils.h"
+
+/* A plan is everything needed to bring a network up for inference in one
+ * file: the cfg with the batch fixed, a table of what every layer resolved to
+ * (shapes, weight counts, workspace, memory, cuDNN algorithms) and the
+ * weights as an indexed container.  Loading one parses the embedded cfg
+ * quietly and without randomly initializing weights, checks each layer and
+ * the network's memory against the table and points the weights at the
+ * mapped file, so start up costs a cfg parse and the buffer allocations. */
+
+#define PLAN_MAGIC 0x4c504b44  /* "DKPL" */
+#define PLAN_VERSION 1
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t layers;
+    uint32_t batch;
+    uint32_t algorithms;        /* whether the table holds cuDNN choices */
+    uint32_t reserved;
+    uint64_t workspace_size;
+    uint64_t memory;            /* network_memory for inference */
+    uint64_t cfg_offset;
+    uint64_t cfg_length;
+    uint64_t table_offset;
+    uint64_t weights_offset;
+    uint64_t weights_length;
+} plan_header;
+
+typedef struct{
+    int32_t type;
+    int32_t batch;
+    int32_t w, h, c;
+    int32_t out_w, out_h, out_c;
+    int32_t inputs;
+    int32_t outputs;
+    int32_t nweights;
+    int32_t algorithms[3];      /* forward, backward data, backward filter */
+    uint64_t workspace_size;
+    uint64_t bytes;             /* the layer's share of network_memory */
+} plan_layer;
+
+/* The cfg as text, comments dropped, with [net] set to run batch images at a
+ * time. */
+static char *plan_cfg_text(list *sections, int batch, size_t *length)
+{
+    char *text = 0;
+    FILE *fp = open_memstream(&text, length);
+    node *n;
+    for(n = sections->front; n; n = n->next){
+        section *s = n->val;
+        int net = (n == sections->front);
+        fprintf(fp, "%s\n", s->type);
+        node *o;
+        for(o = s->options->front; o; o = o->next){
+            kvp *p = o->val;
+            if(net && (0 == strcmp(p->key, "batch") || 0 == strcmp(p->key, "subdivisions"))) continue;
+            fprintf(fp, "%s=%s\n", p->key, p->val);
+        }
+        if(net) fprintf(fp, "batch=%d\nsubdivisions=1\n", batch);
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+    return text;
+}
+
+static network *parse_plan_cfg(char *text, size_t length, int init)
+{
+    FILE *fp = fmemopen(text, length, "r");
+    if(!fp) error("Couldn't read plan cfg");
+    list *sections = read_cfg_stream(fp);
+    fclose(fp);
+    return parse_network_sections(sections, 0, init);
+}
+
+static size_t layer_bytes(layer l)
+{
+    size_t bytes[MEMORY_CATEGORIES] = {0};
+    size_t total = 0;
+    int c;
+    layer_memory(l, l.batch, bytes);
+    for(c = 0; c < MEMORY_CATEGORIES; ++c) if(memory_for_inference(c)) total += bytes[c];
+    return total;
+}
+
+static plan_layer describe_layer(layer l)
+{
+    plan_layer p = {0};
+    p.type = l.type;
+    p.batch = l.batch;
+    p.w = l.w;
+    p.h = l.h;
+    p.c = l.c;
+    p.out_w = l.out_w;
+    p.out_h = l.out_h;
+    p.out_c = l.out_c;
+    p.inputs = l.inputs;
+    p.outputs = l.outputs;
+    p.nweights = l.nweights;
+    p.workspace_size = l.workspace_size;
+    p.bytes = layer_bytes(l);
+#ifdef CUDNN
+    if(l.type == CONVOLUTIONAL && gpu_index >= 0){
+        p.algorithms[0] = l.fw_algo;
+        p.algorithms[1] = l.bd_algo;
+        p.algorithms[2] = l.bf_algo;
+    }
+#endif
+    return p;
+}
+
+static void pad_to(FILE *fp, long alignment)
+{
+    while(ftell(fp) % alignment) fputc(0, fp);
+}
+
+void compile_network_plan(char *cfgfile, char *weightfile, char *planfile, int batch)
+{
+    int i;
+    if(batch < 1) batch = 1;
+    list *sections = read_cfg(cfgfile);
+    size_t cfg_length;
+    char *text = plan_cfg_text(sections, batch, &cfg_length);
+    node *n;
+    for(n = sections->front; n; n = n->next) free_section(n->val);
+    free_list(sections);
+
+    network *net = parse_plan_cfg(text, cfg_length, 1);
+    if(weightfile && weightfile[0]) load_weights(net, weightfile);
+
+    FILE *fp = fopen(planfile, "wb");
+    if(!fp) file_error(planfile);
+    plan_header header = {0};
+    fwrite(&header, sizeof(header), 1, fp);
+
+    header.magic = PLAN_MAGIC;
+    header.version = PLAN_VERSION;
+    header.layers = net->n;
+    header.batch = batch;
+#ifdef CUDNN
+    header.algorithms = gpu_index >= 0;
+#endif
+    header.memory = network_memory(net, net->batch, 0);
+    header.cfg_offset = ftell(fp);
+    header.cfg_length = cfg_length;
+    fwrite(text, 1, cfg_length, fp);
+
+    pad_to(fp, sizeof(uint64_t));
+    header.table_offset = ftell(fp);
+    for(i = 0; i < net->n; ++i){
+        plan_layer p = describe_layer(net->layers[i]);
+        if(p.workspace_size > header.workspace_size) header.workspace_size = p.workspace_size;
+        fwrite(&p, sizeof(p), 1, fp);
+    }
+
+    pad_to(fp, WEIGHT_FILE_ALIGN);
+    header.weights_offset = ftell(fp);
+    write_weight_file(net, fp);
+    header.weights_length = ftell(fp) - header.weights_offset;
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    if(fclose(fp)) file_error(planfile);
+    fprintf(stderr, "Compiled %s into %s: %d layers, batch %d, %.1f MB of weights, %.1f MB to run\n",
+            cfgfile, planfile, net->n, batch, header.weights_length/(1024.*1024.), header.memory/(1024.*1024.));
+    free(text);
+    free_network(net);
+}
+
+int is_network_plan(char *filename)
+{
+    uint32_t magic = 0;
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    int found = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == PLAN_MAGIC;
+    fclose(fp);
+    return found;
+}
+
+network *load_network_plan(char *filename)
+{
+    int i;
+    size_t size;
+    char *base = map_file(filename, &size);
+    plan_header *header = (plan_header *)base;
+    if(size < sizeof(plan_header) || header->magic != PLAN_MAGIC) error("Not a network plan");
+    if(header->version != PLAN_VERSION) error("Unsupported plan version");
+    if(header->cfg_offset + header->cfg_length > size
+            || header->table_offset + header->layers*sizeof(plan_layer) > size
+            || header->weights_offset + header->weights_length > size){
+        error("Plan is truncated");
+    }
+
+    int quiet = quiet_build;
+    quiet_build = 1;
+    network *net = parse_plan_cfg(base + header->cfg_offset, header->cfg_length, 0);
+    quiet_build = quiet;
+
+    // the table catches plans compiled by a build that sizes layers differently
+    plan_layer *table = (plan_layer *)(base + header->table_offset);
+    if(net->n != header->layers) error("Plan does not match this build");
+#ifdef CUDNN
+    size_t workspace = 0;
+    for(i = 0; i < net->n; ++i) if(net->layers[i].workspace_size > workspace) workspace = net->layers[i].workspace_size;
+#endif
+    for(i = 0; i < net->n; ++i){
+        plan_layer *t = table + i;
+#ifdef CUDNN
+        // the compiled choices, when the workspace they were sized for fits
+        layer *l = net->layers + i;
+        if(header->algorithms && l->type == CONVOLUTIONAL && net->gpu_index >= 0 && t->workspace_size <= workspace){
+            l->fw_algo = t->algorithms[0];
+            l->bd_algo = t->algorithms[1];
+            l->bf_algo = t->algorithms[2];
+            l->workspace_size = t->workspace_size;
+        }
+#endif
+        plan_layer p = describe_layer(net->layers[i]);
+        memcpy(p.algorithms, t->algorithms, sizeof(p.algorithms));
+        if(memcmp(&p, t, sizeof(plan_layer))){
+            fprintf(stderr, "Plan layer %d (%s) resolved differently in this build\n", i, get_layer_string(net->layers[i].type));
+            error("Plan does not match this build");
+        }
+    }
+    if(network_memory(net, net->batch, 0) != header->memory) error("Plan does not match this build");
+
+    char *weights = base + header->weights_offset;
+    check_weight_container(weights, header->weights_length);
+    int copy = 0;
+#ifdef GPU
+    copy = net->gpu_index >= 0;
+#endif
+    read_weight_container(net, weights, 0, net->n, copy);
+    if(copy){
+        munmap(base, size);
+    } else {
+        net->weights_map = base;
+        net->weights_map_size = size;
+    }
+    return net;
+}
@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "network.h"
+#include "parser.h"
+#include "trace.h"
+#include "utils.h"
+#include "parameter_arena.h"
+
+/* Training across processes.  Every rank holds a full copy of the network,
+ * trains on its own images and averages gradients with the others over a
+ * ring of TCP connections before each update, the same arrays the in-process
+ * replicas agree on.  Rank, world size and where rank 0 listens come from
+ * RANK, WORLD_SIZE, MASTER_ADDR and MASTER_PORT, so
+ *
+ *   darknet launch 4 detector train ... -dist
+ *
+ * runs four ranks on this machine.  Ranks find each other through rank 0:
+ * each reports the port it listens on, rank 0 hands back the whole table and
+ * every rank connects to the next one.
+ *
+ * A layer's gradients are final as soon as its backward is done in the last
+ * subdivision of a batch, so backward_network hands each layer to a
+ * communication thread that reduces it while the layers below are still
+ * running backward. */
+
+#define RING_CHUNK (1 << 20)
+
+typedef struct{
+    uint32_t addr;
+    uint16_t port;
+    uint16_t rank;
+} peer_address;
+
+struct process_group{
+    int rank;
+    int world;
+    int next;   /* socket to rank+1 */
+    int prev;   /* socket from rank-1 */
+
+    network *net;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    int quit;
+    int *queue;
+    int queued;
+    int taken;
+    int reduced;
+    int *submitted;
+    float *staging;
+    size_t staging_size;
+
+    int steps;
+    double wait_time;
+    double reduce_time;
+    size_t bytes;
+};
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Sends to the next rank and receives from the previous one at the same
+ * time, so a ring of large messages can't deadlock on full socket buffers. */
+static void ring_exchange(process_group *g, void *out, size_t out_size, void *in, size_t in_size)
+{
+    char *outp = out;
+    char *inp = in;
+    while(out_size || in_size){
+        struct pollfd fds[2];
+        int n = 0;
+        int send_slot = -1, recv_slot = -1;
+        if(out_size){
+            fds[n].fd = g->next;
+            fds[n].events = POLLOUT;
+            send_slot = n++;
+        }
+        if(in_size){
+            fds[n].fd = g->prev;
+            fds[n].events = POLLIN;
+            recv_slot = n++;
+        }
+        if(poll(fds, n, -1) < 0){
+            if(errno == EINTR) continue;
+            error("poll failed");
+        }
+        if(send_slot >= 0 && fds[send_slot].revents){
+            ssize_t sent = send(g->next, outp, out_size, MSG_NOSIGNAL);
+            if(sent < 0 && errno != EAGAIN && errno != EINTR) error("Lost connection to the next rank");
+            if(sent > 0){
+                outp += sent;
+                out_size -= sent;
+            }
+        }
+        if(recv_slot >= 0 && fds[recv_slot].revents){
+            ssize_t got = read(g->prev, inp, in_size);
+            if(got == 0) error("Previous rank closed the connection");
+            if(got < 0 && errno != EAGAIN && errno != EINTR) error("Lost connection to the previous rank");
+            if(got > 0){
+                inp += got;
+                in_size -= got;
+            }
+        }
+    }
+}
+
+/* Averages x over all ranks: a reduce-scatter around the ring leaves each
+ * rank with the sum of one chunk, which then travels around the ring once
+ * more.  Every rank ends up with bitwise the same result. */
+void ring_all_reduce(process_group *g, float *x, size_t n)
+{
+    int s;
+    size_t i;
+    int w = g->world;
+    if(w < 2 || !n) return;
+    size_t largest = n/w + 1;
+    if(g->staging_size < largest){
+        g->staging = realloc(g->staging, largest*sizeof(float));
+        g->staging_size = largest;
+    }
+    float *tmp = g->staging;
+    for(s = 0; s < w - 1; ++s){
+        int out = ((g->rank - s) % w + w) % w;
+        int in = ((g->rank - s - 1) % w + w) % w;
+        size_t out_start = n*out/w, out_end = n*(out + 1)/w;
+        size_t in_start = n*in/w, in_end = n*(in + 1)/w;
+        ring_exchange(g, x + out_start, (out_end - out_start)*sizeof(float), tmp, (in_end - in_start)*sizeof(float));
+        for(i = in_start; i < in_end; ++i) x[i] += tmp[i - in_start];
+    }
+    int own = (g->rank + 1) % w;
+    float scale = 1./w;
+    for(i = n*own/w; i < n*(own + 1)/w; ++i) x[i] *= scale;
+    for(s = 0; s < w - 1; ++s){
+        int out = ((g->rank + 1 - s) % w + w) % w;
+        int in = ((g->rank - s) % w + w) % w;
+        size_t out_start = n*out/w, out_end = n*(out + 1)/w;
+        size_t in_start = n*in/w, in_end = n*(in + 1)/w;
+        ring_exchange(g, x + out_start, (out_end - out_start)*sizeof(float), x + in_start, (in_end - in_start)*sizeof(float));
+    }
+    g->bytes += 2*(w - 1)*(n/w)*sizeof(float);
+}
+
+/* Passes rank 0's bytes along the ring, a chunk at a time so every hop
+ * forwards while the next chunk is still arriving. */
+void ring_broadcast(process_group *g, void *data, size_t size)
+{
+    size_t offset;
+    if(g->world < 2) return;
+    char *p = data;
+    for(offset = 0; offset < size; offset += RING_CHUNK){
+        size_t chunk = size - offset < RING_CHUNK ? size - offset : RING_CHUNK;
+        if(g->rank != 0) ring_exchange(g, 0, 0, p + offset, chunk);
+        if((g->rank + 1) % g->world != 0) ring_exchange(g, p + offset, chunk, 0, 0);
+    }
+}
+
+static int env_int(char *name, int def)
+{
+    char *v = getenv(name);
+    return v ? atoi(v) : def;
+}
+
+static uint32_t resolve(char *host)
+{
+    struct addrinfo hints = {0}, *res = 0;
+    hints.ai_family = AF_INET;
+    if(getaddrinfo(host, 0, &hints, &res) || !res){
+        fprintf(stderr, "Couldn't resolve %s\n", host);
+        error("Bad MASTER_ADDR");
+    }
+    uint32_t addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(res);
+    return addr;
+}
+
+static int listen_on(uint16_t port, uint16_t *bound)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) error("socket failed");
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 128)){
+        fprintf(stderr, "Couldn't listen on port %d: %s\n", port, strerror(errno));
+        error("listen failed");
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    if(bound) *bound = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* Keeps trying for a minute, since ranks don't start at the same moment. */
+static int connect_to(uint32_t host, uint16_t port)
+{
+    int tries;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = host;
+    addr.sin_port = htons(port);
+    for(tries = 0; tries < 600; ++tries){
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0) error("socket failed");
+        if(!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) return fd;
+        close(fd);
+        usleep(100000);
+    }
+    fprintf(stderr, "Couldn't connect to %s:%d\n", inet_ntoa(addr.sin_addr), port);
+    error("connect failed");
+    return -1;
+}
+
+static void write_bytes(int fd, void *data, size_t size)
+{
+    char *p = data;
+    while(size){
+        ssize_t n = write(fd, p, size);
+        if(n <= 0) error("write failed");
+        p += n;
+        size -= n;
+    }
+}
+
+static void read_bytes(int fd, void *data, size_t size)
+{
+    char *p = data;
+    while(size){
+        ssize_t n = read(fd, p, size);
+        if(n <= 0) error("read failed");
+        p += n;
+        size -= n;
+    }
+}
+
+/* A world of one if WORLD_SIZE isn't set. */
+process_group *make_process_group()
+{
+    int i;
+    process_group *g = calloc(1, sizeof(process_group));
+    g->rank = env_int("RANK", 0);
+    g->world = env_int("WORLD_SIZE", 1);
+    g->next = g->prev = -1;
+    pthread_mutex_init(&g->mutex, 0);
+    pthread_cond_init(&g->changed, 0);
+    if(g->world < 1 || g->rank < 0 || g->rank >= g->world) error("Bad RANK or WORLD_SIZE");
+    if(g->world == 1) return g;
+
+    char *master = getenv("MASTER_ADDR");
+    uint32_t master_addr = resolve(master ? master : "127.0.0.1");
+    uint16_t master_port = env_int("MASTER_PORT", 29500);
+
+    uint16_t port;
+    int listener = listen_on(0, &port);
+    peer_address *table = calloc(g->world, sizeof(peer_address));
+    if(g->rank == 0){
+        int rendezvous = listen_on(master_port, 0);
+        int *fds = calloc(g->world, sizeof(int));
+        table[0].addr = master_addr;
+        table[0].port = port;
+        for(i = 1; i < g->world; ++i){
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            int fd = accept(rendezvous, (struct sockaddr *)&addr, &len);
+            if(fd < 0) error("accept failed");
+            peer_address p;
+            read_bytes(fd, &p, sizeof(p));
+            if(p.rank < 1 || p.rank >= g->world || fds[p.rank]) error("Two ranks claim the same RANK");
+            p.addr = addr.sin_addr.s_addr;
+            table[p.rank] = p;
+            fds[p.rank] = fd;
+        }
+        for(i = 1; i < g->world; ++i){
+            write_bytes(fds[i], table, g->world*sizeof(peer_address));
+            close(fds[i]);
+        }
+        free(fds);
+        close(rendezvous);
+    } else {
+        int fd = connect_to(master_addr, master_port);
+        peer_address me = {0};
+        me.port = port;
+        me.rank = g->rank;
+        write_bytes(fd, &me, sizeof(me));
+        read_bytes(fd, table, g->world*sizeof(peer_address));
+        close(fd);
+    }
+
+    // the listener is up before anyone learns its port, so connecting first can't hang
+    peer_address next = table[(g->rank + 1) % g->world];
+    g->next = connect_to(next.addr, next.port);
+    uint32_t rank = g->rank;
+    write_bytes(g->next, &rank, sizeof(rank));
+    g->prev = accept(listener, 0, 0);
+    if(g->prev < 0) error("accept failed");
+    read_bytes(g->prev, &rank, sizeof(rank));
+    if(rank != (g->rank + g->world - 1) % g->world) error("Ring connected out of order");
+    close(listener);
+    free(table);
+    set_nonblocking(g->next);
+    set_nonblocking(g->prev);
+    fprintf(stderr, "Rank %d of %d connected\n", g->rank, g->world);
+    return g;
+}
+
+int process_group_rank(process_group *g)
+{
+    return g->rank;
+}
+
+int process_group_size(process_group *g)
+{
+    return g->world;
+}
+
+/* A layer's gradients and statistics are one span of the packed network. */
+static void reduce_layer(process_group *g, int index)
+{
+    parameter_arena *a = g->net->arena;
+    arena_view v = a->views[index];
+    ring_all_reduce(g, a->grads + v.offset, v.size);
+}
+
+static void *reduce_thread(void *ptr)
+{
+    process_group *g = ptr;
+    TRACE_THREAD_NAME("all_reduce");
+    pthread_mutex_lock(&g->mutex);
+    while(1){
+        while(!g->quit && g->taken == g->queued) pthread_cond_wait(&g->changed, &g->mutex);
+        if(g->quit) break;
+        int index = g->queue[g->taken++];
+        pthread_mutex_unlock(&g->mutex);
+
+        double start = what_time_is_it_now();
+        TRACE_BEGIN("reduce_layer", "dist", index);
+        reduce_layer(g, index);
+        TRACE_END();
+        double elapsed = what_time_is_it_now() - start;
+
+        pthread_mutex_lock(&g->mutex);
+        g->reduce_time += elapsed;
+        ++g->reduced;
+        pthread_cond_broadcast(&g->changed);
+    }
+    pthread_mutex_unlock(&g->mutex);
+    return 0;
+}
+
+/* Makes every rank start from rank 0's weights and hooks net up so its
+ * gradients get averaged before each update. */
+void attach_process_group(network *net, process_group *g)
+{
+    int i;
+    float *arrays[5];
+    size_t sizes[5];
+#ifdef GPU
+    if(net->gpu_index >= 0) error("Distributed training runs on CPU only");
+#endif
+    for(i = 0; i < net->n; ++i){
+        if(layer_gradient_arrays(net->layers[i], arrays, sizes) < 0){
+            fprintf(stderr, "Distributed training does not support %s layers\n", get_layer_string(net->layers[i].type));
+            error("Unsupported layer");
+        }
+    }
+    pack_network_parameters(net);
+    g->net = net;
+    net->dist = g;
+    if(g->world == 1) return;
+
+    uint64_t size = 0;
+    char *bytes = 0;
+    if(g->rank == 0){
+        size_t length;
+        FILE *fp = open_memstream(&bytes, &length);
+        save_weights_to_stream(net, fp, net->n);
+        fclose(fp);
+        size = length;
+    }
+    ring_broadcast(g, &size, sizeof(size));
+    if(g->rank != 0) bytes = calloc(size + 1, 1);
+    ring_broadcast(g, bytes, size);
+    if(g->rank != 0){
+        FILE *fp = fmemopen(bytes, size, "rb");
+        load_weights_from_stream(net, fp, 0, net->n);
+        fclose(fp);
+    }
+    free(bytes);
+    fprintf(stderr, "Rank %d has rank 0's weights (%.1f MB)\n", g->rank, size/(1024.*1024.));
+
+    g->queue = calloc(net->n, sizeof(int));
+    g->submitted = calloc(net->n, sizeof(int));
+    if(pthread_create(&g->thread, 0, reduce_thread, g)) error("Thread creation failed");
+}
+
+static int last_subdivision(network *net)
+{
+    return ((*net->seen)/net->batch) % net->subdivisions == 0;
+}
+
+static void submit_layer(process_group *g, int index)
+{
+    float *arrays[5];
+    size_t sizes[5];
+    if(g->submitted[index]) return;
+    g->submitted[index] = 1;
+    if(layer_gradient_arrays(g->net->layers[index], arrays, sizes) <= 0) return;
+    pthread_mutex_lock(&g->mutex);
+    g->queue[g->queued++] = index;
+    pthread_cond_broadcast(&g->changed);
+    pthread_mutex_unlock(&g->mutex);
+}
+
+/* Called by backward_network after each layer. */
+void layer_backward_done(process_group *g, network *net, int index)
+{
+    if(g->world == 1 || net != g->net || !last_subdivision(net)) return;
+    submit_layer(g, index);
+}
+
+/* Called before the update: sends whatever backward didn't reach, waits for
+ * every layer to be averaged and counts the other ranks' images as seen. */
+void finish_gradients(process_group *g, network *net)
+{
+    int i;
+    if(g->world == 1) return;
+    for(i = net->n - 1; i >= 0; --i) submit_layer(g, i);
+    double start = what_time_is_it_now();
+    pthread_mutex_lock(&g->mutex);
+    while(g->reduced < g->queued) pthread_cond_wait(&g->changed, &g->mutex);
+    g->queued = g->taken = g->reduced = 0;
+    pthread_mutex_unlock(&g->mutex);
+    memset(g->submitted, 0, net->n*sizeof(int));
+    g->wait_time += what_time_is_it_now() - start;
+    ++g->steps;
+    *net->seen += (size_t)(g->world - 1)*net->batch*net->subdivisions;
+}
+
+void print_process_group_stats(process_group *g, FILE *fp)
+{
+    if(g->world == 1 || !g->steps) return;
+    fprintf(fp, "Rank %d: %d steps, %.1f MB sent, all-reduce %.2f ms per step of which %.2f ms not hidden by backward\n",
+            g->rank, g->steps, g->bytes/(1024.*1024.), 1000*g->reduce_time/g->steps, 1000*g->wait_time/g->steps);
+}
+
+void free_process_group(process_group *g)
+{
+    if(g->queue){
+        pthread_mutex_lock(&g->mutex);
+        g->quit = 1;
+        pthread_cond_broadcast(&g->changed);
+        pthread_mutex_unlock(&g->mutex);
+        pthread_join(g->thread, 0);
+    }
+    if(g->net) g->net->dist = 0;
+    if(g->next >= 0) close(g->next);
+    if(g->prev >= 0) close(g->prev);
+    pthread_mutex_destroy(&g->mutex);
+    pthread_cond_destroy(&g->changed);
+    free(g->queue);
+    free(g->submitted);
+    free(g->staging);
+    free(g);
+}
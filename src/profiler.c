@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "profiler.h"
+#include "network.h"
+#include "utils.h"
+
+static char *phase_names[PROFILE_PHASES] = {"forward", "backward", "update"};
+static char *counter_names[PROFILE_COUNTERS] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+
+double profiler_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * .000000001;
+}
+
+static double layer_params(layer l)
+{
+    if(l.type == CONNECTED) return (double)l.inputs*l.outputs + l.outputs*(l.batch_normalize ? 2 : 1);
+    if(l.type == BATCHNORM) return 2.*l.c;
+    if(l.type == LOCAL) return (double)l.size*l.size*l.c*l.n*l.out_w*l.out_h + l.outputs;
+    return (double)l.nweights + l.nbiases + ((l.scales && l.batch_normalize) ? l.nbiases : 0);
+}
+
+static double gemm_flops(layer l)
+{
+    switch(l.type){
+        case CONVOLUTIONAL:
+        case DILATED_CONVOLUTIONAL:
+            // A dilated kernel still touches size*size taps, the holes cost nothing.
+            return 2. * l.n * l.size*l.size*l.c/l.groups * l.out_h*l.out_w;
+        case DECONVOLUTIONAL:
+            return 2. * l.n * l.size*l.size*l.c * l.h*l.w;
+        case LOCAL:
+            return 2. * l.n * l.size*l.size*l.c * l.out_h*l.out_w;
+        case CONNECTED:
+            return 2. * l.inputs * l.outputs;
+        case RNN:
+            return 2. * (l.input_layer->inputs * l.input_layer->outputs
+                    + l.self_layer->inputs * l.self_layer->outputs
+                    + l.output_layer->inputs * l.output_layer->outputs);
+        case GRU:
+            return 2. * (l.uz->inputs * l.uz->outputs + l.uh->inputs * l.uh->outputs
+                    + l.ur->inputs * l.ur->outputs + l.wz->inputs * l.wz->outputs
+                    + l.wh->inputs * l.wh->outputs + l.wr->inputs * l.wr->outputs);
+        case LSTM:
+            return 2. * (l.uf->inputs * l.uf->outputs + l.ui->inputs * l.ui->outputs
+                    + l.ug->inputs * l.ug->outputs + l.uo->inputs * l.uo->outputs
+                    + l.wf->inputs * l.wf->outputs + l.wi->inputs * l.wi->outputs
+                    + l.wg->inputs * l.wg->outputs + l.wo->inputs * l.wo->outputs);
+        default:
+            return 0;
+    }
+}
+
+/* im2col expands every output pixel into size*size*c/groups values.  For a
+ * dilated layer the expanded matrix has the same size as the dense one, but
+ * it is gathered from a (dilate_rate-1)*(size+1)+size wide window, so we
+ * charge one write and one read of the column buffer per image. */
+static double column_bytes(layer l)
+{
+    if((l.type != CONVOLUTIONAL && l.type != DILATED_CONVOLUTIONAL) || l.size == 1) return 0;
+    return 2. * sizeof(float) * l.out_h*l.out_w * l.size*l.size*l.c/l.groups;
+}
+
+/* Batchnorm reads the activations once for the statistics and once more to
+ * write the output and x_norm; backward reads delta and x_norm twice and
+ * writes delta once. */
+static double batchnorm_bytes(layer l, profile_phase phase)
+{
+    int fused = l.type == CONVOLUTIONAL || l.type == DILATED_CONVOLUTIONAL || l.type == DECONVOLUTIONAL || l.type == CONNECTED;
+    if(!(fused && l.batch_normalize) && l.type != BATCHNORM) return 0;
+    double out = (double)l.batch * l.outputs;
+    if(phase == PROFILE_FORWARD) return sizeof(float) * 4*out;
+    if(phase == PROFILE_BACKWARD) return sizeof(float) * 5*out;
+    return 0;
+}
+
+void layer_cost(layer l, profile_phase phase, double *flops, double *bytes)
+{
+    double batch = l.batch;
+    double steps = (l.steps > 0) ? l.steps : 1;
+    double gemm = gemm_flops(l) * batch * steps;
+    double params = layer_params(l);
+    double in = batch * l.inputs;
+    double out = batch * l.outputs;
+    double f = 0;
+    double b = 0;
+
+    switch(phase){
+        case PROFILE_FORWARD:
+            if(gemm){
+                f = gemm + out*(l.batch_normalize ? 6 : 2);
+            } else if(l.type == MAXPOOL){
+                f = out * l.size*l.size;
+            } else if(l.type == AVGPOOL){
+                f = in;
+            } else {
+                f = out;
+            }
+            b = sizeof(float) * (in + out + params) + batch * column_bytes(l);
+            break;
+        case PROFILE_BACKWARD:
+            /* weight gradient plus input gradient, each as large as the forward GEMM */
+            f = gemm ? 2*gemm + out*(l.batch_normalize ? 10 : 2) : out;
+            b = sizeof(float) * 2*(in + out + params) + 2 * batch * column_bytes(l);
+            break;
+        case PROFILE_UPDATE:
+            /* decay axpy, rate axpy and momentum scal over every parameter */
+            f = 5*params;
+            b = sizeof(float) * 8*params;
+            break;
+    }
+    b += batchnorm_bytes(l, phase);
+    if(flops) *flops = f;
+    if(bytes) *bytes = b;
+}
+
+/* Counters live in one perf group so a single read() returns a consistent
+ * snapshot of all of them.  They only count the calling thread in user space,
+ * and when the PMU is oversubscribed the kernel multiplexes the group, so the
+ * raw values are scaled by time_enabled/time_running. */
+static void read_counters(profiler *p, double *values)
+{
+    int c;
+    for(c = 0; c < PROFILE_COUNTERS; ++c) values[c] = 0;
+#ifdef __linux__
+    unsigned long long buf[3 + PROFILE_COUNTERS];
+    if(read(p->group, buf, sizeof(buf)) < (ssize_t)(3 + p->nslots)*sizeof(unsigned long long)) return;
+    double scale = buf[2] ? (double)buf[1]/buf[2] : 1;
+    for(c = 0; c < PROFILE_COUNTERS; ++c){
+        if(p->slot[c] >= 0) values[c] = buf[3 + p->slot[c]] * scale;
+    }
+#endif
+}
+
+double profiler_start(profiler *p)
+{
+    if(p->group >= 0) read_counters(p, p->begin);
+    return profiler_clock();
+}
+
+void profile_layer(profiler *p, int i, layer l, profile_phase phase, double seconds)
+{
+    if(i < 0 || i >= p->n) return;
+    double flops, bytes;
+    layer_cost(l, phase, &flops, &bytes);
+    layer_profile *lp = p->layers + i;
+    ++lp->calls[phase];
+    lp->time[phase] += seconds;
+    lp->flops[phase] += flops;
+    lp->bytes[phase] += bytes;
+    if(p->group >= 0){
+        int c;
+        double end[PROFILE_COUNTERS];
+        read_counters(p, end);
+        for(c = 0; c < PROFILE_COUNTERS; ++c) lp->counters[phase][c] += end[c] - p->begin[c];
+    }
+}
+
+void enable_network_profiler(network *net)
+{
+    if(net->prof) return;
+    int c;
+    net->prof = calloc(1, sizeof(profiler));
+    net->prof->n = net->n;
+    net->prof->layers = calloc(net->n, sizeof(layer_profile));
+    net->prof->group = -1;
+    for(c = 0; c < PROFILE_COUNTERS; ++c){
+        net->prof->fds[c] = -1;
+        net->prof->slot[c] = -1;
+    }
+}
+
+#ifdef __linux__
+/* Counts only the calling thread.  inherit would follow the OpenMP workers,
+ * but an inherited count reaches the parent only when the thread exits, and
+ * the workers live as long as the process, so per-layer reads would miss
+ * them either way. */
+static int open_counter(unsigned long long config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = (group < 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+int enable_network_counters(network *net)
+{
+    enable_network_profiler(net);
+    profiler *p = net->prof;
+    if(p->group >= 0) return 1;
+#ifdef __linux__
+    unsigned long long configs[PROFILE_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    int c;
+    p->group = open_counter(configs[COUNTER_CYCLES], -1);
+    if(p->group < 0){
+        fprintf(stderr, "Hardware counters unavailable (%s), profiling time only\n", strerror(errno));
+        return 0;
+    }
+    p->fds[COUNTER_CYCLES] = p->group;
+    p->slot[COUNTER_CYCLES] = p->nslots++;
+    for(c = 0; c < PROFILE_COUNTERS; ++c){
+        if(c == COUNTER_CYCLES) continue;
+        p->fds[c] = open_counter(configs[c], p->group);
+        if(p->fds[c] < 0){
+            fprintf(stderr, "Hardware counter %s unavailable (%s)\n", counter_names[c], strerror(errno));
+            continue;
+        }
+        p->slot[c] = p->nslots++;
+    }
+    ioctl(p->group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(p->group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 1;
+#else
+    fprintf(stderr, "Hardware counters need Linux perf_event_open, profiling time only\n");
+    return 0;
+#endif
+}
+
+void reset_network_profiler(network *net)
+{
+    if(!net->prof) return;
+    memset(net->prof->layers, 0, net->prof->n*sizeof(layer_profile));
+}
+
+void free_profiler(profiler *p)
+{
+    if(!p) return;
+#ifdef __linux__
+    int c;
+    for(c = 0; c < PROFILE_COUNTERS; ++c){
+        if(p->fds[c] >= 0) close(p->fds[c]);
+    }
+#endif
+    free(p->layers);
+    free(p);
+}
+
+static double phase_sum(double *v)
+{
+    int j;
+    double sum = 0;
+    for(j = 0; j < PROFILE_PHASES; ++j) sum += v[j];
+    return sum;
+}
+
+static profiler *sort_profiler;
+
+static int profile_comparator(const void *pa, const void *pb)
+{
+    layer_profile *a = sort_profiler->layers + *(int *)pa;
+    layer_profile *b = sort_profiler->layers + *(int *)pb;
+    double diff = phase_sum(b->time) - phase_sum(a->time);
+    if(diff < 0) return -1;
+    if(diff > 0) return 1;
+    return *(int *)pa - *(int *)pb;
+}
+
+static double rate(double amount, double seconds)
+{
+    return seconds > 0 ? amount / seconds / 1000000000. : 0;
+}
+
+static double counter_sum(layer_profile *lp, profile_counter c)
+{
+    int j;
+    double sum = 0;
+    for(j = 0; j < PROFILE_PHASES; ++j) sum += lp->counters[j][c];
+    return sum;
+}
+
+static void print_counter_ratio(FILE *fp, profiler *p, double num, profile_counter c, double den, int width)
+{
+    if(p->slot[c] < 0 || den <= 0) fprintf(fp, " %*s", width, "-");
+    else fprintf(fp, " %*.3f", width, num/den);
+}
+
+/* IPC says whether the core is busy; misses per kFLOP say why it isn't. */
+static void print_counter_profile(network *net, int *order, FILE *fp)
+{
+    profiler *p = net->prof;
+    int i;
+    fprintf(fp, "\nHardware counters cover the thread running the network only, not its OpenMP workers\n");
+    fprintf(fp, "rank layer type                      Mcycles    IPC  LLC miss/kFLOP  branch miss/kFLOP\n");
+    for(i = 0; i < p->n; ++i){
+        int index = order[i];
+        layer_profile *lp = p->layers + index;
+        if(phase_sum(lp->time) == 0) continue;
+        double cycles = counter_sum(lp, COUNTER_CYCLES);
+        double kflops = phase_sum(lp->flops)/1000.;
+        fprintf(fp, "%4d %5d %-22s %12.2f", i+1, index, get_layer_string(net->layers[index].type), cycles/1000000.);
+        print_counter_ratio(fp, p, counter_sum(lp, COUNTER_INSTRUCTIONS), COUNTER_INSTRUCTIONS, cycles, 6);
+        print_counter_ratio(fp, p, counter_sum(lp, COUNTER_LLC_MISSES), COUNTER_LLC_MISSES, kflops, 15);
+        print_counter_ratio(fp, p, counter_sum(lp, COUNTER_BRANCH_MISSES), COUNTER_BRANCH_MISSES, kflops, 18);
+        fprintf(fp, "\n");
+    }
+}
+
+void print_network_profile(network *net, FILE *fp)
+{
+    profiler *p = net->prof;
+    if(!p) return;
+    int i, j;
+    double phase_time[PROFILE_PHASES] = {0};
+    double total = 0;
+    for(i = 0; i < p->n; ++i){
+        for(j = 0; j < PROFILE_PHASES; ++j){
+            phase_time[j] += p->layers[i].time[j];
+            total += p->layers[i].time[j];
+        }
+    }
+    int *order = calloc(p->n, sizeof(int));
+    for(i = 0; i < p->n; ++i) order[i] = i;
+    sort_profiler = p;
+    qsort(order, p->n, sizeof(int), profile_comparator);
+
+    fprintf(fp, "\nrank layer type                    forward ms backward ms  update ms   total ms      %%  GFLOP/s     GB/s\n");
+    for(i = 0; i < p->n; ++i){
+        int index = order[i];
+        layer_profile *lp = p->layers + index;
+        double t = phase_sum(lp->time);
+        if(t == 0) continue;
+        double avg[PROFILE_PHASES];
+        for(j = 0; j < PROFILE_PHASES; ++j){
+            avg[j] = lp->calls[j] ? 1000.*lp->time[j]/lp->calls[j] : 0;
+        }
+        fprintf(fp, "%4d %5d %-22s %11.3f %11.3f %10.3f %10.3f %6.2f %8.2f %8.2f\n",
+                i+1, index, get_layer_string(net->layers[index].type),
+                avg[PROFILE_FORWARD], avg[PROFILE_BACKWARD], avg[PROFILE_UPDATE],
+                avg[PROFILE_FORWARD] + avg[PROFILE_BACKWARD] + avg[PROFILE_UPDATE],
+                100.*t/total, rate(phase_sum(lp->flops), t), rate(phase_sum(lp->bytes), t));
+    }
+    fprintf(fp, "Total: %f seconds", total);
+    for(j = 0; j < PROFILE_PHASES; ++j){
+        if(phase_time[j] > 0) fprintf(fp, ", %s %.1f%%", phase_names[j], 100.*phase_time[j]/total);
+    }
+    fprintf(fp, "\n");
+    if(p->group >= 0) print_counter_profile(net, order, fp);
+    free(order);
+}
+
+void save_network_profile(network *net, char *filename)
+{
+    profiler *p = net->prof;
+    if(!p) return;
+    FILE *fp = fopen(filename, "w");
+    if(!fp) file_error(filename);
+    int i, j, c;
+    double total = 0;
+    for(i = 0; i < p->n; ++i){
+        layer_profile *lp = p->layers + i;
+        total += phase_sum(lp->time);
+    }
+    fprintf(fp, "layer,type,phase,calls,seconds,avg_ms,flops,bytes,gflops,gbps,percent");
+    for(c = 0; c < PROFILE_COUNTERS; ++c) fprintf(fp, ",%s", counter_names[c]);
+    fprintf(fp, "\n");
+    for(i = 0; i < p->n; ++i){
+        layer_profile *lp = p->layers + i;
+        for(j = 0; j < PROFILE_PHASES; ++j){
+            if(!lp->calls[j]) continue;
+            fprintf(fp, "%d,%s,%s,%d,%.9f,%.6f,%.0f,%.0f,%.4f,%.4f,%.4f",
+                    i, get_layer_string(net->layers[i].type), phase_names[j], lp->calls[j],
+                    lp->time[j], 1000.*lp->time[j]/lp->calls[j], lp->flops[j], lp->bytes[j],
+                    rate(lp->flops[j], lp->time[j]), rate(lp->bytes[j], lp->time[j]),
+                    total > 0 ? 100.*lp->time[j]/total : 0);
+            for(c = 0; c < PROFILE_COUNTERS; ++c){
+                if(p->slot[c] >= 0) fprintf(fp, ",%.0f", lp->counters[j][c]);
+                else fprintf(fp, ",");
+            }
+            fprintf(fp, "\n");
+        }
+    }
+    fclose(fp);
+    fprintf(stderr, "Saved layer profile to %s\n", filename);
+}
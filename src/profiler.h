@@ -0,0 +1,52 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+#include "darknet.h"
+
+#define PROFILE_PHASES 3
+#define PROFILE_COUNTERS 4
+
+typedef enum{
+    PROFILE_FORWARD, PROFILE_BACKWARD, PROFILE_UPDATE
+} profile_phase;
+
+typedef enum{
+    COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_LLC_MISSES, COUNTER_BRANCH_MISSES
+} profile_counter;
+
+typedef struct{
+    int calls[PROFILE_PHASES];
+    double time[PROFILE_PHASES];    // wall seconds summed over all calls
+    double flops[PROFILE_PHASES];   // floating point operations summed over all calls
+    double bytes[PROFILE_PHASES];   // estimated memory traffic summed over all calls
+    double counters[PROFILE_PHASES][PROFILE_COUNTERS];
+} layer_profile;
+
+struct profiler{
+    int n;
+    layer_profile *layers;
+
+    int group;                              // perf_event group leader, -1 when counters are off
+    int fds[PROFILE_COUNTERS];
+    int slot[PROFILE_COUNTERS];             // position of each counter in a group read, -1 if missing
+    int nslots;
+    double begin[PROFILE_COUNTERS];
+};
+
+double profiler_clock();
+double profiler_start(profiler *p);
+void profile_layer(profiler *p, int i, layer l, profile_phase phase, double seconds);
+void layer_cost(layer l, profile_phase phase, double *flops, double *bytes);
+void free_profiler(profiler *p);
+
+/* Cheap enough to leave in the hot loops: one branch when profiling is off. */
+static inline double profile_start(profiler *p)
+{
+    return p ? profiler_start(p) : 0;
+}
+
+static inline void profile_stop(profiler *p, int i, layer l, profile_phase phase, double start)
+{
+    if(p) profile_layer(p, i, l, phase, profiler_clock() - start);
+}
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recompute.h"
+#include "network.h"
+#include "memory_report.h"
+#include "profiler.h"
+#include "blas.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Activation checkpointing.  Layers marked checkpoint=1, every k-th layer for
+ * checkpoint=k in [net], and any layer that later layers or the loss read
+ * from keep their buffers.  The layers between two kept layers form a
+ * segment and share one pool sized for the largest segment, so training
+ * holds the kept activations plus a single segment instead of every
+ * layer's output, delta and batchnorm buffers.  Before backward reaches the
+ * end of a segment, the segment's forward is run again from the kept input
+ * to bring its buffers back. */
+
+static int recomputable(LAYER_TYPE type)
+{
+    switch(type){
+        case CONVOLUTIONAL:
+        case DILATED_CONVOLUTIONAL:
+        case DECONVOLUTIONAL:
+        case CONNECTED:
+        case BATCHNORM:
+        case MAXPOOL:
+        case AVGPOOL:
+        case ACTIVE:
+        case SHORTCUT:
+        case UPSAMPLE:
+        case ROUTE:
+        case REORG:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static size_t rolling_size(layer l)
+{
+    if(!l.rolling_mean) return 0;
+    if(l.type == CONNECTED) return l.outputs;
+    if(l.type == BATCHNORM) return l.c;
+    return l.n;
+}
+
+/* Floats of output, delta and batchnorm buffers a layer holds. */
+static void layer_buffers(layer l, size_t *sizes)
+{
+    size_t out = (size_t)l.batch*l.outputs;
+    sizes[0] = l.output ? out : 0;
+    sizes[1] = l.delta ? out : 0;
+    sizes[2] = (l.x ? out : 0) + (l.x_norm ? out : 0);
+}
+
+static int *find_kept(network *net)
+{
+    int i, j;
+    int *keep = calloc(net->n, sizeof(int));
+    int out = net->n - 1;
+    while(out > 0 && net->layers[out].type == COST) --out;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!recomputable(l.type) || l.checkpoint || l.cost || l.truth || l.stopbackward || i >= out) keep[i] = 1;
+        if(net->checkpoint > 0 && (i + 1) % net->checkpoint == 0) keep[i] = 1;
+        // dropout works in place on the layer before it
+        if(i + 1 < net->n && net->layers[i+1].type == DROPOUT) keep[i] = 1;
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j) keep[l.input_layers[j]] = 1;
+        }
+        if(l.type == SHORTCUT) keep[l.index] = 1;
+    }
+    return keep;
+}
+
+/* Does nothing unless the cfg asked for checkpoints. */
+void plan_recompute(network *net)
+{
+    int i, k;
+    size_t sizes[3];
+    int wanted = net->checkpoint > 0;
+    for(i = 0; i < net->n; ++i) if(net->layers[i].checkpoint) wanted = 1;
+    if(!wanted || net->recompute) return;
+#ifdef GPU
+    if(net->gpu_index >= 0){
+        fprintf(stderr, "Activation checkpointing runs on the CPU only, ignoring it\n");
+        return;
+    }
+#endif
+    recompute_plan *p = calloc(1, sizeof(recompute_plan));
+    p->keep = find_kept(net);
+    size_t *offsets = calloc(net->n, sizeof(size_t));
+    size_t used = 0;
+    size_t stats = 0;
+    size_t segment[3] = {0};
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        double forward, backward;
+        layer_cost(l, PROFILE_FORWARD, &forward, 0);
+        layer_cost(l, PROFILE_BACKWARD, &backward, 0);
+        p->train_flops += forward + backward;
+        if(p->keep[i]){
+            if(used) ++p->segments;
+            used = stats = 0;
+            memset(segment, 0, sizeof(segment));
+            continue;
+        }
+        ++p->recomputed;
+        p->recompute_flops += forward;
+        layer_buffers(l, sizes);
+        offsets[i] = used;
+        for(k = 0; k < 3; ++k){
+            used += sizes[k];
+            segment[k] += sizes[k]*sizeof(float);
+            p->pooled_bytes[k] += sizes[k]*sizeof(float);
+        }
+        stats += 2*rolling_size(l);
+        if(used > p->pool_size){
+            p->pool_size = used;
+            memcpy(p->pool_bytes, segment, sizeof(segment));
+        }
+        if(stats > p->stats_size) p->stats_size = stats;
+    }
+    if(!p->recomputed){
+        free(offsets);
+        free(p->keep);
+        free(p);
+        return;
+    }
+
+    p->pool = calloc(p->pool_size, sizeof(float));
+    p->stats = calloc(p->stats_size + 1, sizeof(float));
+    for(i = 0; i < net->n; ++i){
+        if(p->keep[i]) continue;
+        layer *l = net->layers + i;
+        float **buffers[] = {&l->output, &l->delta, &l->x, &l->x_norm};
+        float *base = p->pool + offsets[i];
+        for(k = 0; k < 4; ++k){
+            if(!*buffers[k]) continue;
+            free(*buffers[k]);
+            *buffers[k] = base;
+            base += (size_t)l->batch*l->outputs;
+        }
+    }
+    free(offsets);
+    net->recompute = p;
+}
+
+static void release_plan(network *net, int reallocate)
+{
+    recompute_plan *p = net->recompute;
+    int i, k;
+    if(!p) return;
+    for(i = 0; i < net->n; ++i){
+        if(p->keep[i]) continue;
+        layer *l = net->layers + i;
+        float **buffers[] = {&l->output, &l->delta, &l->x, &l->x_norm};
+        for(k = 0; k < 4; ++k){
+            if(!*buffers[k]) continue;
+            *buffers[k] = reallocate ? calloc((size_t)l->batch*l->outputs, sizeof(float)) : 0;
+        }
+    }
+    free(p->pool);
+    free(p->stats);
+    free(p->keep);
+    free(p);
+    net->recompute = 0;
+}
+
+/* Gives every layer its own buffers back, e.g. so they can be resized. */
+void unplan_recompute(network *net)
+{
+    release_plan(net, 1);
+}
+
+void free_recompute_plan(network *net)
+{
+    release_plan(net, 0);
+}
+
+void print_recompute_plan(network *net, FILE *fp)
+{
+    recompute_plan *p = net->recompute;
+    int i, k;
+    size_t sizes[3];
+    if(!p) return;
+    size_t total = 0;
+    for(i = 0; i < net->n; ++i){
+        if(net->layers[i].type == DROPOUT) continue;
+        layer_buffers(net->layers[i], sizes);
+        for(k = 0; k < 3; ++k) total += sizes[k]*sizeof(float);
+    }
+    size_t pooled = p->pooled_bytes[0] + p->pooled_bytes[1] + p->pooled_bytes[2];
+    size_t pool = p->pool_size*sizeof(float);
+    fprintf(fp, "Checkpointing: %d layers recomputed in %d segments, activations %.1f MB instead of %.1f MB (%.1f MB saved), %.0f%% more compute per training step\n",
+            p->recomputed, p->segments, (total - pooled + pool)/(1024.*1024.), total/(1024.*1024.),
+            (pooled - pool)/(1024.*1024.), p->train_flops ? 100*p->recompute_flops/p->train_flops : 0);
+}
+
+/* Called by backward_network before layer index: if it ends a segment,
+ * reruns the segment's forward.  The rerun would fold the batch statistics
+ * into the rolling averages a second time, so they are put back after. */
+void recompute_segment(network *netp, int index)
+{
+    recompute_plan *p = netp->recompute;
+    if(!p || !p->keep[index]) return;
+    int start = index;
+    while(start > 0 && !p->keep[start-1]) --start;
+    if(start == index) return;
+
+    network net = *netp;
+    int i;
+    float *s = p->stats;
+    TRACE_BEGIN("recompute", "backward", index);
+    for(i = start; i < index; ++i){
+        layer l = net.layers[i];
+        size_t n = rolling_size(l);
+        if(!n) continue;
+        memcpy(s, l.rolling_mean, n*sizeof(float));
+        memcpy(s + n, l.rolling_variance, n*sizeof(float));
+        s += 2*n;
+    }
+    for(i = start; i < index; ++i){
+        layer l = net.layers[i];
+        net.index = i;
+        net.input = i ? net.layers[i-1].output : netp->input;
+        if(l.delta) fill_cpu(l.outputs*l.batch, 0, l.delta, 1);
+        l.forward(l, net);
+    }
+    s = p->stats;
+    for(i = start; i < index; ++i){
+        layer l = net.layers[i];
+        size_t n = rolling_size(l);
+        if(!n) continue;
+        memcpy(l.rolling_mean, s, n*sizeof(float));
+        memcpy(l.rolling_variance, s + n, n*sizeof(float));
+        s += 2*n;
+    }
+    TRACE_END();
+}
+
+/* Moves the recomputed layers' buffers in a memory breakdown into the pool. */
+void recompute_memory(network *net, int batch, size_t *bytes)
+{
+    recompute_plan *p = net->recompute;
+    memory_category categories[] = {MEMORY_OUTPUT, MEMORY_DELTA, MEMORY_BN_BUFFERS};
+    int k;
+    if(!p) return;
+    double scale = net->batch > 0 ? (double)batch/net->batch : 1;
+    for(k = 0; k < 3; ++k){
+        bytes[categories[k]] -= (size_t)(p->pooled_bytes[k]*scale);
+        bytes[categories[k]] += (size_t)(p->pool_bytes[k]*scale);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef RECOMPUTE_H
+#define RECOMPUTE_H
+#include "darknet.h"
+
+struct recompute_plan{
+    int *keep;          /* per layer: 1 if it keeps its own buffers */
+    int segments;
+    int recomputed;
+    float *pool;        /* buffers of the recomputed layers of one segment */
+    size_t pool_size;   /* floats */
+    size_t pool_bytes[3];   /* output, delta and batchnorm buffers in the largest segment */
+    size_t pooled_bytes[3]; /* the same for every recomputed layer */
+    float *stats;       /* rolling statistics saved across a recompute */
+    size_t stats_size;
+    double recompute_flops;
+    double train_flops;
+};
+
+void plan_recompute(network *net);
+void unplan_recompute(network *net);
+void free_recompute_plan(network *net);
+void print_recompute_plan(network *net, FILE *fp);
+void recompute_segment(network *net, int index);
+void recompute_memory(network *net, int batch, size_t *bytes);
+
+#endif
@@ -47,7 +47,7 @@ layer make_region_layer(int batch, int w, int h, int n, int classes, int coords)
     l.delta_gpu = cuda_make_array(l.delta, batch*l.outputs);
 #endif
 
-    fprintf(stderr, "detection\n");
+    if(!quiet_build) fprintf(stderr, "detection\n");
     srand(0);
 
     return l;
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "network.h"
+#include "parser.h"
+#include "memory_report.h"
+#include "utils.h"
+
+/* Keeps a bounded set of inference networks loaded, keyed by cfg and weight
+ * file.  Weights are mapped rather than read, so many variants of one cfg
+ * cost their activation buffers plus whatever weight pages are touched, and
+ * other processes mapping the same files share those pages.  Every holder
+ * gets a network of its own: the loaded one if it is free, otherwise an
+ * instance sharing its weights, kept for the next holder once released.
+ * The budget is counted from the memory report, weights and instances
+ * included, and when the loaded models go over it the least recently used
+ * ones that nobody holds are freed.  A model that is acquired is never
+ * evicted; if everything is in use the registry goes over budget rather than
+ * fail. */
+
+typedef struct registry_copy{
+    network *net;       /* the loaded network or an instance of it */
+    int busy;
+    struct registry_copy *next;
+} registry_copy;
+
+typedef struct registry_entry{
+    char *cfg;
+    char *weights;
+    network *net;
+    registry_copy *copies;
+    size_t bytes;
+    int refs;
+    int loading;
+    size_t last_used;
+    struct registry_entry *next;
+} registry_entry;
+
+struct model_registry{
+    size_t budget;
+    size_t bytes;
+    size_t tick;
+    registry_entry *entries;
+    pthread_mutex_t mutex;
+    pthread_cond_t loaded;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    double load_time;
+    double max_load_time;
+};
+
+model_registry *make_model_registry(size_t budget)
+{
+    model_registry *r = calloc(1, sizeof(model_registry));
+    r->budget = budget;
+    pthread_mutex_init(&r->mutex, 0);
+    pthread_cond_init(&r->loaded, 0);
+    return r;
+}
+
+static void unlink_entry(model_registry *r, registry_entry *e)
+{
+    registry_entry **p = &r->entries;
+    while(*p != e) p = &(*p)->next;
+    *p = e->next;
+}
+
+static void free_entry(registry_entry *e)
+{
+    while(e->copies){
+        registry_copy *c = e->copies;
+        e->copies = c->next;
+        if(c->net != e->net) free_network_instance(c->net);
+        free(c);
+    }
+    if(e->net) free_network(e->net);
+    free(e->cfg);
+    free(e->weights);
+    free(e);
+}
+
+/* Called with the mutex held.  Unlinks the victims and returns them so the
+ * caller can free them without blocking the other threads. */
+static registry_entry *evict(model_registry *r, size_t incoming)
+{
+    registry_entry *victims = 0;
+    while(r->bytes + incoming > r->budget){
+        registry_entry *e, *lru = 0;
+        for(e = r->entries; e; e = e->next){
+            if(e->refs || e->loading) continue;
+            if(!lru || e->last_used < lru->last_used) lru = e;
+        }
+        if(!lru) break;
+        unlink_entry(r, lru);
+        r->bytes -= lru->bytes;
+        ++r->evictions;
+        lru->next = victims;
+        victims = lru;
+    }
+    return victims;
+}
+
+static void free_victims(registry_entry *victims)
+{
+    while(victims){
+        registry_entry *next = victims->next;
+        free_entry(victims);
+        victims = next;
+    }
+}
+
+static registry_entry *find_entry(model_registry *r, char *cfg, char *weights)
+{
+    registry_entry *e;
+    for(e = r->entries; e; e = e->next){
+        if(0 == strcmp(e->cfg, cfg) && 0 == strcmp(e->weights, weights)) return e;
+    }
+    return 0;
+}
+
+/* What an instance of net allocates: everything inference needs except the
+ * weights and statistics it shares. */
+static size_t instance_bytes(network *net)
+{
+    size_t bytes[MEMORY_CATEGORIES] = {0};
+    size_t total = 0;
+    int c;
+    network_memory_categories(net, net->batch, bytes);
+    for(c = 0; c < MEMORY_CATEGORIES; ++c){
+        if(memory_for_inference(c) && c != MEMORY_WEIGHTS && c != MEMORY_BN_STATS) total += bytes[c];
+    }
+    return total;
+}
+
+/* Called with the mutex held and a reference on e.  Returns a free copy of
+ * e's network, or 0 if every copy is in use. */
+static network *take_copy(registry_entry *e)
+{
+    registry_copy *c;
+    for(c = e->copies; c; c = c->next){
+        if(c->busy) continue;
+        c->busy = 1;
+        return c->net;
+    }
+    return 0;
+}
+
+/* Returns a network for cfg and weights, loading it if needed.  The caller
+ * owns it until registry_release and must not resize or free it; no other
+ * holder gets the same network, so concurrent holders can run it at once.
+ * Threads asking for a model that is being loaded wait for that load. */
+network *registry_acquire(model_registry *r, char *cfg, char *weights)
+{
+    pthread_mutex_lock(&r->mutex);
+    registry_entry *e = find_entry(r, cfg, weights);
+    if(e){
+        ++r->hits;
+        ++e->refs;
+        while(e->loading) pthread_cond_wait(&r->loaded, &r->mutex);
+        e->last_used = ++r->tick;
+        network *net = take_copy(e);
+        pthread_mutex_unlock(&r->mutex);
+        if(net) return net;
+
+        // everything loaded is busy, and our reference keeps e from eviction
+        registry_copy *c = calloc(1, sizeof(registry_copy));
+        c->net = make_network_instance(e->net);
+        c->busy = 1;
+        size_t bytes = instance_bytes(e->net);
+        pthread_mutex_lock(&r->mutex);
+        c->next = e->copies;
+        e->copies = c;
+        e->bytes += bytes;
+        registry_entry *victims = evict(r, bytes);
+        r->bytes += bytes;
+        pthread_mutex_unlock(&r->mutex);
+        free_victims(victims);
+        return c->net;
+    }
+    ++r->misses;
+    e = calloc(1, sizeof(registry_entry));
+    e->cfg = copy_string(cfg);
+    e->weights = copy_string(weights);
+    e->refs = 1;
+    e->loading = 1;
+    e->next = r->entries;
+    r->entries = e;
+    pthread_mutex_unlock(&r->mutex);
+
+    double start = what_time_is_it_now();
+    // built at batch 1, and without random weights when they'll be mapped
+    network *net = parse_network_cfg_custom(cfg, 1, !weights[0]);
+    if(weights[0]) map_weights(net, weights);
+    double elapsed = what_time_is_it_now() - start;
+    size_t bytes = network_memory(net, net->batch, 0);
+    registry_copy *c = calloc(1, sizeof(registry_copy));
+    c->net = net;
+    c->busy = 1;
+
+    pthread_mutex_lock(&r->mutex);
+    e->net = net;
+    e->copies = c;
+    e->bytes = bytes;
+    e->loading = 0;
+    e->last_used = ++r->tick;
+    r->load_time += elapsed;
+    if(elapsed > r->max_load_time) r->max_load_time = elapsed;
+    registry_entry *victims = evict(r, bytes);
+    r->bytes += bytes;
+    pthread_cond_broadcast(&r->loaded);
+    pthread_mutex_unlock(&r->mutex);
+
+    free_victims(victims);
+    return net;
+}
+
+void registry_release(model_registry *r, network *net)
+{
+    registry_entry *e;
+    registry_copy *c = 0;
+    pthread_mutex_lock(&r->mutex);
+    for(e = r->entries; e; e = e->next){
+        for(c = e->copies; c; c = c->next){
+            if(c->net == net && c->busy) break;
+        }
+        if(c) break;
+    }
+    if(!c) error("Releasing a network the registry does not own");
+    c->busy = 0;
+    --e->refs;
+    registry_entry *victims = evict(r, 0);
+    pthread_mutex_unlock(&r->mutex);
+    free_victims(victims);
+}
+
+void print_registry_stats(model_registry *r, FILE *fp)
+{
+    int loaded = 0, used = 0;
+    registry_entry *e;
+    pthread_mutex_lock(&r->mutex);
+    for(e = r->entries; e; e = e->next){
+        ++loaded;
+        if(e->refs) ++used;
+    }
+    size_t lookups = r->hits + r->misses;
+    fprintf(fp, "Registry: %d models loaded (%d in use), %.1f of %.1f MB\n",
+            loaded, used, r->bytes/(1024.*1024.), r->budget/(1024.*1024.));
+    fprintf(fp, "%lu hits, %lu misses (%.1f%% hit rate), %lu evictions\n",
+            (unsigned long)r->hits, (unsigned long)r->misses,
+            lookups ? 100.*r->hits/lookups : 0, (unsigned long)r->evictions);
+    fprintf(fp, "Load time: average %.2f ms, max %.2f ms\n",
+            r->misses ? 1000*r->load_time/r->misses : 0, 1000*r->max_load_time);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/* Every network must have been released. */
+void free_model_registry(model_registry *r)
+{
+    while(r->entries){
+        registry_entry *e = r->entries;
+        if(e->refs) error("Freeing a registry with networks still in use");
+        r->entries = e->next;
+        free_entry(e);
+    }
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->loaded);
+    free(r);
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+#include "network.h"
+#include "profiler.h"
+#include "trace.h"
+#include "blas.h"
+#include "utils.h"
+
+/* Runs forward over the layer graph instead of the layer list.  Every layer
+ * reads the previous layer's output except route layers, which read only the
+ * layers they name, and shortcut layers, which also read one earlier layer.
+ * So a [route] that jumps back starts an independent branch, e.g. the second
+ * yolo head, and it can run next to whatever the first branch is doing.
+ *
+ * Each layer is a task that becomes ready when all of its inputs are done.
+ * The calling thread works the queue alongside threads-1 pool workers, and
+ * every worker has its own im2col workspace so two convolutions can run at
+ * once.  With OPENMP=1 each running layer still spreads its GEMM over the
+ * OpenMP team, so keep parallel_layers small there. */
+
+struct layer_scheduler{
+    int n;
+    int threads;
+    int *ndeps;
+    int *nconsumers;
+    int **consumers;
+
+    int *waiting;
+    int *ready;
+    int head;
+    int tail;
+    int done;
+    network *net;
+
+    size_t workspace_size;
+    float **workspaces;
+    pthread_t *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int quit;
+};
+
+typedef struct{
+    layer_scheduler *s;
+    int worker;
+} worker_args;
+
+static void add_dependency(layer_scheduler *s, network *net, int consumer, int producer)
+{
+    int k;
+    if(producer < 0 || producer >= consumer) return;
+    // dropout works in place, so reading a layer means waiting for the dropouts behind it
+    while(producer + 1 < consumer && net->layers[producer + 1].type == DROPOUT) ++producer;
+    for(k = 0; k < s->nconsumers[producer]; ++k){
+        if(s->consumers[producer][k] == consumer) return;
+    }
+    s->consumers[producer] = realloc(s->consumers[producer], (s->nconsumers[producer] + 1)*sizeof(int));
+    s->consumers[producer][s->nconsumers[producer]++] = consumer;
+    ++s->ndeps[consumer];
+}
+
+static void run_layer(layer_scheduler *s, int i, int worker)
+{
+    network net = *s->net;
+    layer l = net.layers[i];
+    net.index = i;
+    net.input = i ? net.layers[i-1].output : s->net->input;
+    if(worker) net.workspace = s->workspaces[worker];
+    if(l.delta){
+        fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
+    }
+    TRACE_BEGIN(get_layer_string(l.type), "forward", i);
+    double start = profile_start(net.prof);
+    l.forward(l, net);
+    profile_stop(net.prof, i, l, PROFILE_FORWARD, start);
+    TRACE_END();
+}
+
+/* Called with the mutex held. */
+static void complete_layer(layer_scheduler *s, int i)
+{
+    int k;
+    for(k = 0; k < s->nconsumers[i]; ++k){
+        int j = s->consumers[i][k];
+        if(--s->waiting[j] == 0) s->ready[s->tail++] = j;
+    }
+    ++s->done;
+    pthread_cond_broadcast(&s->cond);
+}
+
+static void *layer_worker(void *ptr)
+{
+    worker_args args = *(worker_args *)ptr;
+    free(ptr);
+    layer_scheduler *s = args.s;
+    pthread_mutex_lock(&s->mutex);
+    while(1){
+        while(!s->quit && s->head == s->tail) pthread_cond_wait(&s->cond, &s->mutex);
+        if(s->quit) break;
+        int i = s->ready[s->head++];
+        pthread_mutex_unlock(&s->mutex);
+        TRACE_THREAD_NAME("layer_worker");
+        run_layer(s, i, args.worker);
+        pthread_mutex_lock(&s->mutex);
+        complete_layer(s, i);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+layer_scheduler *make_layer_scheduler(network *net, int threads)
+{
+    int i, j;
+    layer_scheduler *s = calloc(1, sizeof(layer_scheduler));
+    s->n = net->n;
+    s->threads = threads;
+    s->ndeps = calloc(s->n, sizeof(int));
+    s->nconsumers = calloc(s->n, sizeof(int));
+    s->consumers = calloc(s->n, sizeof(int *));
+    s->waiting = calloc(s->n, sizeof(int));
+    s->ready = calloc(s->n, sizeof(int));
+    s->workspaces = calloc(threads, sizeof(float *));
+    s->workers = calloc(threads, sizeof(pthread_t));
+
+    int branches = 0;
+    for(i = 0; i < s->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j) add_dependency(s, net, i, l.input_layers[j]);
+            if(l.n && l.input_layers[0] != i-1) ++branches;
+        } else if(l.type == SHORTCUT){
+            add_dependency(s, net, i, i-1);
+            add_dependency(s, net, i, l.index);
+        } else {
+            add_dependency(s, net, i, i-1);
+        }
+    }
+    fprintf(stderr, "Layer scheduler: %d threads, %d branch points\n", threads, branches);
+
+    pthread_mutex_init(&s->mutex, 0);
+    pthread_cond_init(&s->cond, 0);
+    for(i = 1; i < threads; ++i){
+        worker_args *args = calloc(1, sizeof(worker_args));
+        args->s = s;
+        args->worker = i;
+        if(pthread_create(s->workers + i, 0, layer_worker, args)) error("Thread creation failed");
+    }
+    return s;
+}
+
+void free_layer_scheduler(layer_scheduler *s)
+{
+    if(!s) return;
+    int i;
+    pthread_mutex_lock(&s->mutex);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    for(i = 1; i < s->threads; ++i) pthread_join(s->workers[i], 0);
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    for(i = 0; i < s->n; ++i) free(s->consumers[i]);
+    for(i = 0; i < s->threads; ++i) free(s->workspaces[i]);
+    free(s->consumers);
+    free(s->nconsumers);
+    free(s->ndeps);
+    free(s->waiting);
+    free(s->ready);
+    free(s->workspaces);
+    free(s->workers);
+    free(s);
+}
+
+/* Layers can grow their workspace in resize_network, so check every pass. */
+static void size_workspaces(layer_scheduler *s, network *net)
+{
+    int i;
+    size_t size = 0;
+    for(i = 0; i < net->n; ++i){
+        if(net->layers[i].workspace_size > size) size = net->layers[i].workspace_size;
+    }
+    if(size <= s->workspace_size) return;
+    for(i = 1; i < s->threads; ++i){
+        free(s->workspaces[i]);
+        s->workspaces[i] = calloc(1, size);
+    }
+    s->workspace_size = size;
+}
+
+/* Returns 0 when the network has to run in order: a layer marked truth
+ * changes net.truth for everything after it, and hardware counters only
+ * follow the thread that opened them. */
+int schedule_forward(network *net)
+{
+    int i;
+    if(net->parallel_layers < 2) return 0;
+    // recomputed segments share buffers, so layers from two of them can't overlap
+    if(net->recompute) return 0;
+    if(net->prof && net->prof->group >= 0) return 0;
+    for(i = 0; i < net->n; ++i){
+        if(net->layers[i].truth) return 0;
+    }
+    layer_scheduler *s = net->sched;
+    if(s && (s->threads != net->parallel_layers || s->n != net->n)){
+        free_layer_scheduler(s);
+        s = 0;
+    }
+    if(!s) s = net->sched = make_layer_scheduler(net, net->parallel_layers);
+    size_workspaces(s, net);
+
+    pthread_mutex_lock(&s->mutex);
+    s->net = net;
+    s->head = s->tail = s->done = 0;
+    for(i = 0; i < s->n; ++i){
+        s->waiting[i] = s->ndeps[i];
+        if(!s->ndeps[i]) s->ready[s->tail++] = i;
+    }
+    pthread_cond_broadcast(&s->cond);
+    while(s->done < s->n){
+        if(s->head == s->tail){
+            pthread_cond_wait(&s->cond, &s->mutex);
+            continue;
+        }
+        int index = s->ready[s->head++];
+        pthread_mutex_unlock(&s->mutex);
+        run_layer(s, index, 0);
+        pthread_mutex_lock(&s->mutex);
+        complete_layer(s, index);
+    }
+    s->net = 0;
+    pthread_mutex_unlock(&s->mutex);
+    return 1;
+}
@@ -0,0 +1,9 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include "darknet.h"
+
+layer_scheduler *make_layer_scheduler(network *net, int threads);
+int schedule_forward(network *net);
+void free_layer_scheduler(layer_scheduler *s);
+
+#endif
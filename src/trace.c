@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "utils.h"
+
+/* Each thread appends to its own buffer, so recording never takes a lock.
+ * Buffers are linked into a global list with a CAS and are never freed: when
+ * a thread exits its buffer is marked dead and the next new thread (the data
+ * loader spawns dozens per batch) claims it instead of allocating another.
+ * start_trace only bumps a generation; each thread empties its own buffer the
+ * next time it records, and stop_trace skips buffers still on an old one. */
+
+#define TRACE_CHUNK 1024
+#define TRACE_DEPTH 64
+
+typedef struct{
+    const char *name;
+    const char *cat;
+    int arg;
+    double ts;
+    double dur;
+} trace_event;
+
+typedef struct trace_chunk{
+    trace_event events[TRACE_CHUNK];
+    struct trace_chunk *next;
+} trace_chunk;
+
+typedef struct trace_buffer{
+    int tid;
+    int alive;
+    int generation;
+    double origin;      /* trace_origin of that generation */
+    const char *thread_name;
+    size_t count;
+    trace_chunk *head;
+    trace_chunk *tail;
+    int depth;
+    trace_event stack[TRACE_DEPTH];
+    struct trace_buffer *next;
+} trace_buffer;
+
+int trace_enabled = 0;
+
+static trace_buffer *buffers = 0;
+static int next_tid = 0;
+static int trace_generation = 0;
+static char *trace_file = 0;
+static double trace_origin = 0;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_buffer *local_buffer = 0;
+
+static double trace_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec*1000000. + (double)now.tv_nsec*.001;
+}
+
+static void release_buffer(void *ptr)
+{
+    trace_buffer *b = (trace_buffer *)ptr;
+    __atomic_store_n(&b->alive, 0, __ATOMIC_RELEASE);
+}
+
+static void make_trace_key()
+{
+    pthread_key_create(&trace_key, release_buffer);
+}
+
+static trace_buffer *claim_buffer()
+{
+    pthread_once(&trace_key_once, make_trace_key);
+
+    trace_buffer *b;
+    for(b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b; b = b->next){
+        int dead = 0;
+        if(__atomic_compare_exchange_n(&b->alive, &dead, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) break;
+    }
+    if(!b){
+        b = calloc(1, sizeof(trace_buffer));
+        b->alive = 1;
+        b->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+        b->next = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+        while(!__atomic_compare_exchange_n(&buffers, &b->next, b, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    }
+    // the name was the previous owner's
+    b->thread_name = 0;
+    b->depth = 0;
+    pthread_setspecific(trace_key, b);
+    local_buffer = b;
+    return b;
+}
+
+static trace_buffer *thread_buffer()
+{
+    trace_buffer *b = local_buffer;
+    if(!b) b = claim_buffer();
+    int generation = __atomic_load_n(&trace_generation, __ATOMIC_ACQUIRE);
+    if(b->generation != generation){
+        // scopes still open from the last trace are dropped with its events
+        b->depth = 0;
+        b->tail = 0;
+        b->origin = trace_origin;
+        __atomic_store_n(&b->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->generation, generation, __ATOMIC_RELEASE);
+    }
+    return b;
+}
+
+static void append_event(trace_buffer *b, trace_event e)
+{
+    size_t slot = b->count % TRACE_CHUNK;
+    if(slot == 0){
+        trace_chunk *next = b->tail ? b->tail->next : b->head;
+        if(!next){
+            next = calloc(1, sizeof(trace_chunk));
+            if(b->tail) b->tail->next = next;
+            else b->head = next;
+        }
+        b->tail = next;
+    }
+    b->tail->events[slot] = e;
+    __atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+}
+
+void trace_thread_name(const char *name)
+{
+    thread_buffer()->thread_name = name;
+}
+
+void trace_begin(const char *name, const char *cat, int arg)
+{
+    trace_buffer *b = thread_buffer();
+    if(b->depth >= TRACE_DEPTH){
+        ++b->depth;
+        return;
+    }
+    trace_event *e = b->stack + b->depth++;
+    e->name = name;
+    e->cat = cat;
+    e->arg = arg;
+    e->ts = trace_clock();
+}
+
+void trace_end()
+{
+    trace_buffer *b = thread_buffer();
+    if(b->depth == 0) return;
+    if(--b->depth >= TRACE_DEPTH) return;
+    trace_event e = b->stack[b->depth];
+    e.dur = trace_clock() - e.ts;
+    e.ts -= b->origin;
+    append_event(b, e);
+}
+
+void start_trace(char *filename)
+{
+    free(trace_file);
+    trace_file = copy_string(filename);
+    trace_origin = trace_clock();
+    __atomic_add_fetch(&trace_generation, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "Tracing to %s\n", filename);
+}
+
+void stop_trace()
+{
+    if(!trace_enabled) return;
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+
+    FILE *fp = fopen(trace_file, "w");
+    if(!fp) file_error(trace_file);
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"darknet\"}}");
+    size_t total = 0;
+    int generation = __atomic_load_n(&trace_generation, __ATOMIC_ACQUIRE);
+    trace_buffer *b;
+    for(b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b; b = b->next){
+        // threads that recorded nothing since start_trace still hold the last trace
+        if(__atomic_load_n(&b->generation, __ATOMIC_ACQUIRE) != generation) continue;
+        size_t count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+        if(!count) continue;
+        if(b->thread_name){
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", b->tid, b->thread_name);
+        }
+        size_t i;
+        trace_chunk *c = b->head;
+        for(i = 0; i < count; ++i){
+            if(i && i % TRACE_CHUNK == 0) c = c->next;
+            trace_event e = c->events[i % TRACE_CHUNK];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+                    e.name, e.cat, e.ts, e.dur, b->tid);
+            if(e.arg >= 0) fprintf(fp, ",\"args\":{\"layer\":%d}", e.arg);
+            fprintf(fp, "}");
+        }
+        total += count;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    fprintf(stderr, "Wrote %lu trace events to %s\n", (unsigned long)total, trace_file);
+}
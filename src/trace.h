@@ -0,0 +1,11 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include "darknet.h"
+
+/* Scoped timeline events.  Every begin must be matched by an end on the same
+ * thread; when tracing is off both macros cost a single load and branch. */
+#define TRACE_BEGIN(name, cat, arg) do{ if(trace_enabled) trace_begin(name, cat, arg); }while(0)
+#define TRACE_END() do{ if(trace_enabled) trace_end(); }while(0)
+#define TRACE_THREAD_NAME(name) do{ if(trace_enabled) trace_thread_name(name); }while(0)
+
+#endif
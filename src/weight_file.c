@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "weight_file.h"
+#include "convolutional_layer.h"
+#include "connected_layer.h"
+#include "batchnorm_layer.h"
+#include "local_layer.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Indexed weight container.  The file is a header, a table with one entry
+ * per array (layer, role, shape, offset, length) and the arrays themselves,
+ * each starting on a 64 byte boundary and stored exactly as they sit in
+ * memory.  Loading is a lookup per array, so any range of layers can be read
+ * on its own, and mapping the file gives usable arrays with no copying at
+ * all.  Both checksums are 64 bit FNV-1a; the table's is checked on every
+ * open, the data's only by verify_weight_file since it reads every page. */
+
+typedef struct{
+    layer *owner;
+    float **data;
+    weight_tensor t;
+} tensor_ref;
+
+typedef struct{
+    tensor_ref *refs;
+    int n;
+    int size;
+} tensor_list;
+
+static void add_tensor(tensor_list *list, layer *owner, int index, int sub, tensor_role role, float **data,
+        int a, int b, int c, int d)
+{
+    if(list->n == list->size){
+        list->size = list->size ? 2*list->size : 64;
+        list->refs = realloc(list->refs, list->size*sizeof(tensor_ref));
+    }
+    tensor_ref *r = list->refs + list->n++;
+    memset(r, 0, sizeof(tensor_ref));
+    r->owner = owner;
+    r->data = data;
+    r->t.layer = index;
+    r->t.sublayer = sub;
+    r->t.role = role;
+    r->t.type = owner->type;
+    r->t.dtype = TENSOR_FLOAT32;
+    r->t.shape[0] = a;
+    r->t.shape[1] = b;
+    r->t.shape[2] = c;
+    r->t.shape[3] = d;
+    r->t.length = (uint64_t)a*b*c*d*sizeof(float);
+}
+
+static void add_normalization(tensor_list *list, layer *l, int index, int sub, int n)
+{
+    add_tensor(list, l, index, sub, TENSOR_SCALES, &l->scales, n, 1, 1, 1);
+    add_tensor(list, l, index, sub, TENSOR_ROLLING_MEAN, &l->rolling_mean, n, 1, 1, 1);
+    add_tensor(list, l, index, sub, TENSOR_ROLLING_VARIANCE, &l->rolling_variance, n, 1, 1, 1);
+}
+
+static void add_convolutional(tensor_list *list, layer *l, int index, int sub)
+{
+    add_tensor(list, l, index, sub, TENSOR_BIASES, &l->biases, l->n, 1, 1, 1);
+    if(l->batch_normalize) add_normalization(list, l, index, sub, l->n);
+    add_tensor(list, l, index, sub, TENSOR_WEIGHTS, &l->weights, l->n, l->nweights/(l->n*l->size*l->size), l->size, l->size);
+}
+
+static void add_connected(tensor_list *list, layer *l, int index, int sub)
+{
+    add_tensor(list, l, index, sub, TENSOR_BIASES, &l->biases, l->outputs, 1, 1, 1);
+    add_tensor(list, l, index, sub, TENSOR_WEIGHTS, &l->weights, l->outputs, l->inputs, 1, 1);
+    if(l->batch_normalize) add_normalization(list, l, index, sub, l->outputs);
+}
+
+/* Every array load_weights knows about, in legacy save order. */
+static tensor_list network_tensors(network *net)
+{
+    tensor_list list = {0};
+    int i, k;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL || l->type == DILATED_CONVOLUTIONAL){
+            add_convolutional(&list, l, i, -1);
+        } else if(l->type == CONNECTED){
+            add_connected(&list, l, i, -1);
+        } else if(l->type == BATCHNORM){
+            add_normalization(&list, l, i, -1, l->c);
+        } else if(l->type == CRNN){
+            layer *subs[] = {l->input_layer, l->self_layer, l->output_layer};
+            for(k = 0; k < 3; ++k) add_convolutional(&list, subs[k], i, k);
+        } else if(l->type == RNN){
+            layer *subs[] = {l->input_layer, l->self_layer, l->output_layer};
+            for(k = 0; k < 3; ++k) add_connected(&list, subs[k], i, k);
+        } else if(l->type == LSTM){
+            layer *subs[] = {l->wi, l->wf, l->wo, l->wg, l->ui, l->uf, l->uo, l->ug};
+            for(k = 0; k < 8; ++k) add_connected(&list, subs[k], i, k);
+        } else if(l->type == GRU){
+            layer *subs[] = {l->wz, l->wr, l->wh, l->uz, l->ur, l->uh};
+            for(k = 0; k < 6; ++k) add_connected(&list, subs[k], i, k);
+        } else if(l->type == LOCAL){
+            int locations = l->out_w*l->out_h;
+            add_tensor(&list, l, i, -1, TENSOR_BIASES, &l->biases, l->outputs, 1, 1, 1);
+            add_tensor(&list, l, i, -1, TENSOR_WEIGHTS, &l->weights, locations, l->n, l->c, l->size*l->size);
+        }
+    }
+    return list;
+}
+
+static uint64_t fnv1a(uint64_t hash, void *data, size_t n)
+{
+    unsigned char *p = data;
+    size_t i;
+    for(i = 0; i < n; ++i){
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + WEIGHT_FILE_ALIGN - 1) / WEIGHT_FILE_ALIGN * WEIGHT_FILE_ALIGN;
+}
+
+#ifdef GPU
+static void sync_tensor_owner(layer *l, int push)
+{
+    if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL || l->type == DILATED_CONVOLUTIONAL){
+        if(push) push_convolutional_layer(*l);
+        else pull_convolutional_layer(*l);
+    } else if(l->type == CONNECTED){
+        if(push) push_connected_layer(*l);
+        else pull_connected_layer(*l);
+    } else if(l->type == BATCHNORM){
+        if(push) push_batchnorm_layer(*l);
+        else pull_batchnorm_layer(*l);
+    } else if(l->type == LOCAL){
+        if(push) push_local_layer(*l);
+        else pull_local_layer(*l);
+    }
+}
+
+static void sync_tensors(network *net, tensor_list list, int start, int cutoff, int push)
+{
+    int i;
+    if(net->gpu_index < 0) return;
+    cuda_set_device(net->gpu_index);
+    for(i = 0; i < list.n; ++i){
+        if(list.refs[i].t.layer < start || list.refs[i].t.layer >= cutoff) continue;
+        if(i && list.refs[i].owner == list.refs[i-1].owner) continue;
+        sync_tensor_owner(list.refs[i].owner, push);
+    }
+}
+#endif
+
+/* Writes the container at fp's position; offsets in the table are relative
+ * to that position, which has to be 64 byte aligned within the file. */
+void write_weight_file(network *net, FILE *fp)
+{
+    int i;
+    tensor_list all = network_tensors(net);
+#ifdef GPU
+    sync_tensors(net, all, 0, net->n, 0);
+#endif
+    tensor_list list = {0};
+    list.refs = calloc(all.n ? all.n : 1, sizeof(tensor_ref));
+    for(i = 0; i < all.n; ++i){
+        if(!net->layers[all.refs[i].t.layer].dontsave) list.refs[list.n++] = all.refs[i];
+    }
+    free(all.refs);
+
+    weight_tensor *table = calloc(list.n ? list.n : 1, sizeof(weight_tensor));
+    uint64_t offset = align_offset(sizeof(weight_file_header) + list.n*sizeof(weight_tensor));
+    weight_file_header header = {0};
+    header.magic = WEIGHT_FILE_MAGIC;
+    header.version = WEIGHT_FILE_VERSION;
+    header.seen = *net->seen;
+    header.count = list.n;
+    header.layers = net->n;
+    header.data_checksum = FNV_OFFSET;
+    for(i = 0; i < list.n; ++i){
+        table[i] = list.refs[i].t;
+        table[i].offset = offset;
+        offset = align_offset(offset + table[i].length);
+        header.data_checksum = fnv1a(header.data_checksum, *list.refs[i].data, table[i].length);
+    }
+    header.table_checksum = fnv1a(FNV_OFFSET, table, list.n*sizeof(weight_tensor));
+
+    static const char zeros[WEIGHT_FILE_ALIGN] = {0};
+    long start = ftell(fp);
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(table, sizeof(weight_tensor), list.n, fp);
+    for(i = 0; i < list.n; ++i){
+        long pad = start + table[i].offset - ftell(fp);
+        fwrite(zeros, 1, pad, fp);
+        fwrite(*list.refs[i].data, 1, table[i].length, fp);
+    }
+    free(table);
+    free(list.refs);
+}
+
+void save_weight_file(network *net, char *filename)
+{
+    fprintf(stderr, "Saving weights to %s\n", filename);
+    TRACE_BEGIN("save_weight_file", "io", -1);
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+    write_weight_file(net, fp);
+    if(fclose(fp)) file_error(filename);
+    TRACE_END();
+}
+
+int is_weight_file(char *filename)
+{
+    uint32_t magic = 0;
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    int found = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == WEIGHT_FILE_MAGIC;
+    fclose(fp);
+    return found;
+}
+
+/* Checks the header and table of a container of size bytes at base. */
+void check_weight_container(char *base, size_t size)
+{
+    if(size < sizeof(weight_file_header)) error("Weight file is truncated");
+    weight_file_header *header = (weight_file_header *)base;
+    if(header->magic != WEIGHT_FILE_MAGIC) error("Not an indexed weight file");
+    if(header->version != WEIGHT_FILE_VERSION) error("Unsupported weight file version");
+    size_t table_size = (size_t)header->count*sizeof(weight_tensor);
+    if(sizeof(weight_file_header) + table_size > size) error("Weight file table is truncated");
+    weight_tensor *table = (weight_tensor *)(base + sizeof(weight_file_header));
+    if(fnv1a(FNV_OFFSET, table, table_size) != header->table_checksum) error("Weight file table is corrupt");
+    uint32_t i;
+    for(i = 0; i < header->count; ++i){
+        if(table[i].offset % WEIGHT_FILE_ALIGN || table[i].offset + table[i].length > size){
+            error("Weight file tensor lies outside the file");
+        }
+    }
+}
+
+/* Maps the file privately and checks the header and table. */
+static char *open_weight_file(char *filename, size_t *size)
+{
+    char *base = map_file(filename, size);
+    check_weight_container(base, *size);
+    return base;
+}
+
+static weight_tensor *find_tensor(weight_file_header *header, weight_tensor t, uint32_t *hint)
+{
+    weight_tensor *table = (weight_tensor *)(header + 1);
+    uint32_t k;
+    // tensors come in save order, so the next entry is almost always the one
+    for(k = 0; k < header->count; ++k){
+        weight_tensor *e = table + (*hint + k) % header->count;
+        if(e->layer == t.layer && e->sublayer == t.sublayer && e->role == t.role){
+            *hint = (*hint + k + 1) % header->count;
+            return e;
+        }
+    }
+    return 0;
+}
+
+/* Private, writable mapping of a whole file. */
+char *map_file(char *filename, size_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) file_error(filename);
+    struct stat st;
+    if(fstat(fd, &st) < 0) file_error(filename);
+    *size = st.st_size;
+    char *base = mmap(0, *size ? *size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) file_error(filename);
+    return base;
+}
+
+/* Points layers start to cutoff at the arrays of the checked container at
+ * base, or copies them when copy is set. */
+void read_weight_container(network *net, char *base, int start, int cutoff, int copy)
+{
+    weight_file_header *header = (weight_file_header *)base;
+    *net->seen = header->seen;
+
+    tensor_list list = network_tensors(net);
+    uint32_t hint = 0;
+    int i;
+    for(i = 0; i < list.n; ++i){
+        tensor_ref r = list.refs[i];
+        if(r.t.layer < start || r.t.layer >= cutoff) continue;
+        if(net->layers[r.t.layer].dontload) continue;
+        if(r.t.role != TENSOR_BIASES && r.t.role != TENSOR_WEIGHTS && r.owner->dontloadscales) continue;
+        weight_tensor *e = find_tensor(header, r.t, &hint);
+        if(!e){
+            fprintf(stderr, "Layer %d has no %s tensor %d\n", r.t.layer, get_layer_string(r.t.type), r.t.role);
+            error("Weight file does not match the network");
+        }
+        if(e->type != r.t.type || e->dtype != TENSOR_FLOAT32 || e->length != r.t.length){
+            fprintf(stderr, "Layer %d tensor %d: file has %d x %d x %d x %d, network wants %d x %d x %d x %d\n",
+                    r.t.layer, r.t.role, e->shape[0], e->shape[1], e->shape[2], e->shape[3],
+                    r.t.shape[0], r.t.shape[1], r.t.shape[2], r.t.shape[3]);
+            error("Weight file does not match the network");
+        }
+        if(copy){
+            memcpy(*r.data, base + e->offset, e->length);
+        } else {
+            free(*r.data);
+            *r.data = (float *)(base + e->offset);
+        }
+    }
+#ifdef GPU
+    if(copy) sync_tensors(net, list, start, cutoff, 1);
+#endif
+    free(list.refs);
+}
+
+void load_weight_file_upto(network *net, char *filename, int start, int cutoff)
+{
+    size_t size;
+    fprintf(stderr, "Loading weights from %s...", filename);
+    TRACE_BEGIN("load_weight_file", "io", -1);
+    char *base = open_weight_file(filename, &size);
+    read_weight_container(net, base, start, cutoff, 1);
+    munmap(base, size);
+    TRACE_END();
+    fprintf(stderr, "Done!\n");
+}
+
+/* Inference networks can run straight out of the page cache.  GPU networks
+ * copy, since their weights live on the device anyway. */
+void map_weight_file(network *net, char *filename)
+{
+#ifdef GPU
+    if(net->gpu_index >= 0){
+        load_weight_file_upto(net, filename, 0, net->n);
+        return;
+    }
+#endif
+    if(net->weights_map) error("Network already has mapped weights");
+    if(net->arena) error("Can't map weights into a network packed for training");
+    fprintf(stderr, "Mapping weights from %s...", filename);
+    net->weights_map = open_weight_file(filename, &net->weights_map_size);
+    read_weight_container(net, net->weights_map, 0, net->n, 0);
+    fprintf(stderr, "Done!\n");
+}
+
+int verify_weight_file(char *filename)
+{
+    size_t size;
+    uint32_t i;
+    char *base = open_weight_file(filename, &size);
+    weight_file_header *header = (weight_file_header *)base;
+    weight_tensor *table = (weight_tensor *)(header + 1);
+    uint64_t checksum = FNV_OFFSET;
+    for(i = 0; i < header->count; ++i){
+        checksum = fnv1a(checksum, base + table[i].offset, table[i].length);
+    }
+    int ok = (checksum == header->data_checksum);
+    fprintf(stderr, "%s: %u tensors over %u layers, seen %lu, data checksum %s\n", filename,
+            header->count, header->layers, (unsigned long)header->seen, ok ? "ok" : "MISMATCH");
+    munmap(base, size);
+    return ok;
+}
@@ -0,0 +1,48 @@
+#ifndef WEIGHT_FILE_H
+#define WEIGHT_FILE_H
+#include <stdint.h>
+#include "darknet.h"
+
+#define WEIGHT_FILE_MAGIC 0x54574b44  /* "DKWT" */
+#define WEIGHT_FILE_VERSION 1
+#define WEIGHT_FILE_ALIGN 64
+
+typedef enum{
+    TENSOR_BIASES, TENSOR_SCALES, TENSOR_ROLLING_MEAN, TENSOR_ROLLING_VARIANCE, TENSOR_WEIGHTS
+} tensor_role;
+
+typedef enum{
+    TENSOR_FLOAT32
+} tensor_dtype;
+
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seen;
+    uint32_t count;
+    uint32_t layers;
+    uint64_t table_checksum;
+    uint64_t data_checksum;
+    uint64_t reserved;
+} weight_file_header;
+
+/* One entry per array.  sublayer is -1 for the layer itself, otherwise the
+ * position of a recurrent layer's inner layer in legacy save order. */
+typedef struct{
+    int32_t layer;
+    int16_t sublayer;
+    int16_t role;
+    int32_t type;
+    int32_t dtype;
+    int32_t shape[4];
+    uint64_t offset;
+    uint64_t length;
+} weight_tensor;
+
+void load_weight_file_upto(network *net, char *filename, int start, int cutoff);
+void write_weight_file(network *net, FILE *fp);
+void check_weight_container(char *base, size_t size);
+void read_weight_container(network *net, char *base, int start, int cutoff, int copy);
+char *map_file(char *filename, size_t *size);
+
+#endif
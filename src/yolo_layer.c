@@ -54,7 +54,7 @@ layer make_yolo_layer(int batch, int w, int h, int n, int total, int *mask, int
     l.delta_gpu = cuda_make_array(l.delta, batch*l.outputs);
 #endif
 
-    fprintf(stderr, "yolo\n");
+    if(!quiet_build) fprintf(stderr, "yolo\n");
     srand(0);
 
     return l;
@@ -138,6 +138,12 @@ void forward_yolo_layer(const layer l, network net)
     for (b = 0; b < l.batch; ++b){
         for(n = 0; n < l.n; ++n){
             int index = entry_index(l, b, n*l.w*l.h, 0);
+            if(!net.train && net.fused_decode){
+                // decode_yolo_detections finishes the cells that pass the threshold
+                index = entry_index(l, b, n*l.w*l.h, 4);
+                activate_array(l.output + index, l.w*l.h, LOGISTIC);
+                continue;
+            }
             activate_array(l.output + index, 2*l.w*l.h, LOGISTIC);
             index = entry_index(l, b, n*l.w*l.h, 4);
             activate_array(l.output + index, (1+l.classes)*l.w*l.h, LOGISTIC);
@@ -342,6 +348,76 @@ int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh,
     return count;
 }
 
+/* Whether the last forward left box and class logits for
+ * decode_yolo_detections.  GPU builds always activate everything. */
+int yolo_fused_output(network *net)
+{
+#ifdef GPU
+    return 0;
+#else
+    return net->fused_decode && !net->train;
+#endif
+}
+
+static void finish_yolo_activation(layer l)
+{
+    int b, n;
+    for(b = 0; b < l.batch; ++b){
+        for(n = 0; n < l.n; ++n){
+            activate_array(l.output + entry_index(l, b, n*l.w*l.h, 0), 2*l.w*l.h, LOGISTIC);
+            activate_array(l.output + entry_index(l, b, n*l.w*l.h, 5), l.classes*l.w*l.h, LOGISTIC);
+        }
+    }
+}
+
+/* get_yolo_detections for an output with only objectness activated: the
+ * box offsets and class scores of a cell are squashed only once it passes
+ * the threshold, straight into dets.  The output is left as it is, so boxes
+ * can be read again at another threshold.  Scores squashed one at a time
+ * can differ from activate_array's vector loop in the last bit, so boxes
+ * and scores match get_yolo_detections only within float rounding. */
+int decode_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets)
+{
+    int i, j, n;
+    float *predictions = l.output;
+    int stride = l.w*l.h;
+    if(l.batch == 2){
+        // the flipped pair is squashed and averaged in a copy, as before
+        layer t = l;
+        t.output = calloc(l.batch*l.outputs, sizeof(float));
+        memcpy(t.output, l.output, l.batch*l.outputs*sizeof(float));
+        finish_yolo_activation(t);
+        int count = get_yolo_detections(t, w, h, netw, neth, thresh, map, relative, dets);
+        free(t.output);
+        return count;
+    }
+    int count = 0;
+    for (i = 0; i < l.w*l.h; ++i){
+        int row = i / l.w;
+        int col = i % l.w;
+        for(n = 0; n < l.n; ++n){
+            float objectness = predictions[entry_index(l, 0, n*l.w*l.h + i, 4)];
+            if(objectness <= thresh) continue;
+            float *x = predictions + entry_index(l, 0, n*l.w*l.h + i, 0);
+            float *biases = l.biases + 2*l.mask[n];
+            detection *d = dets + count;
+            d->bbox.x = (col + fast_logistic(x[0])) / l.w;
+            d->bbox.y = (row + fast_logistic(x[stride])) / l.h;
+            d->bbox.w = exp(x[2*stride]) * biases[0] / netw;
+            d->bbox.h = exp(x[3*stride]) * biases[1] / neth;
+            d->objectness = objectness;
+            d->classes = l.classes;
+            for(j = 0; j < l.classes; ++j){
+                float prob = objectness*fast_logistic(x[(5 + j)*stride]);
+                d->prob[j] = (prob > thresh) ? prob : 0;
+            }
+            ++count;
+        }
+    }
+    correct_yolo_boxes(dets, count, w, h, netw, neth, relative);
+    return count;
+}
+
 #ifdef GPU
 
 void forward_yolo_layer_gpu(const layer l, network net)